@@ -1,6 +1,45 @@
 
 #include "fs.h"
 
+struct FsStats fs_stats;
+
+// The dirty set: one bit per disk block, set when the cached copy of
+// the block may differ from the disk.  Write paths add blocks to it
+// with bc_mark_dirty; writes it did not hear about, such as plain
+// stores into mapped pages, are picked up from the PTE_D bits of the
+// pages by bc_flush_range.  Keeping it as a bitmap means it is always
+// sorted by block number, so neighbouring dirty blocks can be written
+// with one disk command.
+static uint32_t bc_dirty[DISKSIZE / BLKSIZE / 32];
+
+// The held set: blocks the journal has logged, or is about to, whose
+// new contents must not reach their place on disk before the journal
+// checkpoints them (see journal.c).  Held blocks are dirty but are
+// neither flushed nor evicted.
+static uint32_t bc_held[DISKSIZE / BLKSIZE / 32];
+
+// Cache budget.  Once more than bc_budget blocks are mapped, reading in
+// a block first evicts others, chosen by a clock sweep over DISKMAP:
+// a block whose page was accessed since the hand last passed (PTE_A)
+// gets a second chance, any other one is written back if dirty and
+// unmapped.
+static uint32_t bc_budget = BC_DEFAULT_BUDGET;
+static uint32_t bc_resident;	// number of blocks mapped
+static uint32_t bc_hand = 1;	// next block the clock looks at
+
+// Blocks are read into staging pages, one area per thread plus one for
+// the main loop, and moved into DISKMAP only once the disk is done
+// with them.  A block that is being read is therefore never mapped,
+// and threads that touch it meanwhile fault and wait for the read
+// (see bc_busy) instead of seeing a half-filled page.
+#define BCSTAGE(t)	(0x08000000 + (t) * BC_MAXBATCH * BC_MAXRUN * BLKSIZE)
+
+// The batch each thread (and, last, the main loop) is reading
+static struct {
+	struct DiskReq *b_reqs;
+	int b_n;
+} bc_busy[NFSTHREAD + 1];
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -28,14 +67,142 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+static void bc_evict(uint32_t nblocks);
+
+// Is block 'blockno' being read from disk by some thread?
+static bool
+bc_in_flight(uint32_t blockno)
+{
+	uint32_t secno = blockno * BLKSECTS;
+	int t, k;
+
+	for (t = 0; t <= NFSTHREAD; t++)
+		for (k = 0; k < bc_busy[t].b_n; k++)
+			if (secno >= bc_busy[t].b_reqs[k].dr_secno
+			    && secno < bc_busy[t].b_reqs[k].dr_secno
+			       + bc_busy[t].b_reqs[k].dr_nsecs)
+				return 1;
+	return 0;
+}
+
+// Read the blocks named by the 'n' requests in 'reqs', none of which
+// may be cached or being read yet, into the block cache.  The requests
+// go to the disk as one batch.  Other threads may run while the disk
+// works; blocks they cached in the meantime are left as they are.
+static void
+bc_read_batch(struct DiskReq *reqs, int n)
+{
+	struct DiskReq stage[BC_MAXBATCH];
+	uint32_t nblocks, nb, i, j;
+	int t, k, r;
+	char *buf, *addr;
+
+	assert(n <= BC_MAXBATCH);
+	for (nblocks = 0, k = 0; k < n; k++)
+		nblocks += reqs[k].dr_nsecs / BLKSECTS;
+	t = thread_current() < 0 ? NFSTHREAD : thread_current();
+	bc_busy[t].b_reqs = reqs;
+	bc_busy[t].b_n = n;
+	bc_evict(nblocks);
+	bc_resident += nblocks;
+
+	buf = (char *) BCSTAGE(t);
+	for (k = 0; k < n; k++) {
+		stage[k] = reqs[k];
+		stage[k].dr_buf = buf;
+		for (i = 0; i < reqs[k].dr_nsecs / BLKSECTS; i++, buf += BLKSIZE)
+			if ((r = sys_page_alloc(0, buf, PTE_W | PTE_P | PTE_U)) < 0)
+				panic("bc_read_batch: sys_page_alloc: %i", r);
+	}
+	if ((r = disk_submit(stage, n)) < 0)
+		panic("bc_read_batch: disk_submit: %i", r);
+
+	// Move the blocks into place, each run of blocks that were not
+	// cached meanwhile with one system call.  The new mappings start
+	// out clean.
+	for (k = 0; k < n; k++) {
+		buf = stage[k].dr_buf;
+		addr = reqs[k].dr_buf;
+		nb = reqs[k].dr_nsecs / BLKSECTS;
+		for (i = 0; i < nb; i = j) {
+			if (va_is_mapped(addr + i * BLKSIZE)) {
+				bc_resident--;
+				if ((r = sys_page_unmap(0, buf + i * BLKSIZE)) < 0)
+					panic("bc_read_batch: sys_page_unmap: %i", r);
+				j = i + 1;
+				continue;
+			}
+			for (j = i + 1; j < nb && !va_is_mapped(addr + j * BLKSIZE); j++)
+				/* do nothing */;
+			if ((r = sys_page_move(buf + i * BLKSIZE, addr + i * BLKSIZE,
+					       j - i, PTE_W | PTE_P | PTE_U)) < 0)
+				panic("bc_read_batch: sys_page_move: %i", r);
+		}
+	}
+	bc_busy[t].b_n = 0;
+	thread_wakeup(bc_busy);
+}
+
+// Fill in *req to transfer the 'nblocks' cached blocks starting at
+// 'blockno'.
+static void
+bc_req(struct DiskReq *req, uint32_t blockno, uint32_t nblocks, bool write)
+{
+	req->dr_secno = blockno * BLKSECTS;
+	req->dr_buf = (void *) (DISKMAP + blockno * BLKSIZE);
+	req->dr_nsecs = nblocks * BLKSECTS;
+	req->dr_write = write;
+}
+
+// Read blocks 'blockno' through 'blockno + nblocks - 1' into the block
+// cache ahead of use, skipping blocks that are cached already.  Each
+// run of missing blocks is read with one disk command, and up to
+// BC_MAXBATCH runs are handed to the disk together.
+// Returns the number of blocks read.
+int
+bc_prefetch(uint32_t blockno, uint32_t nblocks)
+{
+	struct DiskReq reqs[BC_MAXBATCH];
+	uint32_t end, n, nread;
+	int nreq;
+
+	end = blockno + nblocks;
+	if (super)
+		end = MIN(end, super->s_nblocks);
+	for (nread = 0; blockno < end; ) {
+		for (nreq = 0; blockno < end && nreq < BC_MAXBATCH; blockno += n) {
+			if (va_is_mapped(diskaddr(blockno)) || bc_in_flight(blockno)) {
+				n = 1;
+				continue;
+			}
+			for (n = 1; n < BC_MAXRUN && blockno + n < end
+				     && !va_is_mapped(diskaddr(blockno + n))
+				     && !bc_in_flight(blockno + n); n++)
+				/* do nothing */;
+			bc_req(&reqs[nreq++], blockno, n, 0);
+			nread += n;
+		}
+		if (nreq > 0)
+			bc_read_batch(reqs, nreq);
+		fs_stats.fs_bc_prefetch_ios += nreq;
+	}
+	fs_stats.fs_bc_prefetched += nread;
+	return nread;
+}
+
+// bcentry.S
+void bc_fault_upcall(void);
+
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk.  The disk is not waited for here, on the
+// exception stack, but in bc_fault_load on the stack of the thread
+// that faulted.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
+	uintptr_t sp;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -46,24 +213,37 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x out of %08x\n", blockno, super->s_nblocks);
 
-	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	// Hint: first round addr to page boundary. fs/ide.c has code to read
-	// the disk.
-	//
-	// LAB 10: you code here:
-	addr = ROUNDDOWN(addr, PGSIZE);
-	if ((r = sys_page_alloc(0, addr, PTE_W | PTE_P | PTE_U)) < 0) {
-		panic("bc_pgfault: sys_page_alloc: %i", r);
-    }
-	if ((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {
-		panic("bc_pgfault: ide_read: %i", r);
-	}
+	// Return to bc_fault_upcall on the faulting stack, with a copy
+	// of the trap frame below a blank word for its return address.
+	sp = utf->utf_esp - 4 - sizeof(struct UTrapframe);
+	memmove((void *) sp, utf, sizeof(struct UTrapframe));
+	utf->utf_esp = sp;
+	utf->utf_eip = (uintptr_t) bc_fault_upcall;
+}
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %i", r);
+// Bring the block whose fault is described by 'utf' into the cache,
+// waiting for another thread's read of it if there is one.  Called by
+// bc_fault_upcall.
+void
+bc_fault_load(struct UTrapframe *utf)
+{
+	void *addr = (void *) ROUNDDOWN(utf->utf_fault_va, BLKSIZE);
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	struct DiskReq req;
+
+	// Blocks can be evicted again before we get to run, so check
+	// until the block is there.
+	while (!va_is_mapped(addr)) {
+		if (bc_in_flight(blockno)) {
+			thread_wait(bc_busy);
+			continue;
+		}
+		// Allocate a page in the disk map region, read the
+		// contents of the block from the disk into that page.
+		bc_req(&req, blockno, 1, 0);
+		bc_read_batch(&req, 1);
+		fs_stats.fs_bc_misses++;
+	}
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -72,13 +252,175 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Add block 'blockno', which must be in the cache, to the dirty set.
+void
+bc_mark_dirty(uint32_t blockno)
+{
+	bc_dirty[blockno / 32] |= 1U << (blockno % 32);
+}
+
+static bool
+bc_is_dirty(uint32_t blockno)
+{
+	return (bc_dirty[blockno / 32] & (1U << (blockno % 32))) != 0;
+}
+
+// Is cached block 'blockno' changed from what is on disk?
+bool
+bc_block_dirty(uint32_t blockno)
+{
+	void *addr = (void *) (DISKMAP + blockno * BLKSIZE);
+
+	return va_is_mapped(addr) && (va_is_dirty(addr) || bc_is_dirty(blockno));
+}
+
+// Add block 'blockno', which must be in the cache, to the held set and
+// the dirty set, and clear the PTE_D bit of its page, so that later
+// changes to it show up there again.
+void
+bc_hold(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	bc_held[blockno / 32] |= 1U << (blockno % 32);
+	bc_mark_dirty(blockno);
+	if (va_is_dirty(addr)
+	    && (r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+		panic("bc_hold: sys_page_map: %i", r);
+}
+
+// Take block 'blockno' out of the held set.  It stays dirty, to be
+// written out by the next flush that covers it.
+void
+bc_release(uint32_t blockno)
+{
+	bc_held[blockno / 32] &= ~(1U << (blockno % 32));
+}
+
+// Is block 'blockno' in the held set?
+bool
+bc_is_held(uint32_t blockno)
+{
+	return (bc_held[blockno / 32] & (1U << (blockno % 32))) != 0;
+}
+
+// Write the cached blocks named by the 'n' requests in 'reqs' to disk
+// as one batch, then clear their PTE_D bits and dirty set bits.  Blocks
+// that the journal took hold of while the disk worked stay dirty.
+static void
+bc_write_batch(struct DiskReq *reqs, int n)
+{
+	uint32_t blockno, i;
+	void *addr;
+	int k, r;
+
+	if ((r = disk_submit(reqs, n)) < 0)
+		panic("bc_write_batch: disk_submit: %i", r);
+	for (k = 0; k < n; k++) {
+		blockno = reqs[k].dr_secno / BLKSECTS;
+		addr = reqs[k].dr_buf;
+		for (i = 0; i < reqs[k].dr_nsecs / BLKSECTS; i++, addr += BLKSIZE) {
+			if (bc_is_held(blockno + i))
+				continue;
+			bc_dirty[(blockno + i) / 32] &= ~(1U << ((blockno + i) % 32));
+			if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+				panic("bc_write_batch: sys_page_map: %i", r);
+		}
+	}
+}
+
+// Write the single cached block 'blockno' to disk.
+static void
+bc_write(uint32_t blockno)
+{
+	struct DiskReq req;
+
+	bc_req(&req, blockno, 1, 1);
+	bc_write_batch(&req, 1);
+}
+
+// Add the blocks in [blockno, blockno + nblocks) whose pages the
+// hardware has marked dirty to the dirty set.  Only page tables that
+// are present are looked at, so unmapped parts of the disk cost one
+// check per 4MB.
+static void
+bc_scan_dirty(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t end = blockno + nblocks;
+	uintptr_t va;
+
+	while (blockno < end) {
+		va = DISKMAP + blockno * BLKSIZE;
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			blockno = ROUNDDOWN(blockno, NPTENTRIES) + NPTENTRIES;
+			continue;
+		}
+		if ((uvpt[PGNUM(va)] & (PTE_P | PTE_D)) == (PTE_P | PTE_D))
+			bc_mark_dirty(blockno);
+		blockno++;
+	}
+}
+
+// Return the first block in [blockno, end) that is in the dirty set
+// and not held, or 'end' if there is none.  Words of the sets with no
+// such block are passed over whole.
+static uint32_t
+bc_next_dirty(uint32_t blockno, uint32_t end)
+{
+	uint32_t w;
+
+	while (blockno < end) {
+		w = (bc_dirty[blockno / 32] & ~bc_held[blockno / 32]) >> (blockno % 32);
+		if (w)
+			return MIN(blockno + __builtin_ctz(w), end);
+		blockno = ROUNDDOWN(blockno, 32) + 32;
+	}
+	return end;
+}
+
+// Write out every block in [blockno, blockno + nblocks) that is in the
+// dirty set and not held, merging runs of adjacent dirty blocks into
+// single disk commands and handing up to BC_MAXBATCH runs to the disk
+// together.  Only the dirty set is looked at, not the pages, so this
+// costs one check per 32 clean blocks; bc_flush_range scans the pages
+// first.
+static void
+bc_flush_dirty(uint32_t blockno, uint32_t nblocks)
+{
+	struct DiskReq reqs[BC_MAXBATCH];
+	uint32_t end = blockno + nblocks, n;
+	int nreq = 0;
+
+	while ((blockno = bc_next_dirty(blockno, end)) < end) {
+		for (n = 1; n < BC_MAXRUN && blockno + n < end
+			     && bc_is_dirty(blockno + n) && !bc_is_held(blockno + n); n++)
+			/* do nothing */;
+		bc_req(&reqs[nreq++], blockno, n, 1);
+		if (nreq == BC_MAXBATCH) {
+			bc_write_batch(reqs, nreq);
+			nreq = 0;
+		}
+		blockno += n;
+	}
+	if (nreq > 0)
+		bc_write_batch(reqs, nreq);
+}
+
+// Write out every dirty block in [blockno, blockno + nblocks) that is
+// not held, including blocks whose pages were written without telling
+// the dirty set.
+void
+bc_flush_range(uint32_t blockno, uint32_t nblocks)
+{
+	bc_scan_dirty(blockno, nblocks);
+	bc_flush_dirty(blockno, nblocks);
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
+// If the block is not in the block cache, is not dirty or is held,
+// does nothing.
 void
 flush_block(void *addr)
 {
@@ -87,20 +429,177 @@ flush_block(void *addr)
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %p", addr);
 
-	// LAB 10: Your code here.
-	if (!va_is_mapped(addr) || !va_is_dirty(addr)) {
+	if (!va_is_mapped(addr) || (!va_is_dirty(addr) && !bc_is_dirty(blockno))
+	    || bc_is_held(blockno))
 		return;
+	bc_write(blockno);
+}
+
+// Move the 'nblocks' blocks from 'blockno' on between 'buf' and the
+// disk without bringing them into the cache.  Blocks that are cached
+// anyway are the ones that count: reads copy them from their pages, and
+// writes copy into the pages and add them to the dirty set.  The rest
+// go to or from the disk directly, in runs of up to BC_MAXRUN blocks
+// and batches of up to BC_MAXBATCH runs.  Writers must hold the file
+// system alone (see fsreq_serve), so that no block is being read in or
+// written back meanwhile.
+void
+bc_direct(uint32_t blockno, void *buf, uint32_t nblocks, bool write)
+{
+	struct DiskReq reqs[BC_MAXBATCH];
+	uint32_t end = blockno + nblocks, n;
+	char *addr;
+	int nreq = 0, r;
+
+	for (; blockno < end; blockno += n, buf += n * BLKSIZE) {
+		addr = diskaddr(blockno);
+		if (va_is_mapped(addr)) {
+			if (write) {
+				memmove(addr, buf, BLKSIZE);
+				bc_mark_dirty(blockno);
+			} else
+				memmove(buf, addr, BLKSIZE);
+			fs_stats.fs_bc_hits++;
+			n = 1;
+			continue;
+		}
+		for (n = 1; n < BC_MAXRUN && blockno + n < end
+			     && !va_is_mapped(diskaddr(blockno + n)); n++)
+			/* do nothing */;
+		reqs[nreq].dr_secno = blockno * BLKSECTS;
+		reqs[nreq].dr_buf = buf;
+		reqs[nreq].dr_nsecs = n * BLKSECTS;
+		reqs[nreq].dr_write = write;
+		fs_stats.fs_direct += n;
+		if (++nreq == BC_MAXBATCH) {
+			if ((r = disk_submit(reqs, nreq)) < 0)
+				panic("bc_direct: disk_submit: %i", r);
+			nreq = 0;
+		}
 	}
-	addr = ROUNDDOWN(addr, PGSIZE);
+	if (nreq > 0 && (r = disk_submit(reqs, nreq)) < 0)
+		panic("bc_direct: disk_submit: %i", r);
+}
+
+// Put 'page', which holds the new contents of block 'blockno', into the
+// cache as that block and add it to the dirty set.  Whatever was cached
+// for the block is dropped.  'page' is unmapped.
+void
+bc_insert(uint32_t blockno, void *page)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	while (bc_in_flight(blockno))
+		thread_wait(bc_busy);
+	bc_evict(1);
+	if (va_is_mapped(addr))
+		bc_resident--;
+	if ((r = sys_page_map(0, page, 0, addr, PTE_W | PTE_P | PTE_U)) < 0)
+		panic("bc_insert: sys_page_map: %i", r);
+	if ((r = sys_page_unmap(0, page)) < 0)
+		panic("bc_insert: sys_page_unmap: %i", r);
+	bc_resident++;
+	bc_mark_dirty(blockno);
+}
+
+// Write out every dirty block in the cache that is not held.
+void
+bc_sync(void)
+{
+	bc_flush_range(1, super->s_nblocks - 1);
+}
+
+// Drop block 'blockno' from the cache without writing it out.
+static void
+bc_unmap(uint32_t blockno)
+{
+	int r;
+
+	if ((r = sys_page_unmap(0, (void *) (DISKMAP + blockno * BLKSIZE))) < 0)
+		panic("bc_unmap: sys_page_unmap: %i", r);
+	bc_resident--;
+}
+
+// The superblock and bitmap blocks are never evicted.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Evict blocks until 'nblocks' more fit in the cache budget.
+// Held blocks, and blocks whose pages are also mapped by other
+// environments, are skipped.  Gives up after two turns of the clock,
+// which is enough to find every block that can be evicted at all.
+// Parts of the disk with no page table are passed over 4MB at a time.
+static void
+bc_evict(uint32_t nblocks)
+{
+	uint32_t blockno, scanned, n;
+	uintptr_t va;
+	pte_t pte;
 	int r;
-	if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {
-		panic("flush_block: ide_write: %i", r);
-    }
-    // Clear the dirty bit
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) {
-		panic("flush_block: sys_page_map: %i", r);
+
+	if (!super)
+		return;
+	for (scanned = 0; bc_resident + nblocks > bc_budget
+		     && scanned < 2 * super->s_nblocks; scanned++) {
+		blockno = bc_hand;
+		va = DISKMAP + blockno * BLKSIZE;
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			n = ROUNDDOWN(blockno, NPTENTRIES) + NPTENTRIES - blockno;
+			scanned += n - 1;
+			bc_hand = blockno + n >= super->s_nblocks ? 1 : blockno + n;
+			continue;
+		}
+		if (++bc_hand >= super->s_nblocks)
+			bc_hand = 1;
+
+		if (!((pte = uvpt[PGNUM(va)]) & PTE_P)
+		    || bc_pinned(blockno) || bc_is_held(blockno)
+		    || pageref((void *) va) > 1)
+			continue;
+
+		if (pte & PTE_A) {
+			// Second chance.  Remapping clears PTE_D along
+			// with PTE_A, so remember dirtiness in the set.
+			if (pte & PTE_D)
+				bc_mark_dirty(blockno);
+			if ((r = sys_page_map(0, (void *) va, 0, (void *) va, pte & PTE_SYSCALL)) < 0)
+				panic("bc_evict: sys_page_map: %i", r);
+			continue;
+		}
+
+		if ((pte & PTE_D) || bc_is_dirty(blockno)) {
+			bc_write(blockno);
+			fs_stats.fs_bc_writebacks++;
+			// Other threads ran during the write; the block may
+			// have been dropped, shared or written again since.
+			if (!va_is_mapped((void *) va) || pageref((void *) va) > 1
+			    || va_is_dirty((void *) va) || bc_is_dirty(blockno))
+				continue;
+		}
+		bc_unmap(blockno);
+		fs_stats.fs_bc_evictions++;
 	}
-	//panic("flush_block not implemented");
+}
+
+// Limit the block cache to 'nblocks' blocks, evicting blocks now if
+// more than that are cached.
+void
+bc_set_budget(uint32_t nblocks)
+{
+	bc_budget = MAX(nblocks, BC_MIN_BUDGET);
+	bc_evict(0);
+}
+
+// Fill in the current size and budget of the block cache in *st.
+void
+bc_stats(struct FsStats *st)
+{
+	st->fs_bc_resident = bc_resident;
+	st->fs_bc_budget = bc_budget;
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -120,7 +619,7 @@ check_bc(void)
 	assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	bc_unmap(1);
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
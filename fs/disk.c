@@ -0,0 +1,259 @@
+/*
+ * Disk access for the block cache.  The file system image is either on
+ * a virtio-blk device, which takes a batch of requests at once, or on
+ * IDE disks, which do one request after another.  Either way the
+ * drivers handle one batch at a time, so threads of the server that
+ * want the disk while another batch is running wait their turn.
+ *
+ * An image striped over two IDE disks (see struct Super) has them on
+ * different channels, so that both can work at once.  Requests are cut
+ * at stripe unit boundaries, and each disk is kept busy with the pieces
+ * that fall on it until all are done.
+ *
+ * A thread waiting for a transfer to end blocks in disk_pause.  When no
+ * thread can run, the main loop of the server sleeps in disk_sleep
+ * until a disk interrupts (or a request comes), and then wakes the
+ * waiting threads to look at their disks again.
+ */
+
+#include "fs.h"
+
+static bool disk_virtio;		// use virtio-blk instead of IDE
+static bool disk_busy;			// a batch is being carried out
+static bool disk_irq;			// all the disks interrupt us
+static int disk_nwaiting;		// threads blocked in disk_pause
+
+static int disks[FS_MAXDISKS];		// IDE disks, in stripe order
+static int ndisks = 1;
+static uint32_t stripe;			// sectors per stripe unit
+
+// Where a striped request has got to on one disk: the request and
+// sector within it that the next piece for that disk is looked for at
+struct StripeCursor {
+	int sc_req;
+	uint32_t sc_off;
+};
+
+static int disk_submit_locked(struct DiskReq *reqs, int n);
+
+// Read the superblock off the first disk, and if it says the file
+// system is striped, find the rest of the disks.
+static void
+disk_stripe_init(void)
+{
+	static char sect[SECTSIZE] __attribute__((aligned(SECTSIZE)));
+	struct DiskReq req = { BLKSECTS, sect, 1, 0 };
+	struct Super *s = (struct Super *) sect;
+	int r;
+
+	if ((r = disk_submit_locked(&req, 1)) < 0)
+		panic("disk_init: reading the superblock: %i", r);
+	if (s->s_magic != FS_MAGIC || s->s_ndisks <= 1)
+		return;
+
+	if (disk_virtio)
+		panic("file system is striped over %u disks, but is on virtio",
+		      s->s_ndisks);
+	if (s->s_ndisks > FS_MAXDISKS || s->s_stripe < FS_MINSTRIPE
+	    || s->s_stripe > FS_MAXSTRIPE)
+		panic("bad stripe: %u disks, %u blocks", s->s_ndisks, s->s_stripe);
+	// The second disk is the secondary channel's master.
+	if (disks[0] != 1 || !ide_probe_disk(2))
+		panic("file system is striped over %u disks, but the second is missing",
+		      s->s_ndisks);
+	disks[1] = 2;
+	ndisks = s->s_ndisks;
+	stripe = s->s_stripe * BLKSECTS;
+	cprintf("disk: striped over %d disks, %u blocks per unit\n",
+		ndisks, s->s_stripe);
+}
+
+// Find the disk holding the file system image.  A virtio-blk device
+// wins; otherwise use the second IDE disk (number 1) if available,
+// along with disk 2 if the file system is striped.
+void
+disk_init(void)
+{
+	int i;
+
+	if (virtio_blk_init()) {
+		disk_virtio = 1;
+	} else {
+		disks[0] = ide_probe_disk(1) ? 1 : 0;
+		ide_set_disk(disks[0]);
+		ide_dma_init();
+		ide_irq_init();
+	}
+	disk_stripe_init();
+	if (!disk_virtio)
+		for (disk_irq = 1, i = 0; i < ndisks; i++)
+			disk_irq = disk_irq && ide_irq_on(disks[i]);
+}
+
+// Let other threads run until the disk may have finished what the
+// running thread is waiting for, that is, until the next disk_sleep.
+// Outside a thread, give up the CPU to other environments instead.
+void
+disk_pause(void)
+{
+	if (thread_current() < 0) {
+		sys_yield();
+		return;
+	}
+	disk_nwaiting++;
+	thread_wait(&disk_nwaiting);
+}
+
+// Are any threads blocked in disk_pause?
+bool
+disk_waiting(void)
+{
+	return disk_nwaiting > 0;
+}
+
+// Called by the main loop of the server when no thread can run but
+// some wait for the disk.  Sleep until a disk interrupts or, if
+// 'recving', until the message of the receive begun by ipc_recv_start
+// arrives, then wake the threads blocked in disk_pause.  Disks that do
+// not interrupt are polled, giving up the CPU in between.
+void
+disk_sleep(bool recving)
+{
+	int r;
+
+	if (!disk_irq)
+		sys_yield();
+	else if ((r = recving ? sys_ipc_recv(NULL, 0, IPC_RECV_WAIT_IRQ)
+			      : sys_irq_wait(IRQ_ANY)) < 0)
+		panic("disk_sleep: %i", r);
+	disk_nwaiting = 0;
+	thread_wakeup(&disk_nwaiting);
+}
+
+// Which disk sector 'secno' of the file system is on, and where.
+static int
+stripe_map(uint32_t secno, uint32_t *psecno)
+{
+	uint32_t unit = secno / stripe;
+
+	*psecno = (unit / ndisks) * stripe + secno % stripe;
+	return unit % ndisks;
+}
+
+// Find the next piece of the 'n' requests in 'reqs' that is on disk
+// 'd', from where 'c' has got to.  Returns false if there is none.
+static bool
+stripe_next(struct DiskReq *reqs, int n, int d, struct StripeCursor *c,
+	    struct DiskReq *piece)
+{
+	struct DiskReq *req;
+	uint32_t secno, len;
+
+	for (; c->sc_req < n; c->sc_req++, c->sc_off = 0) {
+		req = &reqs[c->sc_req];
+		while (c->sc_off < req->dr_nsecs) {
+			secno = req->dr_secno + c->sc_off;
+			len = MIN(req->dr_nsecs - c->sc_off, stripe - secno % stripe);
+			piece->dr_buf = req->dr_buf + c->sc_off * SECTSIZE;
+			piece->dr_nsecs = len;
+			piece->dr_write = req->dr_write;
+			c->sc_off += len;
+			if (stripe_map(secno, &piece->dr_secno) == d)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+// Carry out the 'n' requests in 'reqs' on a striped file system,
+// giving each disk its next piece as soon as it is done with the last.
+static int
+stripe_submit(struct DiskReq *reqs, int n)
+{
+	struct StripeCursor cur[FS_MAXDISKS];
+	struct DiskReq piece;
+	bool busy[FS_MAXDISKS];
+	int d, r, waiting, err = 0;
+
+	memset(cur, 0, sizeof(cur));
+	memset(busy, 0, sizeof(busy));
+	for (;;) {
+		waiting = -1;
+		for (d = 0; d < ndisks; d++) {
+			if (busy[d]) {
+				if ((r = ide_poll(disks[d])) == 0) {
+					waiting = d;
+					continue;
+				}
+				busy[d] = 0;
+				if (r < 0)
+					err = r;
+			}
+			if (err < 0 || !stripe_next(reqs, n, d, &cur[d], &piece))
+				continue;
+			if ((r = ide_start(disks[d], piece.dr_secno, piece.dr_buf,
+					   piece.dr_nsecs, piece.dr_write)) < 0)
+				err = r;
+			else {
+				busy[d] = 1;
+				waiting = d;
+			}
+		}
+		if (waiting < 0)
+			return err;
+		ide_pause(disks[waiting]);
+	}
+}
+
+static int
+disk_submit_locked(struct DiskReq *reqs, int n)
+{
+	int i, r;
+
+	if (disk_virtio)
+		return virtio_blk_submit(reqs, n);
+	if (ndisks > 1)
+		return stripe_submit(reqs, n);
+	for (i = 0; i < n; i++) {
+		if (reqs[i].dr_write)
+			r = ide_write(reqs[i].dr_secno, reqs[i].dr_buf, reqs[i].dr_nsecs);
+		else
+			r = ide_read(reqs[i].dr_secno, reqs[i].dr_buf, reqs[i].dr_nsecs);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Carry out the 'n' requests in 'reqs', in no particular order.
+// Other threads run while the disk works.
+// Returns 0 on success, < 0 if any request failed.
+int
+disk_submit(struct DiskReq *reqs, int n)
+{
+	int r;
+
+	while (disk_busy)
+		thread_wait(&disk_busy);
+	disk_busy = 1;
+	r = disk_submit_locked(reqs, n);
+	disk_busy = 0;
+	thread_wakeup(&disk_busy);
+	return r;
+}
+
+int
+disk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	struct DiskReq req = { secno, dst, nsecs, 0 };
+
+	return disk_submit(&req, 1);
+}
+
+int
+disk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	struct DiskReq req = { secno, (void *) src, nsecs, 1 };
+
+	return disk_submit(&req, 1);
+}
@@ -1,8 +1,11 @@
 #include <inc/string.h>
 #include <inc/partition.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
+static void file_check_flags(struct File *f);
+
 // --------------------------------------------------------------
 // Super block
 // --------------------------------------------------------------
@@ -24,6 +27,16 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+// Next-fit allocation cursor: the block number alloc_block starts
+// searching from.
+static uint32_t alloc_cursor;
+// Number of free blocks, counted once by bitmap_init and kept up to
+// date by alloc_block and free_block.
+static uint32_t nfree_blocks;
+// Free blocks set aside for file blocks whose allocation is delayed;
+// see file_delay_block.
+static uint32_t nreserved;
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -43,38 +56,165 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (!block_is_free(blockno))
+		nfree_blocks++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	bc_mark_dirty(2 + blockno / BLKBITSIZE);
+	journal_freed(blockno);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it, preferring
+// 'goal' and then the blocks after it.
+//
+// The search starts at 'goal' and wraps around at the end of the disk,
+// so a file's blocks follow each other when the disk allows.  The
+// bitmap is scanned a word at a time, so runs of 32 allocated blocks
+// cost a single comparison, and bsf picks the lowest free block in a
+// word.
+//
+// The changed bitmap block is only added to the block cache's dirty
+// set; it is written out by file_flush or fs_sync.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
-alloc_block(void)
+alloc_block_near(uint32_t goal)
 {
 	// The bitmap consists of one or more blocks.  A single bitmap block
 	// contains the in-use bits for BLKBITSIZE blocks.  There are
 	// super->s_nblocks blocks in the disk altogether.
+	uint32_t nwords, i, w, word, blockno;
 
-	// LAB 10: Your code here.
-	uint32_t i;
-	for (i = 1; i < super->s_nblocks; ++i) {
-	    if (block_is_free(i)) {
-			// Remove the bits set in free_block().
-            bitmap[i >> 5] &= ~(1UL << (i & ((1UL << 5) - 1)));
-			flush_block(bitmap + (i >> 5));
-			return i;
-	    }
+	if (nfree_blocks <= nreserved)
+		return -E_NO_DISK;
+	if (goal >= super->s_nblocks)
+		goal = 0;
+
+	// The word holding 'goal' is looked at twice: first for the
+	// blocks from goal on, last for the ones before it.
+	nwords = (super->s_nblocks + 31) / 32;
+	for (i = 0; i <= nwords; i++) {
+		w = (goal / 32 + i) % nwords;
+		word = bitmap[w];
+		if (i == 0)
+			word &= ~0U << (goal % 32);
+		else if (i == nwords)
+			word &= (1U << (goal % 32)) - 1;
+		// Bits past the end of the disk are set in the last word,
+		// so a free bit there may still be out of range.
+		if (word != 0
+		    && (blockno = w * 32 + bsf(word)) < super->s_nblocks) {
+			bitmap[w] &= ~(1U << (blockno % 32));
+			bc_mark_dirty(2 + blockno / BLKBITSIZE);
+			nfree_blocks--;
+			alloc_cursor = blockno + 1 < super->s_nblocks ? blockno + 1 : 0;
+			return blockno;
+		}
 	}
-	//panic("alloc_block not implemented");
+
 	return -E_NO_DISK;
 }
 
+// Allocate a block for a caller with no preference, next-fit: after
+// the block allocated last.
+int
+alloc_block(void)
+{
+	return alloc_block_near(alloc_cursor);
+}
+
+// Return the first block in [b, end) whose bitmap bit is 'isfree'
+// (1 for free), or 'end' if there is none.  Looks at the bitmap a word
+// at a time.
+static uint32_t
+bitmap_scan(uint32_t b, uint32_t end, bool isfree)
+{
+	uint32_t word;
+
+	while (b < end) {
+		word = isfree ? bitmap[b / 32] : ~bitmap[b / 32];
+		word &= ~0U << (b % 32);
+		if (word != 0)
+			return MIN(ROUNDDOWN(b, 32) + bsf(word), end);
+		b = ROUNDDOWN(b, 32) + 32;
+	}
+	return end;
+}
+
+// Allocate up to 'want' consecutive free blocks: the first run of that
+// many from 'goal' on, or else the longest run there is.  Both the
+// start and the end of each run are found a bitmap word at a time.
+// Sets *pstart to the first block of the run.
+// Returns the number of blocks allocated, -E_NO_DISK if the disk is full.
+static int
+alloc_run(uint32_t want, uint32_t goal, uint32_t *pstart)
+{
+	uint32_t nblocks = super->s_nblocks, b, end, len, best = 0, bestlen = 0;
+	int pass;
+
+	if (nfree_blocks <= nreserved)
+		return -E_NO_DISK;
+	want = MIN(want, nfree_blocks - nreserved);
+	if (goal >= nblocks)
+		goal = 0;
+
+	// Runs starting from goal on first, then those before it.
+	for (pass = 0; pass < 2 && bestlen < want; pass++) {
+		b = pass ? 0 : goal;
+		end = pass ? goal : nblocks;
+		while (bestlen < want && (b = bitmap_scan(b, end, 1)) < end) {
+			len = bitmap_scan(b, MIN(b + want, nblocks), 0) - b;
+			if (len > bestlen) {
+				best = b;
+				bestlen = len;
+			}
+			b += len;
+		}
+	}
+
+	for (b = best; b < best + bestlen; b++) {
+		bitmap[b / 32] &= ~(1U << (b % 32));
+		bc_mark_dirty(2 + b / BLKBITSIZE);
+	}
+	nfree_blocks -= bestlen;
+	alloc_cursor = best + bestlen < nblocks ? best + bestlen : 0;
+	*pstart = best;
+	return bestlen;
+}
+
+// Return the number of free blocks on the disk.
+uint32_t
+fs_free_blocks(void)
+{
+	return nfree_blocks;
+}
+
+// Count the free blocks in the bitmap and reset the allocation cursor.
+static void
+bitmap_init(void)
+{
+	uint32_t i, word;
+
+	nfree_blocks = 0;
+	for (i = 0; i < super->s_nblocks; i += 32) {
+		word = bitmap[i / 32];
+		// Ignore the bits past the end of the disk.
+		if (super->s_nblocks - i < 32)
+			word &= (1U << (super->s_nblocks - i)) - 1;
+		for (; word != 0; word &= word - 1)
+			nfree_blocks++;
+	}
+	alloc_cursor = 0;
+}
+
+// Write out any bitmap blocks changed by alloc_block or free_block,
+// through the journal if there is one.
+static void
+flush_bitmap(void)
+{
+	journal_range(2, (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -107,21 +247,37 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256, "Unsupported file size");
 
-       // Find a JOS disk.  Use the second IDE disk (number 1) if availabl
-       if (ide_probe_disk1())
-               ide_set_disk(1);
-       else
-               ide_set_disk(0);
+	// Find a JOS disk.
+	disk_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	journal_init();
+	file_check_flags(&super->s_root);
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
-	
+	bitmap_init();
+}
+
+// --------------------------------------------------------------
+// Block placement
+// --------------------------------------------------------------
+
+// Blocks are placed where they will be read together: a file's next
+// block right after its previous one, and the first block of a file,
+// or of a directory's index, after the directory block that holds its
+// entry.  alloc_block_near takes the first free block from there on.
+
+// Return the disk block holding the entry of file 'f', which is one of
+// its directory's blocks, or the superblock for the root.
+static uint32_t
+file_home(struct File *f)
+{
+	return ((uintptr_t) f - DISKMAP) / BLKSIZE;
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -131,76 +287,541 @@ fs_init(void)
 // When 'alloc' is set, this function will allocate an indirect block
 // if necessary.
 //
+// Only files using the legacy block map have such slots; see
+// file_map_block for a lookup that works with both layouts.
+//
 // Returns:
 //	0 on success (but note that *ppdiskbno might equal 0).
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT),
+//		or if f uses extents or keeps its data inline.
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
-    // LAB 10: Your code here.
-    uint32_t bno;
-	if (filebno >= NDIRECT + NINDIRECT) {
+	int r;
+
+	if ((f->f_flags & (F_EXTENTS | F_INLINE)) || filebno >= NDIRECT + NINDIRECT)
 		return -E_INVAL;
+	if (filebno < NDIRECT) {
+		*ppdiskbno = f->f_direct + filebno;
+		return 0;
 	}
 	if (!f->f_indirect) {
-		if (!alloc) {
+		if (!alloc)
 			return -E_NOT_FOUND;
+		if ((r = alloc_block_near(f->f_direct[NDIRECT - 1]
+					  ? f->f_direct[NDIRECT - 1] + 1
+					  : file_home(f) + 1)) < 0)
+			return r;
+		f->f_indirect = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+	}
+	*ppdiskbno = (uint32_t *) diskaddr(f->f_indirect) + filebno - NDIRECT;
+	return 0;
+}
+
+// Return a pointer to the i'th extent of extent-mapped file 'f'.
+static struct Extent *
+file_extent(struct File *f, uint32_t i)
+{
+	if (i < NEXTENT)
+		return f->f_extent + i;
+	return (struct Extent *) diskaddr(f->f_xblock) + (i - NEXTENT);
+}
+
+// Return the number of file blocks mapped by the extents of 'f'.
+static uint32_t
+file_extent_blocks(struct File *f)
+{
+	uint32_t i, n;
+
+	for (i = n = 0; i < f->f_nextents; i++)
+		n += file_extent(f, i)->e_len;
+	return n;
+}
+
+// Return where block 'filebno' of file 'f' should go: right after
+// the block before it if that is allocated, else after the block
+// holding the file's entry.
+static uint32_t
+file_goal(struct File *f, uint32_t filebno)
+{
+	struct Extent *e;
+	uint32_t *ptr;
+
+	if (f->f_flags & F_EXTENTS) {
+		// Blocks are only ever added at the end of the map.
+		if (f->f_nextents > 0) {
+			e = file_extent(f, f->f_nextents - 1);
+			return e->e_start + e->e_len;
+		}
+	} else if (filebno > 0 && file_block_walk(f, filebno - 1, &ptr, 0) == 0
+		   && *ptr)
+		return *ptr + 1;
+	return file_home(f) + 1;
+}
+
+// Look up the disk block holding the 'filebno'th block of file 'f'.
+// Sets *pdiskbno to the disk block number, or to 0 if the block is
+// not allocated, as no block of an inline file is.  If 'pnrun' is not
+// null, sets *pnrun to the number of file blocks, starting at
+// 'filebno', that are known to follow each other on disk (0 if the
+// block is not allocated).  Callers can use the run to access several
+// blocks through one diskaddr.
+//
+// Returns 0 on success, -E_INVAL if filebno is beyond what the
+// file's block map can describe.
+int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *pnrun)
+{
+	struct Extent *e;
+	uint32_t i, *ptr, *next, nrun;
+	int r;
+
+	*pdiskbno = nrun = 0;
+	if (f->f_flags & F_INLINE)
+		/* no blocks */;
+	else if (f->f_flags & F_EXTENTS) {
+		for (i = 0; i < f->f_nextents; i++) {
+			e = file_extent(f, i);
+			if (filebno < e->e_len) {
+				*pdiskbno = e->e_start + filebno;
+				nrun = e->e_len - filebno;
+				break;
+			}
+			filebno -= e->e_len;
 		}
-		else {
-			if ((bno = alloc_block()) < 0) {
-				return -E_NO_DISK;
+	} else {
+		if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+			return r == -E_NOT_FOUND ? 0 : r;
+		if ((*pdiskbno = *ptr) != 0) {
+			// The legacy map has to be checked pointer by pointer,
+			// so only look within the same array.
+			for (nrun = 1; filebno + nrun != NDIRECT
+				     && filebno + nrun < NDIRECT + NINDIRECT; nrun++) {
+				next = ptr + nrun;
+				if (*next != *ptr + nrun)
+					break;
 			}
+		}
+	}
+	if (pnrun)
+		*pnrun = nrun;
+	return 0;
+}
+
+// Add the 'n' disk blocks from 'bno' on to the end of the map of
+// extent-mapped file 'f'.  They go at the end of the last extent when
+// they happen to follow it on disk.
+// Returns 0 on success, < 0 on error.
+static int
+file_extend_map(struct File *f, uint32_t bno, uint32_t n)
+{
+	struct Extent *e;
+	int r;
+
+	if (f->f_nextents > 0) {
+		e = file_extent(f, f->f_nextents - 1);
+		if (e->e_start + e->e_len == bno) {
+			e->e_len += n;
+			return 0;
+		}
+	}
+
+	if (f->f_nextents == MAXEXTENTS)
+		return -E_NO_DISK;
+	if (f->f_nextents == NEXTENT && !f->f_xblock) {
+		if ((r = alloc_block_near(bno + n)) < 0)
+			return r;
+		f->f_xblock = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+	}
+	e = file_extent(f, f->f_nextents++);
+	e->e_start = bno;
+	e->e_len = n;
+	return 0;
+}
+
+// Append one newly allocated and zeroed block to the end of the
+// extent-mapped file 'f'.
+// Returns 0 on success, < 0 on error.
+static int
+file_append_block(struct File *f)
+{
+	int r, bno;
+
+	if ((bno = alloc_block_near(file_goal(f, 0))) < 0)
+		return bno;
+	memset(diskaddr(bno), 0, BLKSIZE);
+	bc_mark_dirty(bno);
+
+	if ((r = file_extend_map(f, bno, 1)) < 0)
+		free_block(bno);
+	return r;
+}
+
+// --------------------------------------------------------------
+// Delayed allocation
+// --------------------------------------------------------------
+
+// Blocks written past the end of a regular file's map get no disk
+// block when they are written.  They wait in pages at DELAYVA until the
+// file is flushed, and then all get disk blocks at once, as one run if
+// the disk has one free.  Appends that interleave with writes to other
+// files thus still leave each file in a few long extents.
+//
+// Only extent-mapped files delay allocation.  Their waiting blocks are
+// always the ones right after the end of the map: a write that would
+// leave a hole, and anything that needs the block in the cache, gets
+// the file's waiting blocks allocated first (file_commit_delayed).
+//
+// Each waiting block keeps a disk block and one for metadata reserved,
+// so that allocating it cannot fail for lack of space.  When the disk
+// is too full for that, writes allocate as they go.
+
+#define NDELAY		256
+#define DELAYVA		0x0C000000
+#define DELAYPAGE(i)	((char *) (DELAYVA + (i) * PGSIZE))
 
-			f->f_indirect = bno;
-			memset(diskaddr(bno), 0, BLKSIZE);
+struct DelayBlock {
+	struct File *db_file;		// file the block is part of; 0 if free
+	uint32_t db_filebno;		// block number within the file
+};
+
+static struct DelayBlock delayed[NDELAY];
+static uint32_t ndelayed;		// blocks waiting for a disk block
+
+// Return the slot of block 'filebno' of 'f' in delayed[], or -1 if it
+// is not waiting.
+static int
+delay_find(struct File *f, uint32_t filebno)
+{
+	int i;
+
+	if (ndelayed == 0)
+		return -1;
+	for (i = 0; i < NDELAY; i++)
+		if (delayed[i].db_file == f && delayed[i].db_filebno == filebno)
+			return i;
+	return -1;
+}
+
+// Return the number of blocks of 'f' waiting for a disk block.
+static uint32_t
+delay_count(struct File *f)
+{
+	uint32_t i, n;
+
+	if (ndelayed == 0)
+		return 0;
+	for (i = n = 0; i < NDELAY; i++)
+		if (delayed[i].db_file == f)
+			n++;
+	return n;
+}
+
+// Return true if blocks of 'f' are waiting for disk blocks.  Anything
+// that goes through file_get_block for 'f' then changes its map, so
+// needs the exclusive lock (see fsreq_serve).
+bool
+file_has_delayed(struct File *f)
+{
+	return delay_count(f) != 0;
+}
+
+// Free slot 'i' of delayed[], along with its page if it still has one.
+static void
+delay_free(int i)
+{
+	int r;
+
+	if (va_is_mapped(DELAYPAGE(i))
+	    && (r = sys_page_unmap(0, DELAYPAGE(i))) < 0)
+		panic("delay_free: sys_page_unmap: %i", r);
+	delayed[i].db_file = 0;
+	ndelayed--;
+}
+
+// Give the waiting blocks of 'f' disk blocks, in as few runs as the
+// free space allows, and move them into the block cache.
+// Returns 0 on success, < 0 on error.
+static int
+file_commit_delayed(struct File *f)
+{
+	uint32_t n, filebno, start, i;
+	int run, r, slot;
+
+	if ((n = delay_count(f)) == 0)
+		return 0;
+	// The blocks are about to use what was reserved for them.
+	nreserved -= 2 * n;
+	filebno = file_extent_blocks(f);
+	while (n > 0) {
+		if ((run = alloc_run(n, file_goal(f, filebno), &start)) < 0) {
+			nreserved += 2 * n;
+			return run;
+		}
+		if ((r = file_extend_map(f, start, run)) < 0) {
+			for (i = 0; i < run; i++)
+				free_block(start + i);
+			nreserved += 2 * n;
+			return r;
+		}
+		for (i = 0; i < run; i++) {
+			slot = delay_find(f, filebno + i);
+			assert(slot >= 0);
+			bc_insert(start + i, DELAYPAGE(slot));
+			delay_free(slot);
 		}
+		fs_stats.fs_delayed += run;
+		fs_stats.fs_delay_runs++;
+		filebno += run;
+		n -= run;
 	}
-	*ppdiskbno = (filebno < NDIRECT) ? f->f_direct + filebno :
-		(uint32_t *) diskaddr(f->f_indirect) + filebno - NDIRECT;
 	return 0;
-    //panic("file_block_walk not implemented");
+}
+
+// Allocate disk blocks for every waiting block.
+static void
+delay_commit_all(void)
+{
+	int i, r;
+
+	for (i = 0; i < NDELAY && ndelayed > 0; i++)
+		if (delayed[i].db_file
+		    && (r = file_commit_delayed(delayed[i].db_file)) < 0)
+			cprintf("warning: file_commit_delayed: %i\n", r);
+}
+
+// Drop the waiting blocks of 'f' from block 'nblocks' on, which a
+// truncation cut off.
+static void
+delay_truncate(struct File *f, uint32_t nblocks)
+{
+	int i;
+
+	for (i = 0; i < NDELAY && ndelayed > 0; i++)
+		if (delayed[i].db_file == f && delayed[i].db_filebno >= nblocks) {
+			delay_free(i);
+			nreserved -= 2;
+		}
+}
+
+// Return the page holding block 'filebno' of 'f' while it waits for a
+// disk block, setting one up if the block is the next one past the end
+// of the file's map and may wait.  Returns NULL if the block has to be
+// written in the block cache instead.
+static char *
+file_delay_block(struct File *f, uint32_t filebno)
+{
+	int i, r;
+
+	if ((i = delay_find(f, filebno)) >= 0)
+		return DELAYPAGE(i);
+	if (!(f->f_flags & F_EXTENTS) || f->f_type != FTYPE_REG
+	    || filebno != file_extent_blocks(f) + delay_count(f)
+	    || nfree_blocks < nreserved + 2)
+		return NULL;
+
+	for (i = 0; i < NDELAY && delayed[i].db_file; i++)
+		/* do nothing */;
+	if (i == NDELAY) {
+		// Every slot is taken.  Making room allocates this
+		// file's waiting blocks too, so the block is still the
+		// next one past the end of the map.
+		delay_commit_all();
+		for (i = 0; i < NDELAY && delayed[i].db_file; i++)
+			/* do nothing */;
+		if (i == NDELAY)
+			return NULL;
+	}
+
+	if ((r = sys_page_alloc(0, DELAYPAGE(i), PTE_P | PTE_U | PTE_W)) < 0)
+		return NULL;
+#ifdef SANITIZE_USER_SHADOW_BASE
+	platform_asan_unpoison(DELAYPAGE(i), PGSIZE);
+#endif
+	delayed[i].db_file = f;
+	delayed[i].db_filebno = filebno;
+	ndelayed++;
+	nreserved += 2;
+	return DELAYPAGE(i);
+}
+
+// --------------------------------------------------------------
+// Inline data
+// --------------------------------------------------------------
+
+// New regular files keep their data in the f_inline area of their
+// File, in place of a block map, until they grow past MAXINLINE bytes.
+// Small files thus take no data block, and reading or writing them
+// touches only the block holding their directory entry.  A file moves
+// out to a block of its own (file_promote) when it grows, and when
+// something needs its data in a block: file_get_block, or a client
+// mapping it for writing.
+
+// Move the data of inline file 'f' into its first block, turning it
+// into an extent-mapped file.  The block waits for a disk block like
+// any other appended block when it can (see file_delay_block).
+// Does nothing if 'f' is not inline.
+// Returns 0 on success, < 0 on error.
+int
+file_promote(struct File *f)
+{
+	char data[MAXINLINE], *blk;
+	int r;
+
+	if (!(f->f_flags & F_INLINE))
+		return 0;
+	memmove(data, f->f_inline, MAXINLINE);
+	memset(f->f_inline, 0, MAXINLINE);
+	f->f_flags = (f->f_flags & ~F_INLINE) | F_EXTENTS;
+	if (f->f_size > 0) {
+		if ((blk = file_delay_block(f, 0)) == NULL) {
+			if ((r = file_get_block(f, 0, &blk)) < 0) {
+				f->f_flags = (f->f_flags & ~F_EXTENTS) | F_INLINE;
+				memmove(f->f_inline, data, MAXINLINE);
+				return r;
+			}
+			bc_mark_dirty(((uintptr_t) blk - DISKMAP) / BLKSIZE);
+		}
+		memmove(blk, data, MAXINLINE);
+	}
+	bc_mark_dirty(file_home(f));
+	fs_stats.fs_promoted++;
+	return 0;
 }
 
 // Set *blk to the address in memory where the filebno'th
-// block of file 'f' would be mapped.
+// block of file 'f' would be mapped, allocating the block if needed.
+// Inline files are moved out to blocks first.
+// Extent-mapped files have no holes, so every block between the
+// current end of the map and filebno is allocated as well.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-    // LAB 10: Your code here.
-    uint32_t *pb;
-	uint32_t bno;
-	int err;
-	if (filebno >= NDIRECT + NINDIRECT) {
-		return -E_INVAL;
-	}
-	if ((err = file_block_walk(f, filebno, &pb, 1)) < 0) {
-		return err;
+	uint32_t *pb, bno, nblocks;
+	int r;
+
+	if ((r = file_promote(f)) < 0)
+		return r;
+	if (f->f_flags & F_EXTENTS) {
+		// The block must be in the block cache, so blocks still
+		// waiting for disk blocks cannot wait any longer.
+		if ((r = file_commit_delayed(f)) < 0)
+			return r;
+		if ((r = file_map_block(f, filebno, &bno, 0)) < 0)
+			return r;
+		if (!bno) {
+			for (nblocks = file_extent_blocks(f); nblocks <= filebno; nblocks++)
+				if ((r = file_append_block(f)) < 0)
+					return r;
+			if ((r = file_map_block(f, filebno, &bno, 0)) < 0)
+				return r;
+		}
+		*blk = (char *) diskaddr(bno);
+		return 0;
 	}
+
+	if ((r = file_block_walk(f, filebno, &pb, 1)) < 0)
+		return r;
 	if (!*pb) {
-		if ((bno = alloc_block()) < 0) {
-			return -E_NO_DISK;
-		}
-		*pb = bno;
-		memset(diskaddr(bno), 0, BLKSIZE);
+		if ((r = alloc_block_near(file_goal(f, filebno))) < 0)
+			return r;
+		*pb = r;
+		memset(diskaddr(r), 0, BLKSIZE);
 	}
 	*blk = (char *) diskaddr(*pb);
 	return 0;
-    //panic("file_get_block not implemented");
+}
+
+// Like file_get_block, but also return the number of file blocks,
+// starting at filebno, that can be accessed contiguously from *blk.
+// The run is capped so that its length in bytes fits in an off_t.
+// Returns that number (at least 1) on success, < 0 on error.
+static int
+file_get_run(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t bno, nrun;
+	int r;
+
+	if ((r = file_map_block(f, filebno, &bno, &nrun)) < 0)
+		return r;
+	if (!bno) {
+		if ((r = file_get_block(f, filebno, blk)) < 0)
+			return r;
+		return 1;
+	}
+	*blk = (char *) diskaddr(bno);
+	return MIN(nrun, MAXFILESIZE / BLKSIZE);
+}
+
+// Set *pf to the directory entry in slot 'slot' of 'dir'.
+// Returns 0 on success, < 0 on error.
+static int
+dir_slot(struct File *dir, uint32_t slot, struct File **pf)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(dir, slot / BLKFILES, &blk)) < 0)
+		return r;
+	*pf = (struct File *) blk + slot % BLKFILES;
+	return 0;
+}
+
+// Give the empty directory 'dir' a hash index.
+// Returns 0 on success, < 0 on error.
+static int
+dir_index_init(struct File *dir)
+{
+	int r;
+
+	if ((r = alloc_block_near(file_home(dir) + 1)) < 0)
+		return r;
+	memset(diskaddr(r), 0, BLKSIZE);
+	dir->f_hindex = r;
+	dir->f_flags |= F_HASHED;
+	return 0;
+}
+
+// Entries written before struct File had f_flags, f_hindex and f_hnext
+// carry whatever was left in the old f_pad there.  Clear flags that
+// are unknown, or that do not fit the rest of the entry, so that such
+// a file is read with the legacy map.  Stray bits that do look valid
+// cannot be told apart; images that old should be made again with
+// fsformat.
+static void
+file_check_flags(struct File *f)
+{
+	uint32_t flags = f->f_flags;
+
+	if ((flags & ~(F_EXTENTS | F_HASHED | F_INLINE))
+	    || (flags & (F_EXTENTS | F_INLINE)) == (F_EXTENTS | F_INLINE)
+	    || ((flags & F_EXTENTS) && f->f_nextents > MAXEXTENTS)
+	    || ((flags & F_INLINE)
+		&& (f->f_type != FTYPE_REG || f->f_size > MAXINLINE))
+	    || ((flags & F_HASHED)
+		&& (f->f_type != FTYPE_DIR || f->f_hindex < 2
+		    || f->f_hindex >= super->s_nblocks)))
+		flags = 0;
+	if (flags != f->f_flags) {
+		cprintf("warning: %s: bad flags %08x\n", f->f_name, f->f_flags);
+		f->f_flags = flags;
+	}
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
+// Hashed directories only look at the entries in name's hash chain;
+// others are searched linearly.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
@@ -208,9 +829,24 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, slot;
 	char *blk;
 	struct File *f;
+	struct DirIndex *idx;
+
+	if (dir->f_flags & F_HASHED) {
+		idx = (struct DirIndex *) diskaddr(dir->f_hindex);
+		for (slot = idx->di_bucket[dir_hash(name)]; slot; slot = f->f_hnext) {
+			if ((r = dir_slot(dir, slot - 1, &f)) < 0)
+				return r;
+			if (strcmp(f->f_name, name) == 0) {
+				file_check_flags(f);
+				*file = f;
+				return 0;
+			}
+		}
+		return -E_NOT_FOUND;
+	}
 
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
@@ -223,6 +859,7 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
+				file_check_flags(&f[j]);
 				*file = &f[j];
 				return 0;
 			}
@@ -230,15 +867,102 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Pack the entries of 'dir' from slot *pslot on into 'buf', which has
+// room for 'n' bytes, as struct Dirents.  Stops at the first entry that
+// does not fit, and sets *pslot to the slot to go on from.
+// Returns the number of bytes packed, or < 0 on error.
+ssize_t
+dir_read(struct File *dir, uint32_t *pslot, char *buf, size_t n)
+{
+	int r;
+	uint32_t slot, nslot;
+	size_t len = 0, namelen;
+	struct File *f;
+	struct Dirent *d;
+
+	nslot = dir->f_size / sizeof(struct File);
+	for (slot = *pslot; slot < nslot; slot++) {
+		if ((r = dir_slot(dir, slot, &f)) < 0)
+			return r;
+		if (f->f_name[0] == '\0')
+			continue;
+		namelen = strlen(f->f_name);
+		if (len + DIRENT_SIZE(namelen) > n)
+			break;
+		d = (struct Dirent *) (buf + len);
+		d->d_size = f->f_size;
+		d->d_reclen = DIRENT_SIZE(namelen);
+		d->d_type = f->f_type;
+		d->d_namelen = namelen;
+		memcpy(d->d_name, f->f_name, namelen + 1);
+		len += d->d_reclen;
+	}
+	*pslot = slot;
+	return len;
+}
+
+// Take a free slot of hashed directory 'dir' off its free chain,
+// growing the directory by a block if there is none.
+// Sets *slot on success; returns < 0 on error.
+static int
+dir_alloc_slot(struct File *dir, uint32_t *slot)
+{
+	int r;
+	uint32_t j, nblock;
+	char *blk;
+	struct File *f;
+	struct DirIndex *idx;
+
+	idx = (struct DirIndex *) diskaddr(dir->f_hindex);
+	if (!idx->di_free) {
+		assert((dir->f_size % BLKSIZE) == 0);
+		nblock = dir->f_size / BLKSIZE;
+		if ((r = file_get_block(dir, nblock, &blk)) < 0)
+			return r;
+		dir->f_size += BLKSIZE;
+		f = (struct File *) blk;
+		for (j = BLKFILES; j-- > 0; ) {
+			f[j].f_hnext = idx->di_free;
+			idx->di_free = nblock * BLKFILES + j + 1;
+		}
+	}
+	if ((r = dir_slot(dir, idx->di_free - 1, &f)) < 0)
+		return r;
+	*slot = idx->di_free - 1;
+	idx->di_free = f->f_hnext;
+	return 0;
+}
+
+// Set *file to point at a free File structure in dir, cleared and
+// named 'name'.  The caller is responsible for filling in the other
+// File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
+	uint32_t nblock, i, j, slot, h;
 	char *blk;
 	struct File *f;
+	struct DirIndex *idx;
+
+	if (!(dir->f_flags & F_HASHED) && dir->f_size == 0)
+		if ((r = dir_index_init(dir)) < 0)
+			return r;
+
+	if (dir->f_flags & F_HASHED) {
+		if ((r = dir_alloc_slot(dir, &slot)) < 0)
+			return r;
+		if ((r = dir_slot(dir, slot, &f)) < 0)
+			return r;
+		memset(f, 0, sizeof(*f));
+		strcpy(f->f_name, name);
+		idx = (struct DirIndex *) diskaddr(dir->f_hindex);
+		h = dir_hash(name);
+		f->f_hnext = idx->di_bucket[h];
+		idx->di_bucket[h] = slot + 1;
+		*file = f;
+		return 0;
+	}
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
@@ -247,19 +971,125 @@ dir_alloc_file(struct File *dir, struct File **file)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+			if (f[j].f_name[0] == '\0')
+				goto found;
 	}
 	dir->f_size += BLKSIZE;
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
-	*file = &f[0];
+	j = 0;
+
+found:
+	memset(&f[j], 0, sizeof(f[j]));
+	strcpy(f[j].f_name, name);
+	*file = &f[j];
 	return 0;
 }
 
+// Remove entry 'f' from the hash chains of hashed directory 'dir'
+// and put its slot back on the free chain.
+// Returns 0 on success, < 0 on error.
+static int
+dir_unlink(struct File *dir, struct File *f)
+{
+	int r;
+	uint32_t slot;
+	struct File *g, *prev = NULL;
+	struct DirIndex *idx;
+
+	idx = (struct DirIndex *) diskaddr(dir->f_hindex);
+	for (slot = idx->di_bucket[dir_hash(f->f_name)]; slot; slot = g->f_hnext) {
+		if ((r = dir_slot(dir, slot - 1, &g)) < 0)
+			return r;
+		if (g == f) {
+			if (prev)
+				prev->f_hnext = f->f_hnext;
+			else
+				idx->di_bucket[dir_hash(f->f_name)] = f->f_hnext;
+			f->f_hnext = idx->di_free;
+			idx->di_free = slot;
+			return 0;
+		}
+		prev = g;
+	}
+	return -E_NOT_FOUND;
+}
+
+// --------------------------------------------------------------
+// Path-resolution cache
+// --------------------------------------------------------------
+
+// Caches the result of dir_lookup(dir, name), so reopening a path does
+// not search every directory along it again.  A null d_file records
+// that the name does not exist.  Entries hold pointers into the block
+// cache, which stay valid as long as the directory entry is not
+// removed, so every change to a directory's entries must update the
+// cache through dentry_set or dentry_flush.
+
+#define NDENTRY		256
+
+struct Dentry {
+	struct File *d_dir;		// directory searched; 0 if unused
+	struct File *d_file;		// entry found, or 0 if none
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dentries[NDENTRY];
+
+static struct Dentry *
+dentry_slot(struct File *dir, const char *name)
+{
+	return &dentries[(dir_hash(name) ^ ((uintptr_t) dir >> 8)) % NDENTRY];
+}
+
+// Look up (dir, name) in the cache.
+// Returns 0 and sets *file on a hit (*file is 0 for a cached miss),
+// -E_NOT_FOUND if the cache has nothing for the name.
+static int
+dentry_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dentry_slot(dir, name);
+
+	if (d->d_dir != dir || strcmp(d->d_name, name) != 0)
+		return -E_NOT_FOUND;
+	*file = d->d_file;
+	return 0;
+}
+
+// Record that looking up 'name' in 'dir' yields 'file' (0 for none).
+static void
+dentry_set(struct File *dir, const char *name, struct File *file)
+{
+	struct Dentry *d = dentry_slot(dir, name);
+
+	d->d_dir = dir;
+	d->d_file = file;
+	strcpy(d->d_name, name);
+}
+
+// Forget everything in the cache.
+static void
+dentry_flush(void)
+{
+	memset(dentries, 0, sizeof(dentries));
+}
+
+// dir_lookup through the path-resolution cache.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	int r;
+
+	if (dentry_lookup(dir, name, file) == 0)
+		return *file ? 0 : -E_NOT_FOUND;
+	if ((r = dir_lookup(dir, name, file)) == 0)
+		dentry_set(dir, name, *file);
+	else if (r == -E_NOT_FOUND)
+		dentry_set(dir, name, 0);
+	return r;
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -307,7 +1137,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -329,10 +1159,11 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 // File operations
 // --------------------------------------------------------------
 
-// Create "path".  On success set *pf to point at the file and return 0.
+// Create "path" as a file of type 'type' (FTYPE_REG or FTYPE_DIR).
+// On success set *pf to point at the file and return 0.
 // On error return < 0.
 int
-file_create(const char *path, struct File **pf)
+file_create(const char *path, uint32_t type, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
@@ -342,10 +1173,13 @@ file_create(const char *path, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
 
-	strcpy(f->f_name, name);
+	f->f_type = type;
+	// Directories need blocks for their entries from the start.
+	f->f_flags = type == FTYPE_REG ? F_INLINE : F_EXTENTS;
+	dentry_set(dir, name, f);
 	*pf = f;
 	file_flush(dir);
 	return 0;
@@ -359,25 +1193,104 @@ file_open(const char *path, struct File **pf)
 	return walk_path(path, 0, pf, 0);
 }
 
+// --------------------------------------------------------------
+// Read-ahead
+// --------------------------------------------------------------
+
+// Sequential readers of a file get the blocks after the ones they read
+// fetched in advance, in as few disk commands as the file's layout
+// allows.  The window starts at RA_MINWINDOW blocks and doubles with
+// every further sequential block up to RA_MAXWINDOW; a read elsewhere
+// in the file turns read-ahead off until reads are sequential again.
+
+#define NREADAHEAD	16
+#define RA_MINWINDOW	4
+#define RA_MAXWINDOW	BC_MAXRUN
+
+struct Readahead {
+	struct File *ra_file;
+	uint32_t ra_next;		// block after the last one read
+	uint32_t ra_ahead;		// first block not yet read ahead
+	uint32_t ra_window;		// read-ahead size; 0 if off
+};
+
+static struct Readahead readahead[NREADAHEAD];
+
+// Note that file blocks 'first' through 'last' of 'f' are about to be
+// read, and read ahead of them if the file is being read sequentially.
+static void
+file_readahead(struct File *f, uint32_t first, uint32_t last)
+{
+	struct Readahead *ra;
+	uint32_t bno, end, diskbno, nrun;
+
+	ra = &readahead[((uintptr_t) f / sizeof(struct File)) % NREADAHEAD];
+	if (ra->ra_file != f || first > ra->ra_next || first + 1 < ra->ra_next) {
+		// Reads from the start of a file are likely to continue.
+		ra->ra_file = f;
+		ra->ra_window = first == 0 ? RA_MINWINDOW : 0;
+		ra->ra_ahead = first;
+	} else if (first == ra->ra_next)
+		ra->ra_window = MIN(MAX(ra->ra_window * 2, RA_MINWINDOW), RA_MAXWINDOW);
+	ra->ra_next = last + 1;
+
+	// Top the window up once half of it has been consumed, so that
+	// disk commands stay large.
+	end = MIN(last + 1 + ra->ra_window, (f->f_size + BLKSIZE - 1) / BLKSIZE);
+	if (ra->ra_window == 0 || ra->ra_ahead >= last + 1 + ra->ra_window / 2)
+		return;
+	for (bno = MAX(ra->ra_ahead, first); bno < end; bno += nrun) {
+		if (file_map_block(f, bno, &diskbno, &nrun) < 0 || !diskbno)
+			break;
+		nrun = MIN(nrun, end - bno);
+		bc_prefetch(diskbno, nrun);
+	}
+	ra->ra_ahead = bno;
+}
+
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
+// Holes read as zeros and are left unallocated, so reading never
+// changes the file system; blocks waiting for a disk block are read
+// where they wait.
 // Returns the number of bytes read, < 0 on error.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
-	int r, bn;
+	uint32_t bno, nrun;
+	int r, bn, i;
 	off_t pos;
 	char *blk;
 
-	if (offset >= f->f_size)
+	if (offset >= f->f_size || count == 0)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	if (f->f_flags & F_INLINE) {
+		memmove(buf, f->f_inline + offset, count);
+		return count;
+	}
+	file_readahead(f, offset / BLKSIZE, (offset + count - 1) / BLKSIZE);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_map_block(f, pos / BLKSIZE, &bno, &nrun)) < 0)
 			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		if (!bno) {
+			bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+			if ((i = delay_find(f, pos / BLKSIZE)) >= 0)
+				memmove(buf, DELAYPAGE(i) + pos % BLKSIZE, bn);
+			else
+				memset(buf, 0, bn);
+			pos += bn;
+			buf += bn;
+			continue;
+		}
+		blk = diskaddr(bno);
+		nrun = MIN(nrun, MAXFILESIZE / BLKSIZE);
+		bn = MIN(nrun * BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		for (i = 0; i < pos % BLKSIZE + bn; i += BLKSIZE)
+			if (va_is_mapped(blk + i))
+				fs_stats.fs_bc_hits++;
 		memmove(buf, blk + pos % BLKSIZE, bn);
 		pos += bn;
 		buf += bn;
@@ -386,28 +1299,97 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Find the block of f holding byte 'offset' and make sure it is in the
+// block cache, so that it can be shared with a client instead of being
+// copied.  Sets *pblk to the start of the cached block.
+// Returns the number of bytes of the file from 'offset' to the end of
+// the block, 0 if offset is at or past the end of the file, or < 0 on
+// error.  Inline files have no block to share: the result for them is
+// -E_NOT_SUPP, and callers that must have a block use file_promote.
+int
+file_map(struct File *f, off_t offset, char **pblk)
+{
+	uint32_t bno = offset / BLKSIZE;
+	int r;
+
+	if (offset < 0 || offset >= f->f_size)
+		return 0;
+	if (f->f_flags & F_INLINE)
+		return -E_NOT_SUPP;
+
+	file_readahead(f, bno, bno);
+	if ((r = file_get_block(f, bno, pblk)) < 0)
+		return r;
+	if (va_is_mapped(*pblk))
+		fs_stats.fs_bc_hits++;
+	else
+		// Fault the block in: only mapped pages can be sent.
+		(void) *(volatile char *) *pblk;
+	return MIN(BLKSIZE - offset % BLKSIZE, f->f_size - offset);
+}
+
+// Add the cached blocks of f in [offset, offset + len) to the dirty
+// set.  Clients that write to blocks through pages shared with them by
+// file_map report their writes this way, since we cannot see the
+// dirty bits of their page table entries.
+void
+file_mark_dirty(struct File *f, off_t offset, size_t len)
+{
+	uint32_t bno, end, diskbno;
+
+	if (offset < 0 || offset >= f->f_size || len == 0)
+		return;
+	end = (MIN(offset + len, f->f_size) + BLKSIZE - 1) / BLKSIZE;
+	for (bno = offset / BLKSIZE; bno < end; bno++)
+		if (file_map_block(f, bno, &diskbno, NULL) == 0 && diskbno
+		    && va_is_mapped(diskaddr(diskbno)))
+			bc_mark_dirty(diskbno);
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
-// Extends the file if necessary.
-// Returns the number of bytes written, < 0 on error.
+// Extends the file if necessary, moving it out of line if it gets too
+// big.  Blocks past the end of the file's map may be left waiting for
+// a disk block; see file_delay_block.
+// Returns the number of bytes written, < 0 on error; -E_INVAL if the
+// write would take the file past MAXFILESIZE.
 int
 file_write(struct File *f, const void *buf, size_t count, off_t offset)
 {
-	int r, bn;
+	int r, bn, i;
 	off_t pos;
 	char *blk;
 
+	if (offset < 0 || offset > MAXFILESIZE
+	    || count > (size_t) (MAXFILESIZE - offset))
+		return -E_INVAL;
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
+	if (f->f_flags & F_INLINE) {
+		memmove(f->f_inline + offset, buf, count);
+		bc_mark_dirty(file_home(f));
+		return count;
+	}
+
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((blk = file_delay_block(f, pos / BLKSIZE)) != NULL) {
+			bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+			memmove(blk + pos % BLKSIZE, buf, bn);
+			pos += bn;
+			buf += bn;
+			continue;
+		}
+		if ((r = file_get_run(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		bn = MIN(r * BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
+		for (i = 0; i < pos % BLKSIZE + bn; i += BLKSIZE)
+			bc_mark_dirty(((uintptr_t) blk + i - DISKMAP) / BLKSIZE);
 		pos += bn;
 		buf += bn;
 	}
@@ -415,6 +1397,126 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// --------------------------------------------------------------
+// Direct transfers
+// --------------------------------------------------------------
+
+// Files opened with O_DIRECT have their bulk reads and writes moved
+// between the client's pages and the disk without the block cache, so
+// that streaming a large file neither copies it through the cache nor
+// pushes other files' blocks out of it.  Blocks that happen to be
+// cached are read from and written to there instead (see bc_direct),
+// so the cache and the disk never disagree.  Only whole blocks of
+// regular files go directly; transfers that do not start on a block
+// boundary, and the last part of a write that is not a whole block, go
+// through the cache as usual.
+
+// Give blocks 'filebno' on of file 'f', which have none yet, up to
+// 'want' disk blocks for a direct write to fill.  Unlike file_get_block
+// this leaves them out of the cache, where their contents would only be
+// overwritten.  Sets *pbno to the first disk block and *pnrun to how
+// many follow it.
+// Returns 0 on success, < 0 on error.
+static int
+file_alloc_direct(struct File *f, uint32_t filebno, uint32_t want,
+		  uint32_t *pbno, uint32_t *pnrun)
+{
+	uint32_t start;
+	char *blk;
+	int r, n;
+
+	// Legacy maps allocate a block at a time anyway.  Extent maps
+	// have no holes, so blocks up to filebno get zeroed ones.
+	if (!(f->f_flags & F_EXTENTS) || filebno > file_extent_blocks(f)) {
+		if ((r = file_get_block(f, filebno, &blk)) < 0)
+			return r;
+		return file_map_block(f, filebno, pbno, pnrun);
+	}
+
+	if ((n = alloc_run(want, file_goal(f, filebno), &start)) < 0)
+		return n;
+	if ((r = file_extend_map(f, start, n)) < 0) {
+		while (n-- > 0)
+			free_block(start + n);
+		return r;
+	}
+	*pbno = start;
+	*pnrun = n;
+	return 0;
+}
+
+// Read like file_read, but move whole blocks without the block cache.
+// 'buf' must have room for 'count' rounded up to a whole block.
+// Returns the number of bytes read, < 0 on error.
+ssize_t
+file_read_direct(struct File *f, void *buf, size_t count, off_t offset)
+{
+	uint32_t bno, nrun;
+	size_t pos;
+	int r, i;
+
+	if (f->f_type != FTYPE_REG || (f->f_flags & F_INLINE) || offset % BLKSIZE)
+		return file_read(f, buf, count, offset);
+	if (offset >= f->f_size || count == 0)
+		return 0;
+
+	count = MIN(count, f->f_size - offset);
+	for (pos = 0; pos < count; pos += nrun * BLKSIZE) {
+		if ((r = file_map_block(f, (offset + pos) / BLKSIZE, &bno, &nrun)) < 0)
+			return r;
+		if (!bno) {
+			if ((i = delay_find(f, (offset + pos) / BLKSIZE)) >= 0)
+				memmove(buf + pos, DELAYPAGE(i), BLKSIZE);
+			else
+				memset(buf + pos, 0, BLKSIZE);
+			nrun = 1;
+			continue;
+		}
+		nrun = MIN(nrun, ROUNDUP(count - pos, BLKSIZE) / BLKSIZE);
+		bc_direct(bno, buf + pos, nrun, 0);
+	}
+	return count;
+}
+
+// Write like file_write, but move whole blocks without the block cache.
+// Returns the number of bytes written, < 0 on error.
+int
+file_write_direct(struct File *f, const void *buf, size_t count, off_t offset)
+{
+	uint32_t bno, nrun;
+	size_t pos;
+	int r;
+
+	if (f->f_type != FTYPE_REG || offset % BLKSIZE || count < BLKSIZE)
+		return file_write(f, buf, count, offset);
+	if (offset < 0 || offset > MAXFILESIZE
+	    || count > (size_t) (MAXFILESIZE - offset))
+		return -E_INVAL;
+
+	// Extending the file moves it out of line, as it gets at least a
+	// block.  Blocks still waiting for disk blocks come first in the
+	// map.
+	if (offset + count > f->f_size
+	    && (r = file_set_size(f, offset + count)) < 0)
+		return r;
+	if ((r = file_commit_delayed(f)) < 0)
+		return r;
+
+	for (pos = 0; pos + BLKSIZE <= count; pos += nrun * BLKSIZE) {
+		if ((r = file_map_block(f, (offset + pos) / BLKSIZE, &bno, &nrun)) < 0)
+			return r;
+		if (!bno && (r = file_alloc_direct(f, (offset + pos) / BLKSIZE,
+						   (count - pos) / BLKSIZE,
+						   &bno, &nrun)) < 0)
+			return r;
+		nrun = MIN(nrun, (count - pos) / BLKSIZE);
+		bc_direct(bno, (void *) buf + pos, nrun, 1);
+	}
+	if (pos < count && (r = file_write(f, buf + pos, count - pos, offset + pos)) < 0)
+		return r;
+	return count;
+}
+
 // Remove a block from file f.  If it's not there, just silently succeed.
 // Returns 0 on success, < 0 on error.
 static int
@@ -432,6 +1534,34 @@ file_free_block(struct File *f, uint32_t filebno)
 	return 0;
 }
 
+// Remove the blocks of extent-mapped file 'f' that are not needed
+// for a file of 'new_nblocks' blocks, shortening or dropping extents.
+static void
+file_truncate_extents(struct File *f, uint32_t new_nblocks)
+{
+	struct Extent *e;
+	uint32_t i, bno, nextents, keep;
+
+	nextents = 0;
+	for (i = 0; i < f->f_nextents; i++) {
+		e = file_extent(f, i);
+		keep = MIN(e->e_len, new_nblocks);
+		for (bno = e->e_start + keep; bno < e->e_start + e->e_len; bno++)
+			free_block(bno);
+		new_nblocks -= keep;
+		if ((e->e_len = keep) != 0)
+			nextents = i + 1;
+		else
+			e->e_start = 0;
+	}
+	f->f_nextents = nextents;
+
+	if (nextents <= NEXTENT && f->f_xblock) {
+		free_block(f->f_xblock);
+		f->f_xblock = 0;
+	}
+}
+
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
@@ -449,6 +1579,23 @@ file_truncate_blocks(struct File *f, off_t newsize)
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (new_nblocks == 0 && (f->f_flags & F_HASHED)) {
+		free_block(f->f_hindex);
+		f->f_hindex = 0;
+		f->f_flags &= ~F_HASHED;
+	}
+	if (f->f_flags & F_INLINE) {
+		// Keep the bytes past the end zero, for when it grows.
+		if (newsize < f->f_size)
+			memset(f->f_inline + newsize, 0, f->f_size - newsize);
+		return;
+	}
+	if (f->f_flags & F_EXTENTS) {
+		delay_truncate(f, new_nblocks);
+		file_truncate_extents(f, new_nblocks);
+		return;
+	}
+
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %i", r);
@@ -459,36 +1606,153 @@ file_truncate_blocks(struct File *f, off_t newsize)
 	}
 }
 
+// Return true if a block of 'f' from file block 'first' on is still
+// mapped into a client (read_map hands out the cache pages themselves),
+// so that freeing it would leave the client a page of whatever the
+// block is reused for.
+static bool
+file_blocks_mapped(struct File *f, uint32_t first)
+{
+	uint32_t filebno, nblocks, bno, nrun, i;
+
+	nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	for (filebno = first; filebno < nblocks; filebno += MAX(nrun, 1)) {
+		if (file_map_block(f, filebno, &bno, &nrun) < 0)
+			break;
+		if (bno == 0 && (f->f_flags & F_EXTENTS))
+			break;
+		for (i = 0; i < nrun && filebno + i < nblocks; i++)
+			if (pageref(diskaddr(bno + i)) > 1)
+				return 1;
+	}
+	return 0;
+}
+
 // Set the size of file f, truncating or extending as necessary.
+// An inline file that would no longer fit is moved out to blocks.
+// The new size and the blocks freed go to the journal together.
+// Returns -E_INVAL if the size is negative or more than the file's
+// map can describe: MAXFILESIZE, or MAXLEGACYSIZE for the legacy map.
+// Returns -E_BUSY if a block that would be freed is mapped by a client.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	int r;
+
+	if (newsize < 0 || newsize > MAXFILESIZE
+	    || (newsize > MAXLEGACYSIZE
+		&& !(f->f_flags & (F_EXTENTS | F_INLINE))))
+		return -E_INVAL;
+	if (f->f_size > newsize
+	    && file_blocks_mapped(f, (newsize + BLKSIZE - 1) / BLKSIZE))
+		return -E_BUSY;
+	if ((f->f_flags & F_INLINE) && newsize > MAXINLINE
+	    && (r = file_promote(f)) < 0)
+		return r;
+	if (f->f_size > newsize) {
+		// Shrinking a directory drops entries the path cache may hold.
+		if (f->f_type == FTYPE_DIR)
+			dentry_flush();
 		file_truncate_blocks(f, newsize);
+	}
 	f->f_size = newsize;
-	flush_block(f);
+	journal_block(f);
+	flush_bitmap();
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Flush the contents and metadata of file f out to disk, first giving
+// any of its blocks that wait for disk blocks their place.
+// Extent-mapped files are written back an extent at a time, with runs
+// of dirty blocks merged into single disk commands.  For files using
+// the legacy map, loop over all the blocks in the file and write out
+// the dirty ones.  Inline files only have their File to write.
+//
+// The contents of regular files are written in place first.  The
+// blocks of directories, and all the blocks describing the file, are
+// metadata: they go to the journal, and reach the disk when the
+// running transaction is committed.
 void
 file_flush(struct File *f)
 {
-	int i;
+	struct Extent *e;
+	uint32_t i;
 	uint32_t *pdiskbno;
+	bool meta = f->f_type == FTYPE_DIR;
+	int r;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
+	if ((r = file_commit_delayed(f)) < 0)
+		cprintf("warning: file_commit_delayed: %i\n", r);
+	if (f->f_flags & F_EXTENTS) {
+		for (i = 0; i < f->f_nextents; i++) {
+			e = file_extent(f, i);
+			if (meta)
+				journal_range(e->e_start, e->e_len);
+			else
+				bc_flush_range(e->e_start, e->e_len);
+		}
+		if (f->f_xblock)
+			journal_block(diskaddr(f->f_xblock));
+	} else if (!(f->f_flags & F_INLINE)) {
+		for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
+			if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
+			    pdiskbno == NULL || *pdiskbno == 0)
+				continue;
+			if (meta)
+				journal_block(diskaddr(*pdiskbno));
+			else
+				flush_block(diskaddr(*pdiskbno));
+		}
+		if (f->f_indirect)
+			journal_block(diskaddr(f->f_indirect));
 	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	if (f->f_flags & F_HASHED)
+		journal_block(diskaddr(f->f_hindex));
+	journal_block(f);
+	flush_bitmap();
+}
+
+
+// Remove "path", freeing its blocks.  Directories must be empty.
+// Returns 0 on success, < 0 on error; -E_BUSY if a client still maps
+// a block of the file.
+int
+file_remove(const char *path)
+{
+	int r;
+	uint32_t i, j, nblock;
+	char *blk;
+	struct File *dir, *f, *ents;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (dir == 0)
+		return -E_INVAL;
+	if (file_blocks_mapped(f, 0))
+		return -E_BUSY;
+
+	if (f->f_type == FTYPE_DIR) {
+		nblock = f->f_size / BLKSIZE;
+		for (i = 0; i < nblock; i++) {
+			if ((r = file_get_block(f, i, &blk)) < 0)
+				return r;
+			ents = (struct File *) blk;
+			for (j = 0; j < BLKFILES; j++)
+				if (ents[j].f_name[0] != '\0')
+					return -E_INVAL;
+		}
+		// Entries cached under this directory are about to dangle.
+		dentry_flush();
+	}
+
+	if ((dir->f_flags & F_HASHED) && (r = dir_unlink(dir, f)) < 0)
+		return r;
+	dentry_set(dir, f->f_name, 0);
+	file_truncate_blocks(f, 0);
+	f->f_size = 0;
+	f->f_name[0] = '\0';
+	file_flush(dir);
+	return 0;
 }
 
 
@@ -496,8 +1760,8 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	delay_commit_all();
+	journal_sync();
+	bc_sync();
 }
 
@@ -11,39 +11,137 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most blocks the block cache reads with one disk command
+ * (ide_read takes at most 256 sectors). */
+#define BC_MAXRUN	32
+
+/* Default and smallest block cache budget, in blocks.  The minimum
+ * leaves room for a full read-ahead run next to pinned metadata. */
+#define BC_DEFAULT_BUDGET	1024
+#define BC_MIN_BUDGET		(4 * BC_MAXRUN)
+
+/* A transfer between the disk and memory.  The buffer must be mapped;
+ * it need not be physically contiguous. */
+struct DiskReq {
+	uint32_t dr_secno;		// first sector
+	void *dr_buf;			// buffer in our address space
+	uint32_t dr_nsecs;		// number of sectors
+	bool dr_write;			// memory to disk if set
+};
+
+/* Most requests the block cache hands the disk at once */
+#define BC_MAXBATCH	16
+
+/* Threads the server serves requests with */
+#define NFSTHREAD	8
+
+/* PCI configuration space registers */
+#define PCI_ID		0x00		// vendor ID, device ID
+#define PCI_COMMAND	0x04
+#define PCI_CLASS	0x08		// revision, prog-if, subclass, class
+#define PCI_BAR(n)	(0x10 + 4 * (n))
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
 /* ide.c */
-bool	ide_probe_disk1(void);
+bool	ide_probe_disk(int diskno);
 void	ide_set_disk(int diskno);
+bool	ide_dma_init(void);
+bool	ide_irq_init(void);
+bool	ide_irq_on(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+int	ide_start(int diskno, uint32_t secno, void *va, size_t nsecs, bool write);
+int	ide_poll(int diskno);
+void	ide_pause(int diskno);
+
+/* pci.c */
+uint32_t pci_conf_read(uint32_t dev, uint32_t func, uint32_t off);
+void	pci_conf_write(uint32_t dev, uint32_t func, uint32_t off, uint32_t v);
+bool	pci_find(bool (*match)(uint32_t dev, uint32_t func),
+		 uint32_t *pdev, uint32_t *pfunc);
+void	pci_enable_io(uint32_t dev, uint32_t func);
+
+/* virtio.c */
+bool	virtio_blk_init(void);
+int	virtio_blk_submit(struct DiskReq *reqs, int n);
+
+/* disk.c */
+void	disk_init(void);
+int	disk_submit(struct DiskReq *reqs, int n);
+int	disk_read(uint32_t secno, void *dst, size_t nsecs);
+int	disk_write(uint32_t secno, const void *src, size_t nsecs);
+void	disk_pause(void);
+bool	disk_waiting(void);
+void	disk_sleep(bool recving);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_mark_dirty(uint32_t blockno);
+bool	bc_block_dirty(uint32_t blockno);
+void	bc_hold(uint32_t blockno);
+void	bc_release(uint32_t blockno);
+bool	bc_is_held(uint32_t blockno);
+void	bc_insert(uint32_t blockno, void *page);
+void	bc_flush_range(uint32_t blockno, uint32_t nblocks);
+void	bc_sync(void);
+void	bc_set_budget(uint32_t nblocks);
+void	bc_stats(struct FsStats *st);
+int	bc_prefetch(uint32_t blockno, uint32_t nblocks);
+void	bc_direct(uint32_t blockno, void *buf, uint32_t nblocks, bool write);
 void	bc_init(void);
+extern struct FsStats fs_stats;
+
+/* journal.c */
+void	journal_init(void);
+void	journal_block(void *addr);
+void	journal_range(uint32_t blockno, uint32_t nblocks);
+void	journal_freed(uint32_t blockno);
+void	journal_commit(void);
+void	journal_tick(void);
+void	journal_sync(void);
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
-int	file_create(const char *path, struct File **f);
+int	file_create(const char *path, uint32_t type, struct File **f);
+int	file_promote(struct File *f);
+bool	file_has_delayed(struct File *f);
 int	file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc);
+int	file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *pnrun);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+int	file_map(struct File *f, off_t offset, char **pblk);
+void	file_mark_dirty(struct File *f, off_t offset, size_t len);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
+ssize_t	file_read_direct(struct File *f, void *buf, size_t count, off_t offset);
+int	file_write_direct(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
+ssize_t	dir_read(struct File *dir, uint32_t *pslot, char *buf, size_t n);
 void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+uint32_t fs_free_blocks(void);
+
+/* thread.c */
+int	thread_current(void);
+int	thread_reserve(void);
+void	thread_start(int i, void (*fn)(void));
+int	thread_run(void);
+void	thread_yield(void);
+void	thread_wait(void *chan);
+void	thread_wakeup(void *chan);
+bool	thread_parked(void);
 
 /* test.c */
 void	fs_test(void);
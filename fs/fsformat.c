@@ -33,6 +33,12 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+// The file system server can map at most DISKSIZE (3GB) of disk.
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
+// Size of the metadata journal, header block included
+#define NJOURNAL 128
+// Blocks per stripe unit of a striped file system, unless -s says
+#define DEFAULT_STRIPE 8
 
 struct Dir
 {
@@ -43,6 +49,11 @@ struct Dir
 
 uint32_t nblocks;
 char *diskmap, *diskpos;
+// The disk images the file system is on, and how it is striped over
+// them if there are several
+char *disknames[FS_MAXDISKS];
+int ndisks;
+uint32_t stripe = DEFAULT_STRIPE;
 struct Super *super;
 uint32_t *bitmap;
 
@@ -88,10 +99,34 @@ alloc(uint32_t bytes)
 	return start;
 }
 
+// Split the comma-separated list of disk images 'names' into
+// 'disknames'.
 void
-opendisk(const char *name)
+splitnames(char *names)
+{
+	char *name;
+
+	for (ndisks = 0; (name = strsep(&names, ",")); ndisks++) {
+		if (ndisks == FS_MAXDISKS)
+			panic("at most %d disks", FS_MAXDISKS);
+		disknames[ndisks] = name;
+	}
+}
+
+void
+opendisk(void)
 {
 	int r, diskfd, nbitblocks;
+	const char *name = disknames[0];
+	struct JournalHeader *jh;
+
+	if (ndisks > 1) {
+		// Built in memory, then written out a stripe unit at a time
+		if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
+				    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			panic("mmap: %s", strerror(errno));
+		goto format;
+	}
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -106,6 +141,7 @@ opendisk(const char *name)
 
 	close(diskfd);
 
+format:
 	diskpos = diskmap;
 	alloc(BLKSIZE);
 	super = alloc(BLKSIZE);
@@ -117,6 +153,87 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// The log is all zeros, so it holds no transactions.
+	jh = alloc(NJOURNAL * BLKSIZE);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = 1;
+	super->s_journal = blockof(jh);
+	super->s_njournal = NJOURNAL;
+
+	if (ndisks > 1) {
+		super->s_ndisks = ndisks;
+		super->s_stripe = stripe;
+	}
+}
+
+// Length in bytes of stripe unit 'unit' of the file system, the last
+// of which may be short
+uint32_t
+unitlen(uint32_t unit)
+{
+	uint32_t n = nblocks - unit * stripe;
+
+	return (n < stripe ? n : stripe) * BLKSIZE;
+}
+
+// Where stripe unit 'unit' is on its disk, in bytes
+uint32_t
+unitpos(uint32_t unit)
+{
+	return unit / ndisks * stripe * BLKSIZE;
+}
+
+// Write the file system out to the disks, stripe unit 'u' going to
+// disk u % ndisks.  Every disk gets the same size.
+void
+writestripes(void)
+{
+	uint32_t unit, nunits = (nblocks + stripe - 1) / stripe;
+	int d, fd[FS_MAXDISKS];
+
+	for (d = 0; d < ndisks; d++) {
+		if ((fd[d] = open(disknames[d], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+			panic("open %s: %s", disknames[d], strerror(errno));
+		if (ftruncate(fd[d], unitpos(nunits + ndisks - 1)) < 0)
+			panic("truncate %s: %s", disknames[d], strerror(errno));
+	}
+	for (unit = 0; unit < nunits; unit++)
+		if (pwrite(fd[unit % ndisks], diskmap + unit * stripe * BLKSIZE,
+			   unitlen(unit), unitpos(unit)) != unitlen(unit))
+			panic("write %s: %s", disknames[unit % ndisks],
+			      strerror(errno));
+	for (d = 0; d < ndisks; d++)
+		close(fd[d]);
+}
+
+// Read the file system striped over the disks back into memory, given
+// its superblock from the first one.
+void
+readstripes(struct Super *s)
+{
+	uint32_t unit, nunits;
+	int d, fd[FS_MAXDISKS];
+
+	if (ndisks != s->s_ndisks)
+		panic("the file system is striped over %u disks, not %d",
+		      s->s_ndisks, ndisks);
+	if (s->s_stripe < FS_MINSTRIPE || s->s_stripe > FS_MAXSTRIPE)
+		panic("bad stripe unit of %u blocks", s->s_stripe);
+	nblocks = s->s_nblocks;
+	stripe = s->s_stripe;
+	nunits = (nblocks + stripe - 1) / stripe;
+	if (!(diskmap = malloc(nblocks * BLKSIZE)))
+		panic("out of memory");
+	for (d = 0; d < ndisks; d++)
+		if ((fd[d] = open(disknames[d], O_RDONLY)) < 0)
+			panic("open %s: %s", disknames[d], strerror(errno));
+	for (unit = 0; unit < nunits; unit++)
+		if (pread(fd[unit % ndisks], diskmap + unit * stripe * BLKSIZE,
+			  unitlen(unit), unitpos(unit)) != unitlen(unit))
+			panic("%s is too short", disknames[unit % ndisks]);
+	for (d = 0; d < ndisks; d++)
+		close(fd[d]);
 }
 
 void
@@ -127,23 +244,23 @@ finishdisk(void)
 	for (i = 0; i < blockof(diskpos); ++i)
 		bitmap[i/32] &= ~(1<<(i%32));
 
-	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
+	if (ndisks > 1)
+		writestripes();
+	else if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
 		panic("msync: %s", strerror(errno));
 }
 
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
 	f->f_size = len;
+	f->f_flags = F_EXTENTS;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	// Every file is laid out contiguously, so one extent covers it.
+	if (len > 0) {
+		f->f_nextents = 1;
+		f->f_extent[0].e_start = start;
+		f->f_extent[0].e_len = len / BLKSIZE;
 	}
 }
 
@@ -151,7 +268,7 @@ void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -169,10 +286,27 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 void
 finishdir(struct Dir *d)
 {
-	int size = d->n * sizeof(struct File);
+	int i, size = d->n * sizeof(struct File);
+	uint32_t h, nslots;
 	struct File *start = alloc(size);
+	struct DirIndex *idx = alloc(BLKSIZE);
+
+	// Chain the entries into the hash index, and the rest of the
+	// directory's slots into its free chain.
+	for (i = 0; i < d->n; i++) {
+		h = dir_hash(d->ents[i].f_name);
+		d->ents[i].f_hnext = idx->di_bucket[h];
+		idx->di_bucket[h] = i + 1;
+	}
 	memmove(start, d->ents, size);
+	nslots = ROUNDUP(size, BLKSIZE) / sizeof(struct File);
+	for (i = nslots; i-- > d->n; ) {
+		start[i].f_hnext = idx->di_free;
+		idx->di_free = i + 1;
+	}
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	d->f->f_flags |= F_HASHED;
+	d->f->f_hindex = blockof(idx);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -202,16 +336,176 @@ writefile(struct Dir *dir, const char *name)
 		last = name;
 
 	f = diradd(dir, FTYPE_REG, last);
-	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
-	finishfile(f, blockof(start), st.st_size);
+	if (st.st_size <= MAXINLINE) {
+		// Small enough to keep in the File itself.
+		readn(fd, f->f_inline, st.st_size);
+		f->f_size = st.st_size;
+		f->f_flags = F_INLINE;
+	} else {
+		start = alloc(st.st_size);
+		readn(fd, start, st.st_size);
+		finishfile(f, blockof(start), st.st_size);
+	}
+	close(fd);
+}
+
+// Fragmentation report on an existing image
+
+struct Report
+{
+	uint32_t nfiles, ndirs, nfragmented, ninline;
+	uint32_t nblocks, nruns;	// blocks of files, and runs they are in
+};
+
+// Return the disk block holding block 'filebno' of file 'f', 0 if none.
+uint32_t
+file_block(struct File *f, uint32_t filebno)
+{
+	struct Extent e;
+	uint32_t i, n;
+
+	if (f->f_flags & F_INLINE)
+		return 0;
+	if (f->f_flags & F_EXTENTS) {
+		for (i = 0; i < f->f_nextents; i++) {
+			if (i < NEXTENT)
+				e = f->f_extent[i];
+			else
+				e = ((struct Extent *) (diskmap + f->f_xblock * BLKSIZE))
+					[i - NEXTENT];
+			if (filebno < e.e_len)
+				return e.e_start + filebno;
+			filebno -= e.e_len;
+		}
+		return 0;
+	}
+	if (filebno < NDIRECT)
+		return f->f_direct[filebno];
+	n = filebno - NDIRECT;
+	if (!f->f_indirect || n >= NINDIRECT)
+		return 0;
+	return ((uint32_t *) (diskmap + f->f_indirect * BLKSIZE))[n];
+}
+
+// Count the blocks of 'f' and the runs of consecutive disk blocks they
+// are stored in, print 'f' if it is in more than one run, and add it
+// to the report.  Directories are walked too.
+void
+report_file(struct File *f, const char *path, struct Report *rep)
+{
+	uint32_t i, n, bno, prev = 0, nblks = 0, nruns = 0;
+	struct File *ents;
+	char sub[MAXPATHLEN];
+
+	n = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+	for (i = 0; i < n; i++) {
+		if ((bno = file_block(f, i)) == 0)
+			continue;
+		if (bno >= super->s_nblocks)
+			panic("%s: block %u is past the end of the disk", path, bno);
+		if (nblks == 0 || bno != prev + 1)
+			nruns++;
+		nblks++;
+		prev = bno;
+	}
+	if (nruns > 1)
+		printf("%-40s %6u blocks in %u runs\n", path, nblks, nruns);
+	if (f->f_type == FTYPE_DIR)
+		rep->ndirs++;
+	else
+		rep->nfiles++;
+	rep->ninline += (f->f_flags & F_INLINE) != 0;
+	rep->nblocks += nblks;
+	rep->nruns += nruns;
+	rep->nfragmented += nruns > 1;
+
+	if (f->f_type != FTYPE_DIR)
+		return;
+	for (i = 0; i < n; i++) {
+		if ((bno = file_block(f, i)) == 0)
+			continue;
+		ents = (struct File *) (diskmap + bno * BLKSIZE);
+		for (bno = 0; bno < BLKFILES; bno++) {
+			if (!ents[bno].f_name[0])
+				continue;
+			snprintf(sub, sizeof(sub), "%s%s%s", path,
+				 strcmp(path, "/") ? "/" : "", ents[bno].f_name);
+			report_file(&ents[bno], sub, rep);
+		}
+	}
+}
+
+// Print how fragmented the files and the free space of the file system
+// on the disk images in 'disknames' are.
+void
+report(void)
+{
+	struct Report rep;
+	struct stat st;
+	uint32_t i, run = 0, nfree = 0, nfreeruns = 0, largest = 0;
+	const char *name = disknames[0];
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0)
+		panic("open %s: %s", name, strerror(errno));
+	if (fstat(fd, &st) < 0)
+		panic("stat %s: %s", name, strerror(errno));
+	if ((diskmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+	    == MAP_FAILED)
+		panic("mmap %s: %s", name, strerror(errno));
 	close(fd);
+
+	super = (struct Super *) (diskmap + BLKSIZE);
+	bitmap = (uint32_t *) (diskmap + 2 * BLKSIZE);
+	if (st.st_size < 3 * BLKSIZE || super->s_magic != FS_MAGIC)
+		panic("%s: not a JOS file system", name);
+	if (super->s_ndisks > 1) {
+		readstripes(super);
+		super = (struct Super *) (diskmap + BLKSIZE);
+		bitmap = (uint32_t *) (diskmap + 2 * BLKSIZE);
+	} else if ((uint64_t) super->s_nblocks * BLKSIZE > (uint64_t) st.st_size)
+		panic("%s: image is shorter than its %u blocks", name,
+		      super->s_nblocks);
+
+	memset(&rep, 0, sizeof(rep));
+	report_file(&super->s_root, "/", &rep);
+
+	for (i = 0; i <= super->s_nblocks; i++) {
+		if (i < super->s_nblocks && (bitmap[i / 32] & (1U << (i % 32)))) {
+			run++;
+			continue;
+		}
+		if (run) {
+			nfree += run;
+			nfreeruns++;
+			if (run > largest)
+				largest = run;
+		}
+		run = 0;
+	}
+
+	printf("files                %u, %u fragmented, %u inline; %u directories\n",
+	       rep.nfiles, rep.nfragmented, rep.ninline, rep.ndirs);
+	printf("file blocks          %u in %u runs, %.1f blocks per run\n",
+	       rep.nblocks, rep.nruns,
+	       rep.nruns ? (double) rep.nblocks / rep.nruns : 0.0);
+	printf("free blocks          %u of %u in %u runs, largest %u\n",
+	       nfree, super->s_nblocks, nfreeruns, largest);
+	if (super->s_njournal)
+		printf("journal              %u blocks at %u\n",
+		       super->s_njournal, super->s_journal);
+	else
+		printf("journal              none\n");
+	if (super->s_ndisks > 1)
+		printf("striped              over %u disks, %u blocks per unit\n",
+		       super->s_ndisks, super->s_stripe);
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-s STRIPE] fs.img[,fs2.img] NBLOCKS files...\n"
+			"       fsformat -r fs.img[,fs2.img]\n");
 	exit(2);
 }
 
@@ -224,14 +518,30 @@ main(int argc, char **argv)
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	if (argc == 3 && strcmp(argv[1], "-r") == 0) {
+		splitnames(argv[2]);
+		report();
+		return 0;
+	}
+	// Several comma-separated images stripe the file system over
+	// them, in units of STRIPE blocks.
+	if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		stripe = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || stripe < FS_MINSTRIPE
+		    || stripe > FS_MAXSTRIPE)
+			usage();
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 3)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
-	opendisk(argv[1]);
+	splitnames(argv[1]);
+	opendisk();
 
 	startdir(&super->s_root, &root);
 	for (i = 3; i < argc; i++)
@@ -1,5 +1,12 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use PCI bus-master DMA when a
+ * PIIX-style IDE controller is found, and PIO otherwise.  When the
+ * kernel routes the disk interrupt to us, the driver sleeps in
+ * sys_irq_wait while the drive is busy instead of polling.  Inside a
+ * server thread it blocks in disk_pause instead, letting other threads
+ * run until the server's main loop sees the interrupt.  Disks on the
+ * two channels can be given transfers to carry out at the same time
+ * (ide_start, ide_poll).
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,14 +19,80 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+// Disks are numbered 0 to 3: disk d is drive d & 1 of channel d >> 1.
+// A channel carries out one command at a time, but the two channels
+// work at the same time.
+#define IDE_NDISKS	4
+
 static int diskno = 1;
 
+#define PCI_CLASS_IDE	0x0101		// mass storage class, IDE subclass
+
+// Bus-master IDE registers of a channel, relative to its base
+#define BM_CMD		0
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08		// transfer from disk to memory
+#define BM_STATUS	2
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_IRQ	0x04
+#define BM_PRDT		4
+
+// A physical region descriptor: one contiguous piece of a transfer.
+// A region must not cross a 64KB boundary, so the driver gives each
+// page of the buffer its own.
+struct Prd {
+	uint32_t prd_addr;		// physical address
+	uint16_t prd_len;		// byte count
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000		// last descriptor of the table
+
+#define NPRD		(256 * SECTSIZE / PGSIZE + 1)
+
+static struct Prd prdt[2][NPRD] __attribute__((aligned(PGSIZE)));
+
+struct IdeChannel {
+	uint16_t base;			// command block registers
+	uint16_t ctrl;			// device control register
+	int irq;
+	bool irq_on;			// its interrupt is routed to us
+	uint16_t bmbase;		// bus-master registers; 0 if no DMA
+	struct Prd *prdt;
+	physaddr_t prdt_pa;
+
+	// The transfer ide_start began, until ide_poll sees it end
+	bool busy;
+	int diskno;
+	uint32_t secno;
+	void *va;
+	size_t nsecs;
+	bool write;
+};
+
+static struct IdeChannel channels[2] = {
+	{ 0x1F0, 0x3F6, IRQ_IDE, 0, 0, prdt[0] },
+	{ 0x170, 0x376, IRQ_IDE2, 0, 0, prdt[1] },
+};
+
+// Partition of each disk that ide_read and ide_write address
+static uint32_t part_first[IDE_NDISKS];
+static uint32_t part_nsect[IDE_NDISKS] = { ~0U, ~0U, ~0U, ~0U };
+
+static struct IdeChannel *
+ide_channel(int d)
+{
+	if (d < 0 || d >= IDE_NDISKS)
+		panic("bad disk number");
+	return &channels[d >> 1];
+}
+
 static int
-ide_wait_ready(bool check_error)
+ide_wait_ready(struct IdeChannel *ch, bool check_error)
 {
 	int r;
 
-	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+	while (((r = inb(ch->base + 7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
 		/* do nothing */;
 
 	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
@@ -27,86 +100,348 @@ ide_wait_ready(bool check_error)
 	return 0;
 }
 
+// Let others run while disk 'd' is busy: other threads of the server
+// if we are in one, otherwise other environments until the disk's
+// channel interrupts.
+void
+ide_pause(int d)
+{
+	struct IdeChannel *ch = ide_channel(d);
+
+	if (thread_current() >= 0)
+		disk_pause();
+	else if (ch->irq_on)
+		sys_irq_wait(ch->irq);
+	else
+		sys_yield();
+}
+
+// Wait for the drive to finish what it is busy with, sleeping until
+// its interrupt if we get interrupts, or letting other threads run.
+// Reading the status register also acknowledges the interrupt.
+static void
+ide_sleep(struct IdeChannel *ch, int d)
+{
+	if (ch->irq_on || thread_current() >= 0)
+		while (inb(ch->base + 7) & IDE_BSY)
+			ide_pause(d);
+}
+
+// Ask the kernel to deliver both channels' interrupts to us.
+// Returns true if it will deliver the primary channel's.
 bool
-ide_probe_disk1(void)
+ide_irq_init(void)
 {
+	struct IdeChannel *ch;
+	int r;
+
+	for (ch = channels; ch < channels + 2; ch++) {
+		if ((r = sys_irq_listen(ch->irq)) < 0) {
+			cprintf("IDE: no interrupt %d, polling: %i\n", ch->irq, r);
+			continue;
+		}
+		// Clear nIEN in the device control register so the drive
+		// raises its interrupt line.
+		outb(ch->ctrl, 0);
+		ch->irq_on = 1;
+	}
+	return channels[0].irq_on;
+}
+
+// Does the channel of disk 'd' interrupt us?
+bool
+ide_irq_on(int d)
+{
+	return ide_channel(d)->irq_on;
+}
+
+bool
+ide_probe_disk(int d)
+{
+	struct IdeChannel *ch = ide_channel(d);
 	int r, x;
 
-	// wait for Device 0 to be ready
-	ide_wait_ready(0);
+	// A channel with no drives at all reads as all ones.
+	if (inb(ch->base + 7) == 0xFF) {
+		cprintf("Device %d presence: 0\n", d);
+		return 0;
+	}
 
-	// switch to Device 1
-	outb(0x1F6, 0xE0 | (1<<4));
+	// switch to the drive
+	outb(ch->base + 6, 0xE0 | ((d&1)<<4));
 
-	// check for Device 1 to be ready for a while
+	// check for it to be ready for a while; a missing drive reads
+	// as zero
 	for (x = 0;
-	     x < 1000 && ((r = inb(0x1F7)) & (IDE_BSY|IDE_DF|IDE_ERR)) != 0;
+	     x < 1000 && ((r = inb(ch->base + 7)) & (IDE_BSY|IDE_DF|IDE_ERR)) != 0;
 	     x++)
 		/* do nothing */;
 
 	// switch back to Device 0
-	outb(0x1F6, 0xE0 | (0<<4));
+	outb(ch->base + 6, 0xE0 | (0<<4));
+
+	cprintf("Device %d presence: %d\n", d, (x < 1000 && r != 0));
+	return (x < 1000 && r != 0);
+}
+
+// Is this a bus-master capable IDE controller with an I/O BAR4?
+// Bit 7 of the programming interface means it can do bus mastering.
+static bool
+ide_dma_match(uint32_t dev, uint32_t func)
+{
+	uint32_t class = pci_conf_read(dev, func, PCI_CLASS);
 
-	cprintf("Device 1 presence: %d\n", (x < 1000));
-	return (x < 1000);
+	return (class >> 16) == PCI_CLASS_IDE && (class & 0x8000)
+		&& (pci_conf_read(dev, func, PCI_BAR(4)) & 1);
+}
+
+// Look for a bus-master capable IDE controller on PCI bus 0 and set
+// both of its channels up for DMA.  Returns true if DMA can be used.
+bool
+ide_dma_init(void)
+{
+	uint32_t dev, func, id;
+	uint16_t bmbase;
+	int r;
+
+	if (!pci_find(ide_dma_match, &dev, &func))
+		return 0;
+
+	// Make sure the PRD tables are mapped, then find them in memory.
+	prdt[0][0].prd_flags = 0;
+	if ((r = sys_page_phys(prdt)) < 0) {
+		cprintf("IDE DMA: sys_page_phys: %i\n", r);
+		return 0;
+	}
+	channels[0].prdt_pa = (physaddr_t) r << PGSHIFT;
+	channels[1].prdt_pa = channels[0].prdt_pa + sizeof(prdt[0]);
+
+	pci_enable_io(dev, func);
+	bmbase = pci_conf_read(dev, func, PCI_BAR(4)) & 0xFFFC;
+	channels[0].bmbase = bmbase;
+	channels[1].bmbase = bmbase + 8;
+	id = pci_conf_read(dev, func, PCI_ID);
+	cprintf("IDE DMA: controller %04x:%04x, bus master at 0x%x\n",
+		id & 0xFFFF, id >> 16, bmbase);
+	return 1;
 }
 
 void
 ide_set_disk(int d)
 {
-	if (d != 0 && d != 1)
+	if (d < 0 || d >= IDE_NDISKS)
 		panic("bad disk number");
 	diskno = d;
 }
 
+// Make ide_read and ide_write address the 'nsect' sectors of the
+// current disk from sector 'first_sect' on, as if they were the disk.
+void
+ide_set_partition(uint32_t first_sect, uint32_t nsect)
+{
+	part_first[diskno] = first_sect;
+	part_nsect[diskno] = nsect;
+}
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+
+// Fill in the PRD table of 'ch' for the 'len' bytes at 'va'.
+// Returns 0 on success, < 0 if part of the buffer is not mapped.
+static int
+ide_dma_prepare(struct IdeChannel *ch, const void *va, size_t len)
+{
+	size_t n;
+	int i, r;
+
+	for (i = 0; len > 0; i++, va += n, len -= n) {
+		if ((r = sys_page_phys((void *) ROUNDDOWN(va, PGSIZE))) < 0)
+			return r;
+		n = MIN(len, PGSIZE - PGOFF(va));
+		ch->prdt[i].prd_addr = ((physaddr_t) r << PGSHIFT) + PGOFF(va);
+		ch->prdt[i].prd_len = n;
+		ch->prdt[i].prd_flags = 0;
+	}
+	ch->prdt[i - 1].prd_flags = PRD_EOT;
+	return 0;
+}
+
+// Tell the drive of disk 'd' which sectors the next command is about.
+static void
+ide_select(struct IdeChannel *ch, int d, uint32_t secno, size_t nsecs)
+{
+	outb(ch->base + 2, nsecs);
+	outb(ch->base + 3, secno & 0xFF);
+	outb(ch->base + 4, (secno >> 8) & 0xFF);
+	outb(ch->base + 5, (secno >> 16) & 0xFF);
+	outb(ch->base + 6, 0xE0 | ((d&1)<<4) | ((secno>>24)&0x0F));
+}
+
+// Start moving 'nsecs' sectors starting at 'secno' between disk 'd'
+// and the buffer at 'va' using bus-master DMA.
+// Returns 0 on success, < 0 on error.
+static int
+ide_dma_start(struct IdeChannel *ch, int d, uint32_t secno, const void *va,
+	      size_t nsecs, bool read)
+{
+	uint8_t dir = read ? BM_CMD_READ : 0;
+	int r;
+
+	if ((r = ide_dma_prepare(ch, va, nsecs * SECTSIZE)) < 0)
+		return r;
+
+	ide_wait_ready(ch, 0);
+
+	outl(ch->bmbase + BM_PRDT, ch->prdt_pa);
+	outb(ch->bmbase + BM_CMD, dir);
+	// Writing 1 clears the error and interrupt bits
+	outb(ch->bmbase + BM_STATUS,
+	     inb(ch->bmbase + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	ide_select(ch, d, secno, nsecs);
+	outb(ch->base + 7, read ? 0xC8 : 0xCA);	// READ DMA or WRITE DMA
+
+	outb(ch->bmbase + BM_CMD, dir | BM_CMD_START);
+	return 0;
+}
+
+// Has the DMA transfer on 'ch' ended?  Returns 1 if it has and went
+// well, 0 if it is still going, < 0 if it failed.
+static int
+ide_dma_poll(struct IdeChannel *ch)
+{
+	uint8_t dir = ch->write ? 0 : BM_CMD_READ;
+	int status;
+
+	if (((status = inb(ch->bmbase + BM_STATUS)) & (BM_STATUS_ACTIVE | BM_STATUS_IRQ))
+	    == BM_STATUS_ACTIVE)
+		return 0;
+	outb(ch->bmbase + BM_CMD, dir);
+
+	if (ide_wait_ready(ch, 1) < 0 || (status & BM_STATUS_ERR))
+		return -1;
+	fs_stats.fs_ide_dma++;
+	return 1;
+}
+
+static int
+ide_pio_read(struct IdeChannel *ch, int d, uint32_t secno, void *dst, size_t nsecs)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	fs_stats.fs_ide_pio++;
 
-	ide_wait_ready(0);
+	ide_wait_ready(ch, 0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	ide_select(ch, d, secno, nsecs);
+	outb(ch->base + 7, 0x20);	// CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
+		ide_sleep(ch, d);
+		if ((r = ide_wait_ready(ch, 1)) < 0)
 			return r;
-		insl(0x1F0, dst, SECTSIZE/4);
+		insl(ch->base, dst, SECTSIZE/4);
 	}
 
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+static int
+ide_pio_write(struct IdeChannel *ch, int d, uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	fs_stats.fs_ide_pio++;
 
-	ide_wait_ready(0);
+	ide_wait_ready(ch, 0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_select(ch, d, secno, nsecs);
+	outb(ch->base + 7, 0x30);	// CMD 0x30 means write sector
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
+		if ((r = ide_wait_ready(ch, 1)) < 0)
 			return r;
-		outsl(0x1F0, src, SECTSIZE/4);
+		outsl(ch->base, src, SECTSIZE/4);
+		ide_sleep(ch, d);
 	}
 
 	return 0;
 }
 
+static int
+ide_pio(struct IdeChannel *ch)
+{
+	if (ch->write)
+		return ide_pio_write(ch, ch->diskno, ch->secno, ch->va, ch->nsecs);
+	return ide_pio_read(ch, ch->diskno, ch->secno, ch->va, ch->nsecs);
+}
+
+// Start moving 'nsecs' sectors starting at 'secno' between disk 'd'
+// and the buffer at 'va', using DMA if we can.  Without DMA the
+// transfer is done by the time this returns.  Either way, ide_poll
+// tells when it has ended.  The other channel may be used meanwhile,
+// but not this one.
+// Returns 0 on success, < 0 on error.
+int
+ide_start(int d, uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	struct IdeChannel *ch = ide_channel(d);
+
+	assert(nsecs <= 256 && !ch->busy);
+	ch->diskno = d;
+	ch->secno = secno;
+	ch->va = va;
+	ch->nsecs = nsecs;
+	ch->write = write;
+
+	if (ch->bmbase && ide_dma_start(ch, d, secno, va, nsecs, !write) == 0) {
+		ch->busy = 1;
+		return 0;
+	}
+	return ide_pio(ch);
+}
+
+// Has the transfer that ide_start began on disk 'd' ended?
+// Returns 1 if it has, or there was none, 0 if it is still going,
+// < 0 if it failed.  A failed DMA transfer is done again by PIO.
+int
+ide_poll(int d)
+{
+	struct IdeChannel *ch = ide_channel(d);
+	int r;
+
+	if (!ch->busy)
+		return 1;
+	if ((r = ide_dma_poll(ch)) == 0)
+		return 0;
+	ch->busy = 0;
+	if (r < 0 && (r = ide_pio(ch)) < 0)
+		return r;
+	return 1;
+}
+
+// Move 'nsecs' sectors of the current disk's partition between the
+// disk and 'va', waiting for the transfer to finish.
+static int
+ide_transfer(uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	int r;
+
+	if (secno + nsecs > part_nsect[diskno])
+		return -E_INVAL;
+	if ((r = ide_start(diskno, part_first[diskno] + secno, va, nsecs, write)) < 0)
+		return r;
+	while ((r = ide_poll(diskno)) == 0)
+		ide_pause(diskno);
+	return r < 0 ? r : 0;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return ide_transfer(secno, dst, nsecs, 0);
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return ide_transfer(secno, (void *) src, nsecs, 1);
+}
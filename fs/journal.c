@@ -0,0 +1,346 @@
+/*
+ * Metadata journal.
+ *
+ * Metadata blocks -- the superblock, the bitmap, directory blocks and
+ * the extent, indirect and index blocks of files -- are not written in
+ * place when the file system flushes them.  They join the running
+ * transaction instead (journal_block), and a whole transaction goes to
+ * the log at once: a descriptor block followed by the new contents of
+ * its blocks, written to consecutive log blocks with one batch of disk
+ * commands.  Transactions are committed in groups, at the end of a
+ * request that leaves enough blocks or requests gathered
+ * (journal_tick), and when a client needs its file on disk.
+ *
+ * A block stays held in the block cache (bc_hold) from the time it
+ * joins a transaction until the log fills up.  Then every held block
+ * is written in place and the log starts over (journal_checkpoint).
+ * After a crash, journal_init copies the committed transactions to
+ * their places again, so the metadata on disk is always as some commit
+ * left it, and does not need to be flushed eagerly to stay consistent.
+ *
+ * File contents are not journaled.  file_flush writes the blocks of a
+ * file in place before its metadata joins a transaction.
+ */
+
+#include "fs.h"
+
+// Pages a transaction is gathered in for writing, or read into
+#define JOURNALVA	0x0D000000
+#define JOURNALPAGE(i)	((char *) (JOURNALVA + (i) * PGSIZE))
+
+// Most log blocks used; the rest of a longer journal is left alone
+#define JOURNAL_MAXLOG	512
+
+// A transaction is committed at the end of a request once it has
+// JOURNAL_GROUP blocks or has been open for JOURNAL_GROUPREQS requests.
+#define JOURNAL_GROUP		32
+#define JOURNAL_GROUPREQS	64
+
+static uint32_t jstart;		// first log block; 0 if there is no journal
+static uint32_t jend;		// block past the end of the log
+static uint32_t jhead;		// where the next transaction goes
+static uint32_t jseq;		// sequence number of the next transaction
+static uint32_t jreserve;	// log blocks kept free for one request
+static bool jcheckpoint;	// a held block was freed
+
+// Blocks of the running transaction
+static uint32_t jtx[JOURNAL_MAXLOG];
+static uint32_t ntx;
+static uint32_t ntxreqs;	// requests since the transaction began
+
+// Blocks held since the last checkpoint
+static uint32_t jheld[JOURNAL_MAXLOG];
+static uint32_t nheld;
+
+static void journal_checkpoint(void);
+
+// Allocate staging pages 'first' through 'first + n - 1'.
+static void
+journal_stage_alloc(uint32_t first, uint32_t n)
+{
+	uint32_t i;
+	int r;
+
+	for (i = first; i < first + n; i++)
+		if ((r = sys_page_alloc(0, JOURNALPAGE(i), PTE_P | PTE_U | PTE_W)) < 0)
+			panic("journal: sys_page_alloc: %i", r);
+#ifdef SANITIZE_USER_SHADOW_BASE
+	platform_asan_unpoison(JOURNALPAGE(first), n * PGSIZE);
+#endif
+}
+
+// Unmap staging pages 'first' through 'first + n - 1'.
+static void
+journal_stage_free(uint32_t first, uint32_t n)
+{
+	uint32_t i;
+	int r;
+
+	for (i = first; i < first + n; i++)
+		if ((r = sys_page_unmap(0, JOURNALPAGE(i))) < 0)
+			panic("journal: sys_page_unmap: %i", r);
+}
+
+// Transfer the 'n' blocks from disk block 'blockno' on to or from the
+// staging pages from JOURNALPAGE(first) on, as one batch.
+static void
+journal_io(uint32_t blockno, uint32_t first, uint32_t n, bool write)
+{
+	struct DiskReq reqs[BC_MAXBATCH];
+	uint32_t i, k;
+	int nreq, r;
+
+	for (i = nreq = 0; i < n; i += k, nreq++) {
+		k = MIN(BC_MAXRUN, n - i);
+		reqs[nreq].dr_secno = (blockno + i) * BLKSECTS;
+		reqs[nreq].dr_buf = JOURNALPAGE(first + i);
+		reqs[nreq].dr_nsecs = k * BLKSECTS;
+		reqs[nreq].dr_write = write;
+	}
+	if ((r = disk_submit(reqs, nreq)) < 0)
+		panic("journal: disk_submit: %i", r);
+}
+
+// Write the journal header: the log starts with transaction jseq.
+static void
+journal_write_header(void)
+{
+	struct JournalHeader *jh = (struct JournalHeader *) JOURNALPAGE(0);
+
+	journal_stage_alloc(0, 1);
+	memset(jh, 0, BLKSIZE);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = jseq;
+	journal_io(jstart - 1, 0, 1, 1);
+	journal_stage_free(0, 1);
+}
+
+// Find the journal, copy the transactions committed to its log to
+// their places, and start an empty log.  Called at mount, before
+// anything looks at the bitmap or the directories.
+void
+journal_init(void)
+{
+	struct JournalHeader *jh = (struct JournalHeader *) JOURNALPAGE(0);
+	struct JournalDesc *jd = (struct JournalDesc *) JOURNALPAGE(0);
+	uint32_t pos, i, n, nreplayed = 0;
+
+	static_assert(JOURNAL_MAXLOG <= JOURNAL_MAXTX + 1, "log too long");
+	static_assert(JOURNAL_MAXLOG <= BC_MAXBATCH * BC_MAXRUN, "log too long");
+
+	// Images made before the journal have none.
+	if (super->s_njournal == 0)
+		return;
+	if (super->s_njournal < 3 || super->s_journal < 2
+	    || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal at %u, %u blocks", super->s_journal,
+		      super->s_njournal);
+	jstart = super->s_journal + 1;
+	jend = jstart + MIN(super->s_njournal - 1, JOURNAL_MAXLOG);
+	jreserve = MIN(8 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE,
+		       (jend - jstart) / 2);
+
+	journal_stage_alloc(0, 1);
+	journal_io(jstart - 1, 0, 1, 0);
+	if (jh->jh_magic != JOURNAL_MAGIC)
+		panic("bad journal magic %08x", jh->jh_magic);
+	jseq = jh->jh_seq;
+
+	for (pos = jstart; pos < jend; pos += 1 + n) {
+		journal_io(pos, 0, 1, 0);
+		n = jd->jd_nblocks;
+		if (jd->jd_magic != JOURNAL_MAGIC || jd->jd_seq != jseq
+		    || n == 0 || n > jend - pos - 1)
+			break;
+		journal_stage_alloc(1, n);
+		journal_io(pos + 1, 1, n, 0);
+		if (jd->jd_sum != journal_sum(jd, JOURNALPAGE(1))) {
+			// Torn: the crash came while it was being written.
+			journal_stage_free(1, n);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (jd->jd_blocks[i] < 1 || jd->jd_blocks[i] >= super->s_nblocks)
+				panic("journal: bad block %u in transaction %u",
+				      jd->jd_blocks[i], jseq);
+			bc_insert(jd->jd_blocks[i], JOURNALPAGE(i + 1));
+		}
+		jseq++;
+		nreplayed++;
+	}
+	journal_stage_free(0, 1);
+
+	if (nreplayed > 0) {
+		bc_sync();
+		cprintf("journal: replayed %u transactions\n", nreplayed);
+	}
+	journal_write_header();
+	jhead = jstart;
+}
+
+// The metadata block holding 'addr' has changed: add it to the running
+// transaction.  Without a journal, write it in place now.
+void
+journal_block(void *addr)
+{
+	uint32_t blockno = ((uintptr_t) addr - DISKMAP) / BLKSIZE;
+	uint32_t i;
+
+	if (!jstart) {
+		flush_block(addr);
+		return;
+	}
+	addr = diskaddr(blockno);
+	if (!va_is_mapped(addr))
+		return;
+	// A held block has been logged; only later changes set PTE_D.
+	if (bc_is_held(blockno) ? !va_is_dirty(addr) : !bc_block_dirty(blockno))
+		return;
+
+	for (i = 0; i < ntx && jtx[i] != blockno; i++)
+		/* do nothing */;
+	if (i == ntx) {
+		if (jhead + 1 + ntx + 1 > jend) {
+			// A request logged more than the room kept for
+			// it.  Its changes so far go out without the rest.
+			journal_commit();
+			journal_checkpoint();
+		}
+		jtx[ntx++] = blockno;
+		if (!bc_is_held(blockno))
+			jheld[nheld++] = blockno;
+	}
+	bc_hold(blockno);
+}
+
+// Add the changed blocks among the 'nblocks' metadata blocks from
+// 'blockno' on to the running transaction.  Without a journal, write
+// them in place now.
+void
+journal_range(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t i;
+
+	if (!jstart) {
+		bc_flush_range(blockno, nblocks);
+		return;
+	}
+	for (i = blockno; i < blockno + nblocks; i++)
+		if (va_is_mapped((void *) (DISKMAP + i * BLKSIZE)))
+			journal_block(diskaddr(i));
+}
+
+// Block 'blockno' has been freed.  If the log has a copy of it, the log
+// must be written in place before the block is used for something
+// else, or a replay would overwrite its new contents.  journal_tick
+// sees to that at the end of the request.
+void
+journal_freed(uint32_t blockno)
+{
+	if (bc_is_held(blockno))
+		jcheckpoint = 1;
+}
+
+// Write the running transaction to the log: its descriptor and the
+// current contents of its blocks, to consecutive log blocks with one
+// batch of disk commands.
+void
+journal_commit(void)
+{
+	struct JournalDesc *jd = (struct JournalDesc *) JOURNALPAGE(0);
+	uint32_t i;
+	int r;
+
+	if (!jstart || ntx == 0)
+		return;
+	assert(jhead + 1 + ntx <= jend);
+
+	journal_stage_alloc(0, 1);
+	memset(jd, 0, BLKSIZE);
+	jd->jd_magic = JOURNAL_MAGIC;
+	jd->jd_seq = jseq;
+	jd->jd_nblocks = ntx;
+	for (i = 0; i < ntx; i++) {
+		jd->jd_blocks[i] = jtx[i];
+		// Changes made from now on show up in PTE_D again.
+		bc_hold(jtx[i]);
+		if ((r = sys_page_map(0, diskaddr(jtx[i]), 0, JOURNALPAGE(i + 1),
+				      PTE_P | PTE_U)) < 0)
+			panic("journal_commit: sys_page_map: %i", r);
+	}
+#ifdef SANITIZE_USER_SHADOW_BASE
+	platform_asan_unpoison(JOURNALPAGE(1), ntx * PGSIZE);
+#endif
+	jd->jd_sum = journal_sum(jd, JOURNALPAGE(1));
+	journal_io(jhead, 0, 1 + ntx, 1);
+	journal_stage_free(0, 1 + ntx);
+
+	fs_stats.fs_jcommits++;
+	fs_stats.fs_jblocks += ntx;
+	jhead += 1 + ntx;
+	jseq++;
+	ntx = ntxreqs = 0;
+}
+
+// Write every held block in place and start the log over.  Only called
+// with no running transaction, so that what is written is what the log
+// holds.
+static void
+journal_checkpoint(void)
+{
+	uint32_t i, j, b;
+
+	assert(ntx == 0);
+	jcheckpoint = 0;
+	if (nheld == 0)
+		return;
+
+	// Sort the blocks, so that neighbours go out in one disk command.
+	for (i = 1; i < nheld; i++) {
+		b = jheld[i];
+		for (j = i; j > 0 && jheld[j - 1] > b; j--)
+			jheld[j] = jheld[j - 1];
+		jheld[j] = b;
+	}
+	for (i = 0; i < nheld; i++)
+		bc_release(jheld[i]);
+	for (i = 0; i < nheld; i = j) {
+		for (j = i + 1; j < nheld && jheld[j] == jheld[j - 1] + 1; j++)
+			/* do nothing */;
+		bc_flush_range(jheld[i], j - i);
+	}
+	nheld = 0;
+
+	// The old transactions are in place; a replay must not repeat them.
+	journal_write_header();
+	jhead = jstart;
+	fs_stats.fs_jcheckpoints++;
+}
+
+// Called at the end of every request that may have changed the file
+// system.  Commits the running transaction once it is big or old
+// enough, or the log has no room left for another request, and
+// checkpoints the log when it is nearly full.
+void
+journal_tick(void)
+{
+	if (!jstart)
+		return;
+	if (ntx > 0)
+		ntxreqs++;
+	if (ntx >= JOURNAL_GROUP || ntxreqs >= JOURNAL_GROUPREQS || jcheckpoint
+	    || jhead + 1 + ntx + jreserve > jend)
+		journal_commit();
+	if (jcheckpoint || jhead + 1 + jreserve > jend)
+		journal_checkpoint();
+}
+
+// Commit the running transaction and write the log in place.
+void
+journal_sync(void)
+{
+	if (!jstart)
+		return;
+	journal_commit();
+	journal_checkpoint();
+}
@@ -0,0 +1,55 @@
+/*
+ * PCI configuration space access for the disk drivers, using
+ * configuration mechanism #1.  Only bus 0 is searched, which is where
+ * QEMU puts its devices.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+uint32_t
+pci_conf_read(uint32_t dev, uint32_t func, uint32_t off)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(uint32_t dev, uint32_t func, uint32_t off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	outl(PCI_CONF_DATA, v);
+}
+
+// Find the first function on bus 0 for which 'match' returns true and
+// store its device and function numbers in *pdev and *pfunc.
+// Returns true if one was found.
+bool
+pci_find(bool (*match)(uint32_t dev, uint32_t func),
+	 uint32_t *pdev, uint32_t *pfunc)
+{
+	uint32_t dev, func;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			if ((pci_conf_read(dev, func, PCI_ID) & 0xFFFF) == 0xFFFF)
+				continue;
+			if (match(dev, func)) {
+				*pdev = dev;
+				*pfunc = func;
+				return 1;
+			}
+		}
+	return 0;
+}
+
+// Turn on I/O space decoding and bus mastering for a device.
+void
+pci_enable_io(uint32_t dev, uint32_t func)
+{
+	pci_conf_write(dev, func, PCI_COMMAND,
+		       pci_conf_read(dev, func, PCI_COMMAND) | 0x5);
+}
@@ -32,12 +32,25 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// Entries not in use are kept on a free list.  An entry stays in use
+// until every client has closed its Fd page, which the server can only
+// tell from the page's reference count dropping to 1, so entries are
+// reclaimed by sweeping the table when the free list runs out or a
+// client reaches MAXOPEN_ENV open files.
+//
+// Entries in use are also chained by the File they have open, in
+// openhash, so that finding out whether a file is open looks only at
+// the entries for files in the same chain.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	envid_t o_env;		// client that opened it, or 0 if free
+	struct OpenFile *o_next;	// next free entry
+	struct OpenFile *o_hnext;	// next entry in o_file's openhash chain
 };
 
 // initialize to force into data section
@@ -45,8 +58,47 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+static struct OpenFile *openfree;	// free list of opentab entries
+
+#define NOPENHASH	64
+static struct OpenFile *openhash[NOPENHASH];	// entries in use, by File
+
+// Return the openhash chain of open files of 'f'.
+static struct OpenFile **
+openfile_chain(struct File *f)
+{
+	return &openhash[((uintptr_t) f / sizeof(struct File)) % NOPENHASH];
+}
+
+// Entries in use by each client, indexed by ENVX of its envid
+static uint16_t env_nopen[NENV];
+
+// Virtual address at which thread t receives page mappings containing
+// client requests.  Pread and pwrite data pages follow the request page.
+#define FSREQVA(t)	(0x10000000 - (NFSTHREAD - (t)) * (1 + FSBULKPAGES) * PGSIZE)
+
+// Each request is served by a thread of its own (see thread.c), so
+// that requests that find their blocks in the cache need not wait for
+// the disk on behalf of others.  A thread serves either one IPC
+// request or, in turn, the requests queued on one request ring.
+struct FsWork {
+	envid_t w_env;		// client
+	uint32_t w_type;	// IPC request type
+	union Fsipc *w_req;	// IPC request page; data pages follow it
+	size_t w_npages;	// pages that came with the request being served
+	struct FsRing *w_ring;	// ring to serve, or NULL for IPC
+	uint64_t w_start;	// time stamp counter when the request arrived
+};
+
+// Work of each thread, indexed by thread number
+static struct FsWork works[NFSTHREAD];
+
+// Return the number of pages that came with the current request.
+static size_t
+fsreq_npages(void)
+{
+	return works[thread_current()].w_npages;
+}
 
 void
 serve_init(void)
@@ -58,29 +110,72 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = MAXOPEN; i > 0; i--) {
+		opentab[i - 1].o_next = openfree;
+		openfree = &opentab[i - 1];
+	}
 }
 
-// Allocate an open file.
-int
-openfile_alloc(struct OpenFile **o)
+// Put open file 'o' back on the free list.  Its Fd page stays mapped,
+// to be reused by the next open.
+static void
+openfile_free(struct OpenFile *o)
 {
-	int i, r;
+	struct OpenFile **pp;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
+	if (o->o_file) {
+		for (pp = openfile_chain(o->o_file); *pp != o; pp = &(*pp)->o_hnext)
+			/* do nothing */;
+		*pp = o->o_hnext;
+		o->o_file = 0;
+	}
+	env_nopen[ENVX(o->o_env)]--;
+	o->o_env = 0;
+	o->o_next = openfree;
+	openfree = o;
+}
+
+// Free the open files that no client has mapped any more.
+// Returns the number freed.
+static int
+openfile_reclaim(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_env && pageref(opentab[i].o_fd) <= 1) {
+			openfile_free(&opentab[i]);
+			n++;
 		}
+	return n;
+}
+
+// Allocate an open file for envid.
+// Returns the file ID, or -E_MAX_OPEN if the table is full or envid
+// already has MAXOPEN_ENV files open.
+int
+openfile_alloc(envid_t envid, struct OpenFile **po)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (!openfree || env_nopen[ENVX(envid)] >= MAXOPEN_ENV)
+		openfile_reclaim();
+	if (!openfree || env_nopen[ENVX(envid)] >= MAXOPEN_ENV)
+		return -E_MAX_OPEN;
+
+	o = openfree;
+	if (pageref(o->o_fd) == 0) {
+		if ((r = sys_page_alloc(0, o->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
 	}
-	return -E_MAX_OPEN;
+	openfree = o->o_next;
+	o->o_env = envid;
+	env_nopen[ENVX(envid)]++;
+	o->o_fileid += MAXOPEN;
+	memset(o->o_fd, 0, PGSIZE);
+	*po = o;
+	return o->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -90,12 +185,29 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	struct OpenFile *o;
 
 	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
+	if (!o->o_env || o->o_fileid != fileid || pageref(o->o_fd) <= 1)
 		return -E_INVAL;
 	*po = o;
 	return 0;
 }
 
+// Return true if some client still has 'f' open.  Entries of the
+// chain whose Fd pages every client has closed are freed on the way.
+static bool
+openfile_busy(struct File *f)
+{
+	struct OpenFile *o, *next;
+
+	for (o = *openfile_chain(f); o; o = next) {
+		next = o->o_hnext;
+		if (pageref(o->o_fd) <= 1)
+			openfile_free(o);
+		else if (o->o_file == f)
+			return 1;
+	}
+	return 0;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -117,7 +229,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	path[MAXPATHLEN-1] = 0;
 
 	// Find an open file ID
-	if ((r = openfile_alloc(&o)) < 0) {
+	if ((r = openfile_alloc(envid, &o)) < 0) {
 		if (debug)
 			cprintf("openfile_alloc failed: %i", r);
 		return r;
@@ -126,19 +238,20 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 
 	// Open the file
 	if (req->req_omode & O_CREAT) {
-		if ((r = file_create(path, &f)) < 0) {
+		if ((r = file_create(path, (req->req_omode & O_MKDIR)
+				     ? FTYPE_DIR : FTYPE_REG, &f)) < 0) {
 			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %i", r);
-			return r;
+			goto fail;
 		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %i", r);
-			return r;
+			goto fail;
 		}
 	}
 
@@ -147,17 +260,13 @@ try_open:
 		if ((r = file_set_size(f, 0)) < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %i", r);
-			return r;
+			goto fail;
 		}
 	}
-	if ((r = file_open(path, &f)) < 0) {
-		if (debug)
-			cprintf("file_open failed: %i", r);
-		return r;
-	}
-
 	// Save the file pointer
 	o->o_file = f;
+	o->o_hnext = *openfile_chain(f);
+	*openfile_chain(f) = o;
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
@@ -174,6 +283,10 @@ try_open:
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 
 	return 0;
+
+fail:
+	openfile_free(o);
+	return r;
 }
 
 // Set the size of req->req_fileid to req->req_size bytes, truncating
@@ -235,6 +348,104 @@ serve_read(envid_t envid, union Fsipc *ipc)
 }
 
 
+// Map the block of req->req_fileid that holds byte req->req_offset into
+// the caller, storing the cache page and its permissions in *pg_store
+// and *perm_store.  The page is read-only unless req->req_write is set,
+// which needs a regular file open for writing.  The file cannot be
+// shrunk below, or removed from under, a block mapped this way (see
+// file_set_size).  The seek position is not used or changed.  Small
+// files kept inline have no block to map for a private read; for them
+// the result is -E_NOT_SUPP and the client reads instead.  A page for
+// a shared mapping (req->req_share) must see later writes, so for it
+// such a file is moved to a block.
+// Returns the number of bytes of the file from req_offset to the end of
+// the block, 0 at end of file, or < 0 on error.
+int
+serve_read_map(envid_t envid, struct Fsreq_read_map *req,
+	       void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_write && ((o->o_mode & O_ACCMODE) == O_RDONLY
+			       || o->o_file->f_type == FTYPE_DIR))
+		return -E_INVAL;
+	// A page written through, or shared, must be the file's own block.
+	if ((req->req_write || req->req_share)
+	    && (r = file_promote(o->o_file)) < 0)
+		return r;
+	if ((r = file_map(o->o_file, req->req_offset, &blk)) <= 0)
+		return r;
+
+	// The client shares our cache page.  Writes to it are reported
+	// back with FSREQ_FLUSH.
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|(req->req_write ? PTE_W : 0);
+	return r;
+}
+
+// Read at most ipc->pio.req_n bytes from ipc->pio.req_fileid, starting
+// at ipc->pio.req_offset, into the data pages that came after the
+// request page.  Files opened with O_DIRECT are read into them straight
+// from the disk.  The seek position is not used or changed.  Returns
+// the number of bytes read, or < 0 on error.
+int
+serve_pread(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_pio *req = &ipc->pio;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_pread %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_n > (fsreq_npages() - 1) * PGSIZE || req->req_offset < 0)
+		return -E_INVAL;
+	if (o->o_mode & O_DIRECT)
+		return file_read_direct(o->o_file, (char *) ipc + PGSIZE,
+					req->req_n, req->req_offset);
+	return file_read(o->o_file, (char *) ipc + PGSIZE, req->req_n,
+			 req->req_offset);
+}
+
+// Write ipc->pio.req_n bytes from the data pages that came after the
+// request page to ipc->pio.req_fileid at ipc->pio.req_offset, extending
+// the file if necessary.  Files opened with O_DIRECT are written from
+// them straight to the disk.  The seek position is not used or changed.
+// Returns the number of bytes written, or < 0 on error.
+int
+serve_pwrite(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_pio *req = &ipc->pio;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_pwrite %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if (req->req_n > (fsreq_npages() - 1) * PGSIZE || req->req_offset < 0)
+		return -E_INVAL;
+	if (o->o_mode & O_DIRECT)
+		return file_write_direct(o->o_file, (char *) ipc + PGSIZE,
+					 req->req_n, req->req_offset);
+	return file_write(o->o_file, (char *) ipc + PGSIZE, req->req_n,
+			  req->req_offset);
+}
+
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
@@ -283,7 +494,47 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	return 0;
 }
 
-// Flush all data and metadata of req->req_fileid to disk.
+// Return the entries of directory req->req_fileid from req->req_cookie
+// on, as many as fit in req->req_n bytes, packed as struct Dirents in
+// ipc->readdirRet.  ret_cookie is where the next request goes on from;
+// a reply with no entries means the end of the directory.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_readdir *req = &ipc->readdir;
+	struct Fsret_readdir *ret = &ipc->readdirRet;
+	struct OpenFile *o;
+	uint32_t slot;
+	size_t n;
+	ssize_t r;
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x %08x\n", envid, req->req_fileid,
+			req->req_cookie);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (o->o_file->f_type != FTYPE_DIR || req->req_cookie < 0)
+		return -E_INVAL;
+
+	// The reply overwrites the request.
+	slot = ROUNDUP(req->req_cookie, sizeof(struct File)) / sizeof(struct File);
+	n = MIN(req->req_n, sizeof(ret->ret_buf));
+	if ((r = dir_read(o->o_file, &slot, ret->ret_buf, n)) < 0)
+		return r;
+	// Not at the end, but not even one entry fit.
+	if (r == 0 && slot < o->o_file->f_size / sizeof(struct File))
+		return -E_INVAL;
+	ret->ret_cookie = slot * sizeof(struct File);
+	ret->ret_n = r;
+	return 0;
+}
+
+// Flush all data and metadata of req->req_fileid to disk, including
+// the blocks in [req->req_offset, req->req_offset + req->req_len) that
+// the caller wrote through a mapping.  The metadata is on disk when
+// this returns only if req->req_commit is set; otherwise it goes with
+// the next group commit of the journal.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
@@ -295,11 +546,38 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
+	file_mark_dirty(o->o_file, req->req_offset, req->req_len);
 	file_flush(o->o_file);
+	if (req->req_commit)
+		journal_commit();
 	return 0;
 }
 
 
+// Remove the file named req->req_path.  Files that are open cannot be
+// removed, since their descriptors would go on to use the directory
+// slot of whatever file is created there next.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+	struct File *f;
+	int r;
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	if ((r = file_open(path, &f)) < 0)
+		return r;
+	if (openfile_busy(f))
+		return -E_BUSY;
+	return file_remove(path);
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -307,33 +585,401 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the server's statistics in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_stats %08x\n", envid);
+
+	ipc->statsRet.ret_stats = fs_stats;
+	bc_stats(&ipc->statsRet.ret_stats);
+	return 0;
+}
+
+// Request rings of clients, mapped at FSRINGVA(i)
+#define NFSRING		16
+#define FSRINGVA(i)	(0xD8000000 + (i) * FSRING_PAGES * PGSIZE)
+
+struct FsRing {
+	envid_t r_env;		// client; 0 if the ring is free
+	struct FsSq *r_sq;
+	struct FsCq *r_cq;
+	union Fsipc *r_reqs;	// request page of each slot
+	bool r_busy;		// a thread is serving the ring
+};
+
+static struct FsRing rings[NFSRING];
+
+static bool
+fsring_alive(struct FsRing *ring)
+{
+	const volatile struct Env *e = &envs[ENVX(ring->r_env)];
+
+	return e->env_id == ring->r_env && e->env_status != ENV_FREE;
+}
+
+static void
+fsring_free(struct FsRing *ring)
+{
+	int i;
+
+	for (i = 0; i < FSRING_PAGES; i++)
+		sys_page_unmap(0, (char *) ring->r_sq + i * PGSIZE);
+	ring->r_env = 0;
+}
+
+// Take the ring in the pages that came with the request as envid's
+// request ring, replacing any ring it had before.  Rings of clients
+// that have exited are reused.  Returns 0 on success, < 0 on error.
+int
+serve_ring_setup(envid_t envid, union Fsipc *ipc)
+{
+	struct FsRing *ring = NULL;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x\n", envid);
+
+	if (fsreq_npages() != FSRING_PAGES)
+		return -E_INVAL;
+	for (i = 0; i < NFSRING; i++) {
+		if (rings[i].r_env && rings[i].r_busy && rings[i].r_env == envid)
+			return -E_INVAL;
+		if (rings[i].r_env && !rings[i].r_busy
+		    && (rings[i].r_env == envid || !fsring_alive(&rings[i])))
+			fsring_free(&rings[i]);
+		if (!rings[i].r_env && !ring)
+			ring = &rings[i];
+	}
+	if (!ring)
+		return -E_NO_MEM;
+
+	ring->r_sq = (struct FsSq *) FSRINGVA(ring - rings);
+	ring->r_cq = (struct FsCq *) ((char *) ring->r_sq + PGSIZE);
+	ring->r_reqs = (union Fsipc *) ((char *) ring->r_sq + 2 * PGSIZE);
+	for (i = 0; i < FSRING_PAGES; i++)
+		if ((r = sys_page_map(0, (char *) ipc + i * PGSIZE, 0,
+				      (char *) ring->r_sq + i * PGSIZE,
+				      PTE_P | PTE_U | PTE_W)) < 0) {
+			fsring_free(ring);
+			return r;
+		}
+	ring->r_env = envid;
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and read map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_READ_MAP] =	(fshandler)serve_read_map, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_PREAD] =		serve_pread,
+	[FSREQ_PWRITE] =	serve_pwrite,
+	[FSREQ_RING_SETUP] =	serve_ring_setup,
+	[FSREQ_READDIR] =	serve_readdir
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// The file system lock.  Requests that only look at the file system
+// share it; the others hold it alone.  Requests waiting to hold it
+// alone keep new sharers out, so that they are not starved.
+static int fs_readers;		// requests holding the lock shared
+static bool fs_writer;		// a request holds the lock alone
+static int fs_writers_waiting;
+
+static void
+fs_lock(bool excl)
+{
+	if (excl) {
+		fs_writers_waiting++;
+		while (fs_writer || fs_readers)
+			thread_wait(&fs_readers);
+		fs_writers_waiting--;
+		fs_writer = 1;
+	} else {
+		while (fs_writer || fs_writers_waiting)
+			thread_wait(&fs_readers);
+		fs_readers++;
+	}
+}
+
+static void
+fs_unlock(bool excl)
+{
+	if (excl)
+		fs_writer = 0;
+	else
+		fs_readers--;
+	thread_wakeup(&fs_readers);
+}
+
+// Can a request of type 'type' share the file system lock?  Only
+// requests that change nothing on disk, nor in an open file's Fd, can.
+// FSREQ_READ moves the seek position, so two of them on one Fd would
+// race; FSREQ_PREAD leaves it alone.
+static bool
+fsreq_shared(uint32_t type, union Fsipc *req)
+{
+	switch (type) {
+	case FSREQ_PREAD:
+	case FSREQ_STAT:
+	case FSREQ_STATS:
+	case FSREQ_READDIR:
+		return 1;
+	case FSREQ_READ_MAP:
+		return !req->read_map.req_write;
+	default:
+		return 0;
+	}
+}
+
+// Does mapping req->req_offset of req->req_fileid for envid need a
+// block to be allocated, an inline file to be moved to one, or the
+// file's delayed blocks to be given theirs (file_get_block does that
+// for any block of the file)?
+static bool
+read_map_hole(envid_t envid, struct Fsreq_read_map *req)
+{
+	struct OpenFile *o;
+	uint32_t bno;
+
+	if (openfile_lookup(envid, req->req_fileid, &o) < 0)
+		return 0;
+	if (req->req_share && (o->o_file->f_flags & F_INLINE))
+		return 1;
+	if (file_has_delayed(o->o_file))
+		return 1;
+	if (req->req_offset < 0 || req->req_offset >= o->o_file->f_size)
+		return 0;
+	return file_map_block(o->o_file, req->req_offset / BLKSIZE, &bno, 0) == 0
+		&& bno == 0;
+}
+
+// Serve the request of type 'type' in 'req', which came with 'npages'
+// pages, for envid.  Requests that pass a page back (open and read
+// map) are only served if 'pg_store' is not null.
+// Returns the request's result.
+static int
+fsreq_serve(envid_t envid, uint32_t type, union Fsipc *req, size_t npages,
+	    void **pg_store, int *perm_store)
+{
+	bool excl = !fsreq_shared(type, req);
+	int r;
+
+	works[thread_current()].w_npages = npages;
+	fs_lock(excl);
+	if (!excl && type == FSREQ_READ_MAP && read_map_hole(envid, &req->read_map)) {
+		fs_unlock(0);
+		fs_lock(excl = 1);
+	}
+
+	if (pg_store && type == FSREQ_OPEN)
+		r = serve_open(envid, &req->open, pg_store, perm_store);
+	else if (pg_store && type == FSREQ_READ_MAP)
+		r = serve_read_map(envid, &req->read_map, pg_store, perm_store);
+	else if (type < NHANDLERS && handlers[type])
+		r = handlers[type](envid, req);
+	else {
+		if (pg_store)
+			cprintf("Invalid request code %d from %08x\n", type, envid);
+		r = -E_INVAL;
+	}
+
+	if (excl)
+		journal_tick();
+	fs_unlock(excl);
+	return r;
+}
+
+// Count a request that arrived when the time stamp counter read
+// 'start' and has just been answered.
+static void
+fsreq_done(uint64_t start)
+{
+	uint64_t cycles = read_tsc() - start;
+	int b;
+
+	for (b = 0; b < FSLAT_NBUCKETS - 1 && (cycles >> (b + 1)) != 0; b++)
+		/* do nothing */;
+	fs_stats.fs_lat_hist[b]++;
+	fs_stats.fs_reqs++;
+	if (thread_parked())
+		fs_stats.fs_reqs_parked++;
+}
+
+// Return the ring of envid, or NULL if it has none.
+static struct FsRing *
+fsring_find(envid_t envid)
+{
+	int i;
+
+	for (i = 0; i < NFSRING; i++)
+		if (rings[i].r_env == envid)
+			return &rings[i];
+	return NULL;
+}
+
+// Serve the requests queued on one ring, in order, as long as there is
+// room on its completion queue.
+static void
+fsring_run(struct FsRing *ring)
+{
+	struct FsSq *sq = ring->r_sq;
+	struct FsCq *cq = ring->r_cq;
+	struct FsSqe sqe;
+	uint64_t start;
+	int n, r;
+
+	ring->r_busy = 1;
+	// Read sq_tail again after each request, so requests queued while
+	// we work are served before the thread goes away.
+	for (n = 0; sq->sq_head != sq->sq_tail
+		     && cq->cq_tail - cq->cq_head < FSRING_SIZE; n++) {
+		barrier();
+		start = read_tsc();
+		thread_parked();
+		sqe = sq->sq_ents[sq->sq_head % FSRING_SIZE];
+		if (sqe.sqe_slot >= FSRING_SIZE)
+			r = -E_INVAL;
+		else
+			// Ring requests come with nothing but their
+			// request page.
+			r = fsreq_serve(ring->r_env, sqe.sqe_type,
+					&ring->r_reqs[sqe.sqe_slot], 1, NULL, NULL);
+
+		cq->cq_ents[cq->cq_tail % FSRING_SIZE].cqe_slot = sqe.sqe_slot;
+		cq->cq_ents[cq->cq_tail % FSRING_SIZE].cqe_res = r;
+		barrier();
+		cq->cq_tail++;
+		sq->sq_head++;
+		barrier();
+		fsreq_done(start);
+	}
+	ring->r_busy = 0;
+	thread_wakeup(ring);
+
+	fs_stats.fs_ring_reqs += n;
+	if (n)
+		fs_stats.fs_ring_drains++;
+}
+
+// Body of a thread serving a ring.
+static void
+serve_ring_work(void)
+{
+	fsring_run(works[thread_current()].w_ring);
+}
+
+// Body of a thread serving an IPC request.
+static void
+serve_ipc_work(void)
+{
+	struct FsWork *w = &works[thread_current()];
+	struct FsRing *ring;
+	size_t npages = w->w_npages, i;
+	void *pg = NULL;
+	int perm = 0, r;
+
+	// Requests the client queued on its ring before this one go
+	// first.
+	if ((ring = fsring_find(w->w_env)) != NULL) {
+		while (ring->r_busy)
+			thread_wait(ring);
+		if (ring->r_env == w->w_env)
+			fsring_run(ring);
+	}
+
+	r = fsreq_serve(w->w_env, w->w_type, w->w_req, npages, &pg, &perm);
+	ipc_send(w->w_env, r, pg, perm);
+	fsreq_done(w->w_start);
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, (char *) w->w_req + i * PGSIZE);
+}
+
+// Start threads for the rings that have requests queued, and free the
+// rings of clients that have exited.  Returns true if there is ring
+// work to do: threads were started, or ran out.
+static bool
+fsring_dispatch(void)
+{
+	struct FsRing *ring;
+	bool busy = 0;
+	int t;
+
+	for (ring = rings; ring < rings + NFSRING; ring++) {
+		if (!ring->r_env || ring->r_busy)
+			continue;
+		if (!fsring_alive(ring)) {
+			fsring_free(ring);
+			continue;
+		}
+		if (ring->r_sq->sq_head == ring->r_sq->sq_tail)
+			continue;
+		busy = 1;
+		if ((t = thread_reserve()) < 0)
+			break;
+		works[t].w_env = ring->r_env;
+		works[t].w_ring = ring;
+		ring->r_busy = 1;
+		thread_start(t, serve_ring_work);
+	}
+	return busy;
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	struct FsWork *w;
+	uint32_t req;
+	envid_t whom;
+	int perm, nrun, r;
+	int t = -1;		// thread the next IPC request goes to
+	bool recving = 0, busy, idle;
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		nrun = thread_run();
+
+		// Receive the next request while the threads are busy.
+		if (t < 0)
+			t = thread_reserve();
+		if (t >= 0 && !recving) {
+			if ((r = ipc_recv_start((void *) FSREQVA(t), 1 + FSBULKPAGES)) < 0)
+				panic("serve: ipc_recv_start: %i", r);
+			recving = 1;
+		}
+		busy = fsring_dispatch();
+
+		// Sleep until a request comes only if no thread has
+		// anything to do, or until the disk interrupts too if
+		// threads are waiting for it.
+		idle = nrun == 0 && !busy;
+		if (!recving
+		    || !ipc_recv_poll(&whom, &req, &perm, idle && !disk_waiting())) {
+			if (idle && disk_waiting())
+				disk_sleep(recving);
+			else if (nrun > 0 || !recving)
+				sys_yield();
+			continue;
+		}
+		recving = 0;
+
+		// Requests queued on rings are picked up above.
+		if (req == FSREQ_RING_KICK)
+			continue;
+		w = &works[t];
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], (char *) fsreq);
+				req, whom, uvpt[PGNUM(FSREQVA(t))], (char *) FSREQVA(t));
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -342,17 +988,14 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		w->w_env = whom;
+		w->w_type = req;
+		w->w_req = (union Fsipc *) FSREQVA(t);
+		w->w_npages = thisenv->env_ipc_npages;
+		w->w_ring = NULL;
+		w->w_start = read_tsc();
+		thread_start(t, serve_ipc_work);
+		t = -1;
 	}
 }
 
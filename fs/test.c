@@ -14,23 +14,22 @@ static inline void check_consistency(void)
 
 void check_dir(struct File* dir)
 {
-	int r;
-	uint32_t *blk;
+	uint32_t bno;
 	struct File *files;
 
 	uint32_t nblock = dir->f_size / BLKSIZE;
 	for (int i = 0; i < nblock; ++i) {
 
-		if ((r = file_block_walk(dir, i, &blk, 0)) < 0) {
+		if (file_map_block(dir, i, &bno, NULL) < 0 || bno == 0) {
 			continue;
 		}
 
-		files = (struct File*) diskaddr(*blk);
+		files = (struct File*) diskaddr(bno);
 
 		for (int j = 0; j < BLKFILES; ++j) {
 			struct File *f = &(files[j]);
 			if (strcmp(f->f_name, "\0") != 0) {
-				uint32_t *pdiskbno = NULL;
+				uint32_t diskbno;
 
 				cprintf("checking consistency of %s\n", f->f_name);
 
@@ -38,12 +37,11 @@ void check_dir(struct File* dir)
 					if (f->f_type == FTYPE_DIR) {
 						check_dir(f);
 					}
-					if (file_block_walk(f, k, &pdiskbno, 0) < 0
-					    || pdiskbno == NULL
-					    || *pdiskbno == 0) {
+					if (file_map_block(f, k, &diskbno, NULL) < 0
+					    || diskbno == 0) {
 						continue;
 					}
-					assert(!block_is_free(*pdiskbno));
+					assert(!block_is_free(diskbno));
 				}
 			}
 		}
@@ -56,13 +54,14 @@ fs_test(void)
 	struct File *f;
 	int r;
 	char *blk;
-	uint32_t *bits;
+	uint32_t *bits, nfree, bno;
 
 	// back up bitmap
 	if ((r = sys_page_alloc(0, (void*) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
 		panic("sys_page_alloc: %i", r);
 	bits = (uint32_t*) PGSIZE;
 	memmove(bits, bitmap, PGSIZE);
+	nfree = fs_free_blocks();
 	// allocate block
 	if ((r = alloc_block()) < 0)
 		panic("alloc_block: %i", r);
@@ -70,6 +69,8 @@ fs_test(void)
 	assert(bits[r/32] & (1 << (r%32)));
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
+	// and the free block count went down
+	assert(fs_free_blocks() == nfree - 1);
 	cprintf("alloc_block is good\n");
 	check_consistency();
 	cprintf("fs consistency is good\n");
@@ -86,6 +87,8 @@ fs_test(void)
 		panic("file_get_block: %i", r);
 	if (strcmp(blk, msg) != 0)
 		panic("file_get_block returned wrong data");
+	assert(file_map(f, 1, &blk) == f->f_size - 1 && strcmp(blk, msg) == 0);
+	assert(file_map(f, f->f_size, &blk) == 0);
 	cprintf("file_get_block is good\n");
 
 	*(volatile char*)blk = *(volatile char*)blk;
@@ -96,7 +99,7 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %i", r);
-	assert(f->f_direct[0] == 0);
+	assert(file_map_block(f, 0, &bno, NULL) == 0 && bno == 0);
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
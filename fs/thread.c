@@ -0,0 +1,205 @@
+/*
+ * Cooperative threads for the file system server.
+ *
+ * Each request the server works on runs in a thread of its own, so
+ * that a request waiting for the disk can be set aside while others
+ * are served from the block cache.  Threads never preempt each other:
+ * a thread gives up the CPU only in thread_yield and thread_wait.
+ * Threads waiting for the disk block in thread_wait (see disk_pause),
+ * so that the main loop can sleep until the disk interrupts when no
+ * thread can run.  Everything between two such calls runs without
+ * interference.
+ *
+ * Switches always go through the main loop of the server: a thread
+ * that gives up the CPU returns to thread_run, which picks the next
+ * runnable thread.
+ */
+
+#include "fs.h"
+
+#define THREAD_STACKSIZE	(4 * PGSIZE)
+
+enum {
+	THREAD_FREE = 0,
+	THREAD_RESERVED,	// claimed, but not started yet
+	THREAD_RUNNABLE,
+	THREAD_WAITING,		// waiting for a thread_wakeup on t_chan
+};
+
+struct Thread {
+	int t_state;
+	uintptr_t t_esp;	// saved stack pointer while switched out
+	void (*t_fn)(void);	// function the thread runs
+	void *t_chan;		// what a waiting thread waits for
+	bool t_parked;		// gave up the CPU since thread_parked
+};
+
+static struct Thread threads[NFSTHREAD];
+static char thread_stacks[NFSTHREAD][THREAD_STACKSIZE] __attribute__((aligned(PGSIZE)));
+static uintptr_t main_esp;	// stack pointer of the main loop
+static int thread_cur = -1;	// running thread; -1 in the main loop
+static void *main_chan;		// what the main loop waits for in thread_wait
+
+// switch.S
+void thread_switch(uintptr_t *save_esp, uintptr_t esp);
+
+// Return the number of the running thread, or -1 if the main loop of
+// the server is running.
+int
+thread_current(void)
+{
+	return thread_cur;
+}
+
+// Where every thread starts.  Run the thread's function, then go back
+// to the main loop for good.
+static void
+thread_entry(void)
+{
+	struct Thread *t = &threads[thread_cur];
+
+	t->t_fn();
+	t->t_state = THREAD_FREE;
+	thread_switch(&t->t_esp, main_esp);
+	panic("free thread %d resumed", (int) (t - threads));
+}
+
+// Claim a free thread, to be started later with thread_start.
+// Returns its number, or -E_NO_MEM if all threads are in use.
+int
+thread_reserve(void)
+{
+	int i;
+
+	for (i = 0; i < NFSTHREAD; i++)
+		if (threads[i].t_state == THREAD_FREE) {
+			threads[i].t_state = THREAD_RESERVED;
+			return i;
+		}
+	return -E_NO_MEM;
+}
+
+// Make reserved thread 'i' run 'fn' the next time thread_run is called.
+// The thread is freed when 'fn' returns.
+void
+thread_start(int i, void (*fn)(void))
+{
+	struct Thread *t = &threads[i];
+	uintptr_t *sp;
+
+	assert(t->t_state == THREAD_RESERVED);
+
+	// Build the frame thread_switch pops: the callee-saved registers
+	// and the return address, here thread_entry.  thread_entry
+	// itself never returns.
+	sp = (uintptr_t *) (thread_stacks[i] + THREAD_STACKSIZE);
+	*--sp = 0;
+	*--sp = (uintptr_t) thread_entry;
+	*--sp = 0;	// ebp
+	*--sp = 0;	// ebx
+	*--sp = 0;	// esi
+	*--sp = 0;	// edi
+
+	t->t_esp = (uintptr_t) sp;
+	t->t_fn = fn;
+	t->t_chan = NULL;
+	t->t_parked = 0;
+	t->t_state = THREAD_RUNNABLE;
+}
+
+// Give every runnable thread a turn, running each until it finishes or
+// gives up the CPU.  Must be called from the main loop.
+// Returns the number of threads still runnable afterwards.
+int
+thread_run(void)
+{
+	int i, n;
+
+	assert(thread_cur < 0);
+	for (i = 0; i < NFSTHREAD; i++) {
+		if (threads[i].t_state != THREAD_RUNNABLE)
+			continue;
+		thread_cur = i;
+		thread_switch(&main_esp, threads[i].t_esp);
+		thread_cur = -1;
+	}
+	for (i = n = 0; i < NFSTHREAD; i++)
+		if (threads[i].t_state == THREAD_RUNNABLE)
+			n++;
+	return n;
+}
+
+// Let other threads run; the caller stays runnable.  Outside a thread
+// this gives up the CPU to other environments instead.
+void
+thread_yield(void)
+{
+	struct Thread *t;
+
+	if (thread_cur < 0) {
+		sys_yield();
+		return;
+	}
+	t = &threads[thread_cur];
+	t->t_parked = 1;
+	thread_switch(&t->t_esp, main_esp);
+}
+
+// Wait until another thread calls thread_wakeup(chan).  The main loop
+// has no thread to block, so outside a thread this runs the threads
+// instead, sleeping for the disk when none can run, until one of them
+// wakes 'chan'.  This happens when the main loop needs a block that a
+// thread is reading in.
+void
+thread_wait(void *chan)
+{
+	struct Thread *t;
+
+	if (thread_cur < 0) {
+		assert(!main_chan);
+		main_chan = chan;
+		while (main_chan) {
+			if (thread_run() > 0)
+				continue;
+			if (disk_waiting())
+				disk_sleep(0);
+			else
+				sys_yield();
+		}
+		return;
+	}
+	t = &threads[thread_cur];
+	t->t_chan = chan;
+	t->t_state = THREAD_WAITING;
+	t->t_parked = 1;
+	thread_switch(&t->t_esp, main_esp);
+}
+
+// Make every thread waiting on 'chan' runnable.
+void
+thread_wakeup(void *chan)
+{
+	int i;
+
+	if (main_chan == chan)
+		main_chan = NULL;
+	for (i = 0; i < NFSTHREAD; i++)
+		if (threads[i].t_state == THREAD_WAITING && threads[i].t_chan == chan) {
+			threads[i].t_chan = NULL;
+			threads[i].t_state = THREAD_RUNNABLE;
+		}
+}
+
+// Has the running thread given up the CPU since it started, or since
+// the last call to thread_parked?
+bool
+thread_parked(void)
+{
+	bool parked;
+
+	if (thread_cur < 0)
+		return 0;
+	parked = threads[thread_cur].t_parked;
+	threads[thread_cur].t_parked = 0;
+	return parked;
+}
@@ -0,0 +1,262 @@
+/*
+ * Legacy virtio-blk driver.  Requests go into the device's virtqueue
+ * as descriptor chains; a whole batch is queued before the device is
+ * notified once, and the device may work on all of them at the same
+ * time.  We then poll the used ring until the batch is back.
+ * The register and ring layouts are those of the legacy virtio PCI
+ * interface (virtio 0.9.5).
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define VIRTIO_VENDOR		0x1AF4
+#define VIRTIO_DEV_BLK		0x1001		// legacy block device
+
+// Legacy virtio-pci registers, relative to BAR0
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_PFN	0x08
+#define VIRTIO_QUEUE_SIZE	0x0C
+#define VIRTIO_QUEUE_SEL	0x0E
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_STATUS		0x12
+#define VIRTIO_ISR		0x13
+#define VIRTIO_BLK_CAPACITY	0x14		// 64 bits, in sectors
+
+// Device status bits
+#define VIRTIO_S_ACK		0x01
+#define VIRTIO_S_DRIVER		0x02
+#define VIRTIO_S_DRIVER_OK	0x04
+#define VIRTIO_S_FAILED		0x80
+
+struct VringDesc {
+	uint64_t vd_addr;		// physical address
+	uint32_t vd_len;
+	uint16_t vd_flags;
+	uint16_t vd_next;		// next descriptor of the chain
+};
+#define VRING_DESC_NEXT		0x1	// vd_next is valid
+#define VRING_DESC_WRITE	0x2	// device writes the buffer
+
+struct VringAvail {
+	uint16_t va_flags;
+	uint16_t va_idx;		// where we put the next entry
+	uint16_t va_ring[];		// head descriptors
+};
+
+struct VringUsedElem {
+	uint32_t vu_id;			// head descriptor
+	uint32_t vu_len;		// bytes written by the device
+};
+
+struct VringUsed {
+	uint16_t vu_flags;
+	uint16_t vu_idx;		// where the device puts the next entry
+	struct VringUsedElem vu_ring[];
+};
+
+// Largest queue we set up.  QEMU offers 128 or 256 entries.
+#define VQ_MAXSIZE	1024
+
+// Where the virtqueue is mapped.  A legacy device is told the ring's
+// first physical page only, so it must be physically contiguous.
+#define VIRTIO_RING	0x0F000000
+
+// Every request starts with this header and ends with a status byte.
+struct VblkHdr {
+	uint32_t vh_type;
+	uint32_t vh_ioprio;
+	uint64_t vh_sector;
+};
+#define VBLK_T_IN	0		// read
+#define VBLK_T_OUT	1		// write
+#define VBLK_S_OK	0
+
+// Most requests in flight at once
+#define VBLK_MAXREQ	64
+
+static uint16_t vbase;			// I/O base of the device
+static uint16_t vq_size;		// descriptors in the queue
+static struct VringDesc *vq_desc;
+static struct VringAvail *vq_avail;
+static volatile struct VringUsed *vq_used;
+static uint16_t vq_used_idx;		// used ring entries consumed so far
+static uint64_t vblk_capacity;		// disk size in sectors
+
+// Headers and status bytes of the requests in flight, indexed by their
+// position in the batch.  Both fit in one page.
+static struct {
+	struct VblkHdr hdr[VBLK_MAXREQ];
+	uint8_t status[VBLK_MAXREQ];
+} vblk __attribute__((aligned(PGSIZE)));
+static physaddr_t vblk_pa;
+
+static bool
+virtio_blk_match(uint32_t dev, uint32_t func)
+{
+	return pci_conf_read(dev, func, PCI_ID) == (VIRTIO_DEV_BLK << 16 | VIRTIO_VENDOR)
+		&& (pci_conf_read(dev, func, PCI_BAR(0)) & 1);
+}
+
+// Look for a virtio-blk device on PCI bus 0 and set up its queue.
+// Returns true if the device can be used.
+bool
+virtio_blk_init(void)
+{
+	uint32_t dev, func, used_off, ring_size;
+	int r;
+
+	if (!pci_find(virtio_blk_match, &dev, &func))
+		return 0;
+	pci_enable_io(dev, func);
+	vbase = pci_conf_read(dev, func, PCI_BAR(0)) & 0xFFFC;
+
+	// Reset the device, tell it we know how to drive it, and accept
+	// none of its optional features.
+	outb(vbase + VIRTIO_STATUS, 0);
+	outb(vbase + VIRTIO_STATUS, VIRTIO_S_ACK);
+	outb(vbase + VIRTIO_STATUS, VIRTIO_S_ACK | VIRTIO_S_DRIVER);
+	outl(vbase + VIRTIO_GUEST_FEATURES, 0);
+
+	outw(vbase + VIRTIO_QUEUE_SEL, 0);
+	vq_size = inw(vbase + VIRTIO_QUEUE_SIZE);
+	if (vq_size == 0 || vq_size > VQ_MAXSIZE) {
+		cprintf("virtio-blk: bad queue size %u\n", vq_size);
+		goto fail;
+	}
+
+	// Descriptors, then the available ring, then the used ring on
+	// the next page boundary.
+	used_off = ROUNDUP(vq_size * sizeof(struct VringDesc)
+			   + sizeof(struct VringAvail)
+			   + (vq_size + 1) * sizeof(uint16_t), PGSIZE);
+	ring_size = used_off + ROUNDUP(sizeof(struct VringUsed)
+				       + vq_size * sizeof(struct VringUsedElem)
+				       + sizeof(uint16_t), PGSIZE);
+	if ((r = sys_page_alloc_contig((void *) VIRTIO_RING, ring_size / PGSIZE,
+				       PTE_P | PTE_U | PTE_W)) < 0) {
+		cprintf("virtio-blk: sys_page_alloc_contig: %i\n", r);
+		goto fail;
+	}
+	vq_desc = (struct VringDesc *) VIRTIO_RING;
+	vq_avail = (struct VringAvail *) (vq_desc + vq_size);
+	vq_used = (struct VringUsed *) (VIRTIO_RING + used_off);
+	outl(vbase + VIRTIO_QUEUE_PFN, r);
+
+	// Make sure the request headers are mapped, then find them.
+	vblk.status[0] = 0;
+	if ((r = sys_page_phys(&vblk)) < 0) {
+		cprintf("virtio-blk: sys_page_phys: %i\n", r);
+		goto fail;
+	}
+	vblk_pa = (physaddr_t) r << PGSHIFT;
+
+	vblk_capacity = inl(vbase + VIRTIO_BLK_CAPACITY)
+		| (uint64_t) inl(vbase + VIRTIO_BLK_CAPACITY + 4) << 32;
+	outb(vbase + VIRTIO_STATUS,
+	     VIRTIO_S_ACK | VIRTIO_S_DRIVER | VIRTIO_S_DRIVER_OK);
+	cprintf("virtio-blk: %u sectors, queue of %u at 0x%x\n",
+		(uint32_t) vblk_capacity, vq_size, vbase);
+	return 1;
+
+fail:
+	outb(vbase + VIRTIO_STATUS, VIRTIO_S_FAILED);
+	return 0;
+}
+
+// Number of descriptors request 'req' needs: the header, one per page
+// the buffer touches, and the status byte.
+static uint32_t
+vblk_ndesc(const struct DiskReq *req)
+{
+	return 2 + (PGOFF(req->dr_buf) + req->dr_nsecs * SECTSIZE + PGSIZE - 1) / PGSIZE;
+}
+
+// Build the descriptor chain for 'req' starting at descriptor *pd,
+// using header and status slot 'slot', and put it in the available
+// ring without publishing it yet.  Advances *pd past the chain.
+// Returns 0 on success, < 0 if part of the buffer is not mapped.
+static int
+vblk_queue(const struct DiskReq *req, int slot, uint16_t *pd)
+{
+	uint16_t d = *pd;
+	void *va = req->dr_buf;
+	size_t len = req->dr_nsecs * SECTSIZE, n;
+	int r;
+
+	vblk.hdr[slot].vh_type = req->dr_write ? VBLK_T_OUT : VBLK_T_IN;
+	vblk.hdr[slot].vh_ioprio = 0;
+	vblk.hdr[slot].vh_sector = req->dr_secno;
+	vblk.status[slot] = 0xFF;
+
+	vq_desc[d].vd_addr = vblk_pa + ((uintptr_t) &vblk.hdr[slot] - (uintptr_t) &vblk);
+	vq_desc[d].vd_len = sizeof(struct VblkHdr);
+	vq_desc[d].vd_flags = VRING_DESC_NEXT;
+	vq_desc[d].vd_next = d + 1;
+	d++;
+
+	for (; len > 0; va += n, len -= n, d++) {
+		if ((r = sys_page_phys((void *) ROUNDDOWN(va, PGSIZE))) < 0)
+			return r;
+		n = MIN(len, PGSIZE - PGOFF(va));
+		vq_desc[d].vd_addr = ((physaddr_t) r << PGSHIFT) + PGOFF(va);
+		vq_desc[d].vd_len = n;
+		vq_desc[d].vd_flags = VRING_DESC_NEXT
+			| (req->dr_write ? 0 : VRING_DESC_WRITE);
+		vq_desc[d].vd_next = d + 1;
+	}
+
+	vq_desc[d].vd_addr = vblk_pa + ((uintptr_t) &vblk.status[slot] - (uintptr_t) &vblk);
+	vq_desc[d].vd_len = 1;
+	vq_desc[d].vd_flags = VRING_DESC_WRITE;
+	vq_desc[d].vd_next = 0;
+
+	vq_avail->va_ring[(uint16_t) (vq_avail->va_idx + slot) % vq_size] = *pd;
+	*pd = d + 1;
+	return 0;
+}
+
+// Carry out the 'n' requests in 'reqs'.  As many as fit in the queue
+// are handed to the device together, and the device is notified once
+// for each such group.  Returns 0 on success, < 0 on error.
+int
+virtio_blk_submit(struct DiskReq *reqs, int n)
+{
+	int done, nreq, i, r;
+	uint16_t d;
+
+	for (done = 0; done < n; done += nreq) {
+		for (nreq = 0, d = 0; done + nreq < n && nreq < VBLK_MAXREQ; nreq++) {
+			struct DiskReq *req = &reqs[done + nreq];
+
+			if (req->dr_secno + req->dr_nsecs > vblk_capacity)
+				return -E_INVAL;
+			if (d + vblk_ndesc(req) > vq_size)
+				break;
+			if ((r = vblk_queue(req, nreq, &d)) < 0)
+				return r;
+		}
+		if (nreq == 0)
+			return -E_INVAL;
+
+		// Publish the chains only once they are complete.
+		barrier();
+		vq_avail->va_idx += nreq;
+		barrier();
+		outw(vbase + VIRTIO_QUEUE_NOTIFY, 0);
+		fs_stats.fs_vblk_kicks++;
+
+		while ((uint16_t) (vq_used->vu_idx - vq_used_idx) < nreq)
+			disk_pause();
+		barrier();
+		vq_used_idx += nreq;
+		// Reading the ISR register acknowledges the interrupt.
+		inb(vbase + VIRTIO_ISR);
+
+		for (i = 0; i < nreq; i++)
+			if (vblk.status[i] != VBLK_S_OK)
+				return -1;
+		fs_stats.fs_vblk_reqs += nreq;
+	}
+	return 0;
+}
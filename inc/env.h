@@ -29,6 +29,15 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Most pages one IPC message can carry
+#define IPC_MAXPAGES		32
+
+// How sys_ipc_recv waits
+#define IPC_RECV_BLOCK		0	// start receiving and wait for a message
+#define IPC_RECV_START		1	// start receiving and return at once
+#define IPC_RECV_WAIT		2	// wait for the receive started before
+#define IPC_RECV_WAIT_IRQ	3	// IPC_RECV_WAIT, or for an interrupt
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -65,6 +74,12 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_npages;	// Pages accepted; then pages received
+	bool env_ipc_waiting;		// Env is blocked in sys_ipc_recv
+
+	// Hardware interrupt delivery
+	bool env_irq_waiting;		// Env is blocked in sys_irq_wait, or in
+					// sys_ipc_recv with IPC_RECV_WAIT_IRQ
 };
 
 #endif // !JOS_INC_ENV_H
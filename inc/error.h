@@ -25,6 +25,7 @@ enum {
 	E_FILE_EXISTS	= 13,	// File already exists
 	E_NOT_EXEC	= 14,	// File not a valid executable
 	E_NOT_SUPP	= 15,	// Operation not supported
+	E_BUSY		= 16,	// File is in use
 
 	MAXERROR
 };
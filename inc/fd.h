@@ -12,6 +12,12 @@ struct Fd;
 struct Stat;
 struct Dev;
 
+// One buffer of a vectored read or write
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
 // Per-device-class file descriptor operations
 struct Dev {
 	int dev_id;
@@ -21,6 +27,9 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Positional, vectored transfers; optional
+	ssize_t (*dev_preadv)(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+	ssize_t (*dev_pwritev)(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
 };
 
 struct FdFile {
@@ -24,26 +24,102 @@
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Largest file the legacy direct/indirect block map can describe
+#define MAXLEGACYSIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+
+// A run of consecutive disk blocks holding consecutive file blocks
+struct Extent {
+	uint32_t e_start;		// first disk block of the run
+	uint32_t e_len;			// number of blocks in the run
+};
+
+// Number of extents in a File descriptor
+#define NEXTENT		12
+// Number of extents in an extent block
+#define BLKEXTENTS	(BLKSIZE / sizeof(struct Extent))
+// Maximum number of extents a file can have
+#define MAXEXTENTS	(NEXTENT + BLKEXTENTS)
+
+// Largest file size off_t can express, rounded down to a block.
+// Extent-mapped files are otherwise limited only by the disk size.
+#define MAXFILESIZE	(0x7FFFFFFF & ~(BLKSIZE - 1))
+
+// Largest file whose data can be kept in its File descriptor
+#define MAXINLINE	(8 + 8*NEXTENT)
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	// Block map.  Which of the three layouts is in use is decided
+	// by the F_EXTENTS and F_INLINE flags.
+	union {
+		// Legacy layout.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+		// Extent layout.
+		// File blocks are mapped in order, without holes: the
+		// first f_extent[0].e_len blocks of the file live in the
+		// first extent, the next ones in the second, and so on.
+		// Extents past NEXTENT are kept in the f_xblock block.
+		struct {
+			uint32_t f_nextents;		// number of extents
+			uint32_t f_xblock;		// extent block
+			struct Extent f_extent[NEXTENT];
+		};
+		// Inline layout.
+		// The file has no blocks: its f_size bytes are right here,
+		// and the bytes after them are zero.
+		char f_inline[MAXINLINE];
+	};
+	// Flags.  These and the hash fields below took over bytes of
+	// padding that old images did not zero; file systems made before
+	// them should be reformatted (see file_check_flags).
+	uint32_t f_flags;		// F_* flags
+
+	// Directory hash index.
+	uint32_t f_hindex;		// index block of a F_HASHED directory
+	uint32_t f_hnext;		// next slot + 1 in this entry's chain
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - (8 + 8*NEXTENT) - 12];
 } __attribute__((packed));	// required only on some 64-bit machines
 
+// File flags
+#define F_EXTENTS	0x1	// Block map is a list of extents
+#define F_HASHED	0x2	// Directory has a hash index
+#define F_INLINE	0x4	// Data is in f_inline, not in blocks
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
+// The hash index of a directory lives in its own block, so the
+// directory's contents stay a plain array of 'struct File's.
+// Entries are named by slot: entry j of directory block i is in slot
+// i * BLKFILES + j.  Chains hold slot + 1, so that 0 ends a chain.
+#define NDIRBUCKET	(BLKSIZE / 4 - 1)
+
+struct DirIndex {
+	uint32_t di_free;		// chain of unused slots
+	uint32_t di_bucket[NDIRBUCKET];	// chains of entries by name hash
+};
+
+// Hash bucket of a directory entry named 'name' (FNV-1a).
+static __inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619u;
+	return h % NDIRBUCKET;
+}
+
 // File types
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
@@ -57,8 +133,66 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// first block of the journal
+	uint32_t s_njournal;		// journal size in blocks; 0 if none
+	uint32_t s_ndisks;		// disks the blocks are striped over;
+					// 0 or 1 if just one
+	uint32_t s_stripe;		// blocks per stripe unit
+};
+
+// Striped file systems: block b is in stripe unit u = b / s_stripe,
+// which is on disk u % s_ndisks, at block (u / s_ndisks) * s_stripe +
+// b % s_stripe of that disk.  The superblock, in block 1, is on the
+// first disk, where it would be on an unstriped disk.
+#define FS_MAXDISKS	2
+#define FS_MINSTRIPE	2
+#define FS_MAXSTRIPE	32
+
+// Metadata journal.  The first block of the journal holds a
+// JournalHeader; the rest is the log, filled from its start with
+// transactions: a JournalDesc block followed by the new contents of
+// the jd_nblocks metadata blocks it lists.  Transactions are replayed
+// at mount in order, starting from sequence number jh_seq, up to the
+// first one whose descriptor or checksum does not match.
+
+#define JOURNAL_MAGIC	0x4A4E4C21	// 'JNL!'
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// sequence number of the first transaction
+};
+
+// Most blocks one transaction can hold
+#define JOURNAL_MAXTX	(BLKSIZE / 4 - 4)
+
+struct JournalDesc {
+	uint32_t jd_magic;		// JOURNAL_MAGIC
+	uint32_t jd_seq;		// sequence number of this transaction
+	uint32_t jd_nblocks;		// number of blocks that follow
+	uint32_t jd_sum;		// journal_sum of the transaction
+	uint32_t jd_blocks[JOURNAL_MAXTX];	// where each block belongs
 };
 
+// Checksum of the transaction described by 'jd', whose blocks follow
+// each other in memory from 'blocks' on: FNV-1a over its header fields
+// and contents.
+static __inline uint32_t
+journal_sum(const struct JournalDesc *jd, const void *blocks)
+{
+	uint32_t h = 2166136261u, i, j;
+	const uint32_t *w;
+
+	h = (h ^ jd->jd_seq) * 16777619u;
+	h = (h ^ jd->jd_nblocks) * 16777619u;
+	for (i = 0; i < jd->jd_nblocks; i++) {
+		h = (h ^ jd->jd_blocks[i]) * 16777619u;
+		w = (const uint32_t *) blocks + i * (BLKSIZE / 4);
+		for (j = 0; j < BLKSIZE / 4; j++)
+			h = (h ^ w[j]) * 16777619u;
+	}
+	return h;
+}
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
@@ -70,9 +204,75 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Stats returns a Fsret_stats on the request page
+	FSREQ_STATS,
+	// Read map returns a read-only block cache page
+	FSREQ_READ_MAP,
+	// Pread and pwrite move data in the pages after the request page
+	FSREQ_PREAD,
+	FSREQ_PWRITE,
+	// Ring setup passes the FSRING_PAGES pages of a request ring
+	FSREQ_RING_SETUP,
+	// Ring kick has no page and no reply; it wakes the server up to
+	// drain the rings
+	FSREQ_RING_KICK,
+	// Readdir returns a Fsret_readdir on the request page
+	FSREQ_READDIR
+};
+
+// Most data pages that follow the request page of a pread or pwrite
+#define FSBULKPAGES	16
+
+// Buckets of the request latency histogram in struct FsStats
+#define FSLAT_NBUCKETS	32
+
+// File system server statistics
+struct FsStats {
+	uint32_t fs_bc_hits;		// blocks file_read found in the cache
+	uint32_t fs_bc_misses;		// blocks read in by a page fault
+	uint32_t fs_bc_prefetched;	// blocks read in by read-ahead
+	uint32_t fs_bc_prefetch_ios;	// disk commands issued for read-ahead
+	uint32_t fs_bc_evictions;	// blocks evicted from the cache
+	uint32_t fs_bc_writebacks;	// dirty blocks written out to evict them
+	uint32_t fs_bc_resident;	// blocks in the cache
+	uint32_t fs_bc_budget;		// most blocks the cache may hold
+	uint32_t fs_ide_dma;		// disk commands done with bus-master DMA
+	uint32_t fs_ide_pio;		// disk commands done with PIO
+	uint32_t fs_vblk_reqs;		// requests done by virtio-blk
+	uint32_t fs_vblk_kicks;		// times virtio-blk was handed a batch
+	uint32_t fs_ring_reqs;		// requests taken from request rings
+	uint32_t fs_ring_drains;	// wakeups that found ring requests
+	uint32_t fs_reqs;		// requests served
+	uint32_t fs_reqs_parked;	// requests that waited for the disk
+	uint32_t fs_delayed;		// file blocks allocated late
+	uint32_t fs_delay_runs;		// disk block runs they were given
+	uint32_t fs_promoted;		// inline files moved out to blocks
+	uint32_t fs_jcommits;		// journal transactions written
+	uint32_t fs_jblocks;		// metadata blocks written to the journal
+	uint32_t fs_jcheckpoints;	// times the log was written in place
+	uint32_t fs_direct;		// blocks moved between clients and the
+					// disk without the block cache
+	// Request latency: fs_lat_hist[i] counts requests that took
+	// fewer than 2^(i+1) cycles (and at least 2^i, for i > 0)
+	// from their arrival to their reply.
+	uint32_t fs_lat_hist[FSLAT_NBUCKETS];
 };
 
+// A directory entry as FSREQ_READDIR returns it.  Entries are packed
+// one after the other; each takes d_reclen bytes.
+struct Dirent {
+	off_t d_size;			// file size in bytes
+	uint16_t d_reclen;		// bytes from here to the next entry
+	uint8_t d_type;			// file type
+	uint8_t d_namelen;		// length of d_name
+	char d_name[0];			// null-terminated name
+};
+
+// Bytes a Dirent with a name of 'namelen' characters takes
+#define DIRENT_SIZE(namelen) \
+	ROUNDUP(sizeof(struct Dirent) + (namelen) + 1, sizeof(uint32_t))
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -104,13 +304,75 @@ union Fsipc {
 	} statRet;
 	struct Fsreq_flush {
 		int req_fileid;
+		// Blocks in [req_offset, req_offset + req_len) were written
+		// through a mapping and must be written out too.
+		off_t req_offset;
+		size_t req_len;
+		// Also commit the journal, so that the file's metadata
+		// is on disk when the request is answered.
+		bool req_commit;
 	} flush;
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsret_stats {
+		struct FsStats ret_stats;
+	} statsRet;
+	struct Fsreq_pio {
+		int req_fileid;
+		off_t req_offset;
+		size_t req_n;
+	} pio;
+	struct Fsreq_read_map {
+		int req_fileid;
+		off_t req_offset;
+		bool req_write;		// map the page writable
+		bool req_share;		// for a shared mapping
+	} read_map;
+	struct Fsreq_readdir {
+		int req_fileid;
+		// Directory offset to go on from: 0 at first, then the
+		// ret_cookie of the previous reply
+		off_t req_cookie;
+		size_t req_n;		// most bytes of entries to return
+	} readdir;
+	struct Fsret_readdir {
+		off_t ret_cookie;
+		size_t ret_n;		// bytes of entries in ret_buf
+		char ret_buf[PGSIZE - sizeof(off_t) - sizeof(size_t)];
+	} readdirRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
 };
 
+// A request ring lets a client queue requests for the file server in
+// memory it shares with the server, instead of sending each one by IPC.
+// The ring is FSRING_PAGES pages: the submission queue, the completion
+// queue, then one union Fsipc request page per slot.  Queue indices run
+// freely and are used modulo FSRING_SIZE.  The client fills in a slot
+// and queues its number; the server runs the request on the slot page,
+// where any reply goes, and queues the slot and result on the
+// completion queue.  Only requests that pass no pages can use a ring.
+#define FSRING_SIZE	8
+#define FSRING_PAGES	(2 + FSRING_SIZE)
+
+struct FsSq {
+	volatile uint32_t sq_head;	// next entry the server takes
+	volatile uint32_t sq_tail;	// next entry the client fills
+	struct FsSqe {
+		uint32_t sqe_type;	// FSREQ_*
+		uint32_t sqe_slot;	// request page holding the arguments
+	} sq_ents[FSRING_SIZE];
+};
+
+struct FsCq {
+	volatile uint32_t cq_head;	// next entry the client takes
+	volatile uint32_t cq_tail;	// next entry the server fills
+	struct FsCqe {
+		uint32_t cqe_slot;
+		int32_t cqe_res;	// what the IPC reply value would be
+	} cq_ents[FSRING_SIZE];
+};
+
 #endif /* !JOS_INC_FS_H */
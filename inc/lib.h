@@ -65,9 +65,15 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
-int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
-int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm,
+			 size_t npages);
+int	sys_ipc_recv(void *rcv_pg, size_t npages, int how);
 int	sys_gettime(void);
+int	sys_page_phys(void *va);
+int	sys_page_alloc_contig(void *va, size_t npages, int perm);
+int	sys_page_move(void *srcva, void *dstva, size_t npages, int perm);
+int	sys_irq_listen(int irq);
+int	sys_irq_wait(int irq);
 
 int	vsys_gettime(void);
 
@@ -86,7 +92,12 @@ sys_exofork(void)
 
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, size_t npages, int *perm_store);
+int	ipc_recv_start(void *pg, size_t npages);
+int	ipc_recv_poll(envid_t *from_env_store, uint32_t *value_store,
+		      int *perm_store, bool wait);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
@@ -100,7 +111,14 @@ ssize_t	read(int fd, void *buf, size_t nbytes);
 ssize_t	write(int fd, const void *buf, size_t nbytes);
 int	seek(int fd, off_t offset);
 void	close_all(void);
+void	drain_all(void);
 ssize_t	readn(int fd, void *buf, size_t nbytes);
+ssize_t	pread(int fd, void *buf, size_t nbytes, off_t offset);
+ssize_t	pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
+ssize_t	readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t	writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t	preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t	pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
@@ -110,6 +128,22 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fsstats(struct FsStats *st);
+int	read_map(int fd, off_t offset, void **blk);
+ssize_t	readdir(int fd, void *buf, size_t n);
+int	devfile_map(struct Fd *fd, off_t offset, void *dstva, bool write, bool share);
+int	devfile_sync(struct Fd *fd, off_t offset, size_t len);
+int	devfile_drain(struct Fd *fd);
+int	fsync(int fd);
+int	fsring_prep(unsigned type, union Fsipc **req);
+void	fsring_submit(void);
+int	fsring_wait(int slot);
+
+// mmap.c
+int	mmap(int fd, off_t offset, size_t len, int prot, int flags, void **addr);
+int	msync(void *addr, size_t len);
+int	munmap(void *addr, size_t len);
+bool	mmap_pgfault(struct UTrapframe *utf);
 
 // pageref.c
 int	pageref(void *addr);
@@ -125,6 +159,29 @@ int	getchar(void);
 int	iscons(int fd);
 int	opencons(void);
 
+// stdio.c
+#define	EOF		(-1)
+#define	FOPEN_MAX	16	/* streams open at once, with stdin/out/err */
+#define	_IOFBF		0	/* fully buffered */
+#define	_IOLBF		1	/* line buffered */
+#define	_IONBF		2	/* unbuffered */
+typedef struct FILE FILE;
+extern FILE *stdin, *stdout, *stderr;
+FILE*	fopen(const char *path, const char *mode);
+FILE*	fdopen(int fd, const char *mode);
+int	fclose(FILE *f);
+int	fflush(FILE *f);
+int	setvbuf(FILE *f, char *buf, int mode, size_t size);
+size_t	fread(void *buf, size_t size, size_t n, FILE *f);
+size_t	fwrite(const void *buf, size_t size, size_t n, FILE *f);
+int	fgetc(FILE *f);
+int	fputc(int c, FILE *f);
+char*	fgets(char *s, int n, FILE *f);
+int	fputs(const char *s, FILE *f);
+int	feof(FILE *f);
+int	ferror(FILE *f);
+int	fileno(FILE *f);
+
 // pipe.c
 int	pipe(int pipefds[2]);
 int	pipeisclosed(int pipefd);
@@ -142,6 +199,14 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#define O_NOBUF		0x1000		/* no client-side buffering */
+#define O_DIRECT	0x2000		/* bulk transfers bypass the block cache */
+
+/* mmap protections and flags */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+#define	MAP_SHARED	0x1		/* writes go to the file */
+#define	MAP_PRIVATE	0x2		/* writes are private copies */
 
 #ifdef JOS_PROG
 extern void (* volatile sys_exit)(void);
@@ -139,6 +139,8 @@
 #define USTACKSIZE  (2*PGSIZE)
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
+// Max number of those one environment may have open
+#define MAXOPEN_ENV	(MAXOPEN / 4)
 #define FILEVA		0xD0000000
 
 #ifdef SANITIZE_USER_SHADOW_OFF
@@ -18,6 +18,11 @@ enum {
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
 	SYS_gettime,
+	SYS_page_phys,
+	SYS_page_alloc_contig,
+	SYS_irq_listen,
+	SYS_irq_wait,
+	SYS_page_move,
 	NSYSCALLS
 };
 
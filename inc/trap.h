@@ -38,8 +38,12 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_CLOCK        8
 #define IRQ_IDE         14
+#define IRQ_IDE2        15
 #define IRQ_ERROR       19
 
+// sys_irq_wait argument: any interrupt the environment listens to
+#define IRQ_ANY         (-1)
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
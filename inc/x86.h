@@ -34,6 +34,7 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint32_t bsf(uint32_t val) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -280,6 +281,16 @@ read_tsc(void)
 	return tsc;
 }
 
+// Index of the least significant set bit of val.
+// The result is undefined if val is zero.
+static __inline uint32_t
+bsf(uint32_t val)
+{
+	uint32_t idx;
+	__asm __volatile("bsfl %1,%0" : "=r" (idx) : "rm" (val) : "cc");
+	return idx;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -307,4 +318,9 @@ nmi_disable(void)
 	outb(0x70, inb(0x70) | NMI_LOCK );
 }
 
+// Keep the compiler from moving memory accesses across this point.
+// x86 does not reorder stores with stores or loads with loads, so this
+// is enough to order accesses to memory shared with another environment.
+#define barrier()	__asm __volatile("" : : : "memory")
+
 #endif /* !JOS_INC_X86_H */
@@ -283,6 +283,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_waiting = 0;
+	e->env_irq_waiting = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
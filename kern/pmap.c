@@ -379,6 +379,53 @@ page_free(struct PageInfo *pp)
 	}
 }
 
+//
+// Allocate 'n' physically contiguous pages for a device that reads
+// and writes memory itself.  The pages are taken out of the free list
+// in one pass; like page_alloc, their pp_ref is left at 0.
+//
+// Returns the first page of the run, or NULL if there is no free run
+// that long.
+//
+struct PageInfo *
+page_alloc_npages(int alloc_flags, size_t n)
+{
+	struct PageInfo *first, *pp, **link;
+	size_t i, run;
+
+	if (!n)
+		return NULL;
+	first = NULL;
+	for (i = 0, run = 0; i < npages; i++) {
+		run = is_page_free(&pages[i]) ? run + 1 : 0;
+		if (run == n) {
+			first = &pages[i + 1 - n];
+			break;
+		}
+	}
+	if (!first)
+		return NULL;
+
+	page_free_list_end = NULL;
+	for (link = &page_free_list; (pp = *link); ) {
+		if (pp >= first && pp < first + n) {
+			*link = pp->pp_link;
+			pp->pp_link = NULL;
+		} else {
+			page_free_list_end = pp;
+			link = &pp->pp_link;
+		}
+	}
+	for (pp = first; pp < first + n; pp++) {
+#ifdef SANITIZE_SHADOW_BASE
+		platform_asan_unpoison(page2kva(pp), PGSIZE);
+#endif
+		if (alloc_flags & ALLOC_ZERO)
+			memset(page2kva(pp), 0, PGSIZE);
+	}
+	return first;
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
@@ -49,10 +49,14 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// An environment waiting for a device interrupt is worth halting
+	// for, since the interrupt will make it runnable.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		     envs[i].env_status == ENV_DYING ||
+		     (envs[i].env_status == ENV_NOT_RUNNABLE &&
+		      envs[i].env_irq_waiting)))
 			break;
 	}
 	if (i == NENV) {
@@ -298,8 +298,9 @@ sys_page_unmap(envid_t envid, void *va)
 }
 
 // Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// If srcva < UTOP, then also send the 'npages' pages currently mapped
+// from 'srcva' on, so that receiver gets duplicate mappings of the same
+// pages.  The receiver gets at most as many pages as it asked for.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -311,10 +312,13 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
+// If the target environment is blocked in sys_ipc_recv, it is marked
+// runnable again, returning 0 from the paused system call.  (Hint: does
+// the sys_ipc_recv function ever actually return?)  A target that
+// started receiving with IPC_RECV_START may be blocked for another
+// reason, such as sys_irq_wait, and is left blocked.
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -329,20 +333,23 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//	-E_INVAL if srcva < UTOP and npages is 0 or more than IPC_MAXPAGES.
+//	-E_INVAL if srcva < UTOP but one of the pages is not mapped in the
+//		caller's address space.
+//	-E_INVAL if (perm & PTE_W), but one of the pages is read-only in
+//		the current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map the pages in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		 uint32_t npages)
 {
 	// LAB 9: Your code here.
 	//panic("sys_ipc_try_send not implemented");
 	struct Env *e;
 	struct PageInfo *p;
 	pte_t *ptep;
+	uint32_t i;
 
 	if (envid2env(envid, &e, 0) < 0) {
 		return -E_BAD_ENV;
@@ -357,25 +364,42 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		if (perm & ~PTE_SYSCALL) {
 			return -E_INVAL;
 		}
-		if (!(p = page_lookup(curenv->env_pgdir, srcva, &ptep))) {
+		if (!npages || npages > IPC_MAXPAGES
+		    || (uintptr_t) srcva > UTOP - npages * PGSIZE) {
 			return -E_INVAL;
 		}
-		if (!(*ptep & PTE_W) && (perm & PTE_W)) {
-			return -E_INVAL;
+		// Check every page before mapping any of them.
+		for (i = 0; i < npages; i++) {
+			if (!(p = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, &ptep))) {
+				return -E_INVAL;
+			}
+			if (!(*ptep & PTE_W) && (perm & PTE_W)) {
+				return -E_INVAL;
+			}
 		}
-		if (page_insert(e->env_pgdir, p, e->env_ipc_dstva, perm)) {
-			return -E_NO_MEM;
-        }
-        e->env_ipc_perm = perm;
+		npages = MIN(npages, e->env_ipc_npages);
+		for (i = 0; i < npages; i++) {
+			p = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, NULL);
+			if (page_insert(e->env_pgdir, p, e->env_ipc_dstva + i * PGSIZE, perm)) {
+				return -E_NO_MEM;
+			}
+		}
+		e->env_ipc_perm = npages ? perm : 0;
+		e->env_ipc_npages = npages;
 	}
 	else {
 		e->env_ipc_perm = 0;
+		e->env_ipc_npages = 0;
 	}
 
 	e->env_ipc_recving = 0;
 	e->env_ipc_from = curenv->env_id;
 	e->env_ipc_value = value;
-	e->env_status = ENV_RUNNABLE;
+	if (e->env_ipc_waiting) {
+		e->env_ipc_waiting = 0;
+		e->env_irq_waiting = 0;
+		e->env_status = ENV_RUNNABLE;
+	}
 	return 0;
 }
 
@@ -383,24 +407,65 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP, then you are willing to receive up to 'npages'
+// pages of data.  'dstva' is the virtual address at which the first
+// sent page should be mapped; the others follow it.
+//
+// 'how' is IPC_RECV_BLOCK to receive as described above.
+// IPC_RECV_START starts receiving but returns at once; the environment
+// keeps running, and can tell that a message has arrived from its
+// env_ipc_recving turning 0.  IPC_RECV_WAIT then blocks until that
+// happens, or returns at once if it has already happened.
+// IPC_RECV_WAIT_IRQ does the same, but also returns when one of the
+// interrupts the environment listens to arrives (see sys_irq_wait).
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP and npages is 0, more than IPC_MAXPAGES,
+//		or the pages would not all fit below UTOP.
+//	-E_INVAL if 'how' is not one of the above.
+//	-E_INVAL if 'how' is IPC_RECV_WAIT_IRQ and the environment is not
+//		listening to any interrupt.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t npages, uint32_t how)
 {
 	// LAB 9: Your code here.
 	//panic("sys_ipc_recv not implemented");
+	int r;
+
+	if (how == IPC_RECV_WAIT || how == IPC_RECV_WAIT_IRQ) {
+		if (!curenv->env_ipc_recving)
+			return 0;
+		if (how == IPC_RECV_WAIT_IRQ) {
+			if ((r = irq_take(IRQ_ANY)) != 0)
+				return r < 0 ? r : 0;
+			curenv->env_irq_waiting = 1;
+		}
+		curenv->env_ipc_waiting = 1;
+		curenv->env_status = ENV_NOT_RUNNABLE;
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
+	if (how != IPC_RECV_BLOCK && how != IPC_RECV_START) {
+		return -E_INVAL;
+	}
 	if ((uintptr_t) dstva < UTOP && PGOFF(dstva)) {
         return -E_INVAL;
     }
+	if ((uintptr_t) dstva < UTOP && (!npages || npages > IPC_MAXPAGES
+	    || (uintptr_t) dstva > UTOP - npages * PGSIZE)) {
+		return -E_INVAL;
+	}
 
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_npages = (uintptr_t) dstva < UTOP ? npages : 0;
+	if (how == IPC_RECV_START) {
+		return 0;
+	}
+	curenv->env_ipc_waiting = 1;
 	curenv->env_status = ENV_NOT_RUNNABLE;
     curenv->env_tf.tf_regs.reg_eax = 0;
 	sched_yield();
@@ -417,6 +482,147 @@ sys_gettime(void)
 	return gettime();
 }
 
+// Return the physical page number of the page mapped at 'va' in the
+// caller's address space, so that the file system server can point
+// disk DMA at its block cache.
+//
+// Returns the page number on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the file system environment.
+//	-E_INVAL if va >= UTOP, or no page is mapped at va.
+static int
+sys_page_phys(void *va)
+{
+	struct PageInfo *pp;
+
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, va, NULL)))
+		return -E_INVAL;
+	return PGNUM(page2pa(pp));
+}
+
+// Allocate 'npages' physically contiguous, zeroed pages and map them
+// at 'va' onwards in the caller's address space, for device rings that
+// span more than one page.  Only the file system environment may
+// allocate contiguous memory.
+//
+// Returns the physical page number of the first page on success,
+// < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the file system environment.
+//	-E_INVAL if the range is not below UTOP, va is not page-aligned,
+//		or perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there is no free run of npages pages, or no memory
+//		for the page tables.
+static int
+sys_page_alloc_contig(void *va, size_t npages, int perm)
+{
+	struct PageInfo *pp;
+	size_t i;
+
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	if (!npages || npages > UTOP / PGSIZE ||
+	    (uintptr_t) va > UTOP - npages * PGSIZE ||
+	    PGOFF(va) || perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+	// Make the page tables first, so that page_insert cannot fail
+	// once the pages are allocated.
+	for (i = 0; i < npages; i++)
+		if (!pgdir_walk(curenv->env_pgdir, (char *) va + i * PGSIZE, 1))
+			return -E_NO_MEM;
+	if (!(pp = page_alloc_npages(ALLOC_ZERO, npages)))
+		return -E_NO_MEM;
+	for (i = 0; i < npages; i++)
+		if (page_insert(curenv->env_pgdir, pp + i,
+				(char *) va + i * PGSIZE, perm | PTE_U | PTE_P) < 0)
+			panic("sys_page_alloc_contig: page_insert failed");
+	return PGNUM(page2pa(pp));
+}
+
+// Move the 'npages' pages mapped from 'srcva' on in the caller's
+// address space to 'dstva' onwards, with permission 'perm', leaving
+// the source range unmapped.  Whatever was mapped in the destination
+// range is unmapped first.  This does for a run of pages what a
+// sys_page_map and a sys_page_unmap per page would.  Perm has the same
+// restrictions as in sys_page_map.  Nothing is moved unless all of it
+// can be.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if npages is 0, either range is not below UTOP, srcva or
+//		dstva is not page-aligned, or the ranges overlap.
+//	-E_INVAL if a page of the source range is not mapped.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but a source page is read-only.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_move(void *srcva, void *dstva, size_t npages, int perm)
+{
+	char *src = srcva, *dst = dstva;
+	struct PageInfo *pp;
+	pte_t *ptep;
+	size_t i;
+
+	if (!npages || npages > UTOP / PGSIZE ||
+	    (uintptr_t) srcva > UTOP - npages * PGSIZE || PGOFF(srcva) ||
+	    (uintptr_t) dstva > UTOP - npages * PGSIZE || PGOFF(dstva) ||
+	    (src < dst + npages * PGSIZE && dst < src + npages * PGSIZE) ||
+	    perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+	// Check every page, and make the page tables, before moving any,
+	// so that page_insert cannot fail below.
+	for (i = 0; i < npages; i++) {
+		if (!(pp = page_lookup(curenv->env_pgdir, src + i * PGSIZE, &ptep)) ||
+		    (!(*ptep & PTE_W) && (perm & PTE_W)))
+			return -E_INVAL;
+		if (!pgdir_walk(curenv->env_pgdir, dst + i * PGSIZE, 1))
+			return -E_NO_MEM;
+	}
+	for (i = 0; i < npages; i++) {
+		pp = page_lookup(curenv->env_pgdir, src + i * PGSIZE, NULL);
+		if (page_insert(curenv->env_pgdir, pp, dst + i * PGSIZE,
+				perm | PTE_U | PTE_P) < 0)
+			panic("sys_page_move: page_insert failed");
+		page_remove(curenv->env_pgdir, src + i * PGSIZE);
+	}
+	return 0;
+}
+
+// Deliver hardware interrupt 'irq' to the calling environment, which
+// can then wait for it with sys_irq_wait.  Only the file system
+// environment may listen, and only to the disk interrupts.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the file system environment.
+//	-E_INVAL if irq is not a disk interrupt.
+static int
+sys_irq_listen(int irq)
+{
+	return irq_listen(irq);
+}
+
+// Block until interrupt 'irq' arrives, or any interrupt the caller
+// listens to if 'irq' is IRQ_ANY.  Returns at once if one arrived since
+// the last call.  The interrupt says that the device
+// wants attention, not what happened, so callers should check the
+// device's status afterwards.
+//
+// Returns 0 on success, -E_INVAL if the caller is not listening to irq.
+static int
+sys_irq_wait(int irq)
+{
+	int r;
+
+	if ((r = irq_take(irq)) != 0)
+		return r < 0 ? r : 0;
+	curenv->env_irq_waiting = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+	return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -450,13 +656,23 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			sys_yield();
 			return 0;
 		case SYS_ipc_try_send:
-			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4);
+			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4, a5);
 		case SYS_ipc_recv:
-			return sys_ipc_recv((void *) a1);
+			return sys_ipc_recv((void *) a1, a2, a3);
 		case SYS_env_set_trapframe:
 			return sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
 		case SYS_gettime:
 			return sys_gettime();
+		case SYS_page_phys:
+			return sys_page_phys((void *) a1);
+		case SYS_page_alloc_contig:
+			return sys_page_alloc_contig((void *) a1, (size_t) a2, (int) a3);
+		case SYS_irq_listen:
+			return sys_irq_listen((int) a1);
+		case SYS_irq_wait:
+			return sys_irq_wait((int) a1);
+		case SYS_page_move:
+			return sys_page_move((void *) a1, (void *) a2, (size_t) a3, (int) a4);
 		default:
 			return -E_INVAL;
 	}
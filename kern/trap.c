@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/string.h>
 #include <inc/vsyscall.h>
 #include <kern/pmap.h>
@@ -18,7 +19,6 @@
 # define debug 0
 #endif
 
-static struct Taskstate ts;
 int *vsys;
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -26,6 +26,12 @@ int *vsys;
  */
 static struct Trapframe *last_tf;
 
+/* Environments that asked for hardware interrupts with sys_irq_listen,
+ * and interrupts that arrived while their listener was not waiting.
+ */
+static envid_t irq_listener[MAX_IRQS];
+static bool irq_pending[MAX_IRQS];
+
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
  */
@@ -92,6 +98,8 @@ trap_init(void)
 	extern void (*syscall_thdlr)(void);
 	extern void (*kbd_thdlr)(void);
     extern void (*serial_thdlr)(void);
+	extern void (*ide_thdlr)(void);
+	extern void (*ide2_thdlr)(void);
 	//инициализация IDT
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, (int) &divide_thdlr, 0);
 	SETGATE(idt[T_DEBUG], 0, GD_KT, (int) &debug_thdlr, 0);
@@ -109,6 +117,8 @@ trap_init(void)
 	SETGATE(idt[T_FPERR], 0, GD_KT, (int) &fperr_thdlr, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, &kbd_thdlr, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, &serial_thdlr, 3);
+	SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, &ide_thdlr, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_IDE2], 0, GD_KT, &ide2_thdlr, 0);
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, (int) &syscall_thdlr, 3);
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -120,11 +130,11 @@ trap_init_percpu(void)
 {
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	cpu_ts.ts_esp0 = KSTACKTOP;
+	cpu_ts.ts_ss0 = GD_KD;
 
 	// Initialize the TSS slot of the gdt.
-	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&cpu_ts),
 					sizeof(struct Taskstate), 0);
 	gdt[GD_TSS0 >> 3].sd_s = 0;
 
@@ -192,6 +202,69 @@ print_regs(struct PushRegs *regs)
 }
 
 
+// Route hardware interrupt 'irq' to the current environment.
+// Only the disk interrupts can be routed, and only to an environment
+// with I/O privilege (the file system server).
+int
+irq_listen(int irq)
+{
+	if (irq != IRQ_IDE && irq != IRQ_IDE2)
+		return -E_INVAL;
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	irq_listener[irq] = curenv->env_id;
+	irq_pending[irq] = 0;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Consume an interrupt on 'irq', or on any interrupt if 'irq' is
+// IRQ_ANY, that arrived while the current environment was not waiting
+// for it.
+// Returns 1 if there was one, 0 if not, < 0 if the current
+// environment is not listening to 'irq' (or to any interrupt).
+int
+irq_take(int irq)
+{
+	int i, r;
+
+	if (irq == IRQ_ANY) {
+		r = -E_INVAL;
+		for (i = 0; i < MAX_IRQS; i++)
+			if (irq_listener[i] && irq_listener[i] == curenv->env_id
+			    && (r = irq_take(i)) > 0)
+				return r;
+		return r;
+	}
+	if (irq < 0 || irq >= MAX_IRQS || !irq_listener[irq]
+	    || irq_listener[irq] != curenv->env_id)
+		return -E_INVAL;
+	if (!irq_pending[irq])
+		return 0;
+	irq_pending[irq] = 0;
+	return 1;
+}
+
+// Hand interrupt 'irq' to its listener.  A listener blocked in
+// sys_irq_wait, or in sys_ipc_recv with IPC_RECV_WAIT_IRQ, is run right
+// away; otherwise the interrupt is left pending for its next wait.
+static void
+irq_deliver(int irq)
+{
+	struct Env *e;
+
+	pic_send_eoi(irq);
+	if (!irq_listener[irq] || envid2env(irq_listener[irq], &e, 0) < 0)
+		return;
+	if (e->env_irq_waiting) {
+		e->env_irq_waiting = 0;
+		e->env_ipc_waiting = 0;
+		e->env_status = ENV_RUNNABLE;
+		env_run(e);
+	}
+	irq_pending[irq] = 1;
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -251,6 +324,13 @@ trap_dispatch(struct Trapframe *tf)
 	    sched_yield();
 	    return;
 	}
+
+	// Disk interrupts go to the environment listening for them.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_IDE ||
+	    tf->tf_trapno == IRQ_OFFSET + IRQ_IDE2) {
+		irq_deliver(tf->tf_trapno - IRQ_OFFSET);
+		return;
+	}
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT) {
 		panic("unhandled trap in kernel");
@@ -280,6 +360,14 @@ trap(struct Trapframe *tf)
 		cprintf("Incoming TRAP frame at %p\n", tf);
 	}
 
+	// An interrupt that woke the CPU up in sched_halt has no
+	// environment to return to.
+	if (!curenv) {
+		assert(tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS);
+		trap_dispatch(tf);
+		sched_yield();
+	}
+
 	assert(curenv);
 
 	// Garbage collect if current enviroment is a zombie
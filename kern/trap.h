@@ -19,6 +19,8 @@ void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
+int irq_listen(int irq);
+int irq_take(int irq);
 void backtrace(struct Trapframe *);
 
 #endif /* JOS_KERN_TRAP_H */
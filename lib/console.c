@@ -21,6 +21,8 @@ getchar(void)
 	// JOS does, however, support standard _input_ redirection,
 	// allowing the user to redirect script files to the shell and such.
 	// getchar() reads a character from file descriptor 0.
+	// It reads no further than that, so that the shell does not take
+	// input meant for the commands it runs; fgetc(stdin) reads ahead.
 	r = read(0, &c, 1);
 	if (r < 0)
 		return r;
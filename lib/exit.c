@@ -4,6 +4,7 @@
 void
 exit(void)
 {
+	fflush(NULL);
 	close_all();
 	sys_env_destroy(0);
 }
@@ -172,6 +172,28 @@ close_all(void)
 		close(i);
 }
 
+// Write out the data buffered for 'fd', if its device buffers any.
+static int
+fd_drain(struct Fd *fd)
+{
+	if (fd->fd_dev_id == devfile.dev_id)
+		return devfile_drain(fd);
+	return 0;
+}
+
+// Write out the data buffered for every open file descriptor.  Called
+// before file descriptors are shared with another environment.
+void
+drain_all(void)
+{
+	struct Fd *fd;
+	int i;
+
+	for (i = 0; i < MAXFD; i++)
+		if (fd_lookup(i, &fd) == 0)
+			(void) fd_drain(fd);
+}
+
 // Make file descriptor 'newfdnum' a duplicate of file descriptor 'oldfdnum'.
 // For instance, writing onto either file descriptor will affect the
 // file and the file offset of the other.
@@ -184,7 +206,8 @@ dup(int oldfdnum, int newfdnum)
 	char *ova, *nva;
 	struct Fd *oldfd, *newfd;
 
-	if ((r = fd_lookup(oldfdnum, &oldfd)) < 0)
+	if ((r = fd_lookup(oldfdnum, &oldfd)) < 0
+	    || (r = fd_drain(oldfd)) < 0)
 		return r;
 	close(newfdnum);
 
@@ -262,13 +285,131 @@ write(int fdnum, const void *buf, size_t n)
 	return (*dev->dev_write)(fd, buf, n);
 }
 
+// Look up fdnum for a transfer in direction 'write', checking the
+// open mode.  Sets *pfd and *pdev.
+static int
+fd_lookup_io(int fdnum, bool write, struct Fd **pfd, struct Dev **pdev)
+{
+	int r;
+
+	if ((r = fd_lookup(fdnum, pfd)) < 0
+	    || (r = dev_lookup((*pfd)->fd_dev_id, pdev)) < 0)
+		return r;
+	if (((*pfd)->fd_omode & O_ACCMODE) == (write ? O_RDONLY : O_WRONLY)) {
+		cprintf("[%08x] %s %d -- bad mode\n", thisenv->env_id,
+			write ? "write" : "read", fdnum);
+		return -E_INVAL;
+	}
+	return 0;
+}
+
+// Read into the buffers of iov from 'offset' in the file, leaving the
+// file offset alone.  Returns the number of bytes read, or < 0 on error.
+ssize_t
+preadv(int fdnum, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup_io(fdnum, 0, &fd, &dev)) < 0)
+		return r;
+	if (iovcnt < 0 || offset < 0)
+		return -E_INVAL;
+	if (!dev->dev_preadv)
+		return -E_NOT_SUPP;
+	return (*dev->dev_preadv)(fd, iov, iovcnt, offset);
+}
+
+// Write the buffers of iov at 'offset' in the file, leaving the file
+// offset alone.  Returns the number of bytes written, or < 0 on error.
+ssize_t
+pwritev(int fdnum, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup_io(fdnum, 1, &fd, &dev)) < 0)
+		return r;
+	if (iovcnt < 0 || offset < 0)
+		return -E_INVAL;
+	if (!dev->dev_pwritev)
+		return -E_NOT_SUPP;
+	return (*dev->dev_pwritev)(fd, iov, iovcnt, offset);
+}
+
+ssize_t
+pread(int fdnum, void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { buf, n };
+
+	return preadv(fdnum, &iov, 1, offset);
+}
+
+ssize_t
+pwrite(int fdnum, const void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { (void *) buf, n };
+
+	return pwritev(fdnum, &iov, 1, offset);
+}
+
+// Vectored read or write at the file offset.  Devices with positional
+// transfers get the whole vector in one call; others get one read or
+// write per buffer, stopping at the first short one.
+static ssize_t
+rwv(int fdnum, const struct iovec *iov, int iovcnt, bool wr)
+{
+	int i, r;
+	ssize_t m, tot;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup_io(fdnum, wr, &fd, &dev)) < 0)
+		return r;
+	if (iovcnt < 0)
+		return -E_INVAL;
+	if (wr ? dev->dev_pwritev : dev->dev_preadv) {
+		m = wr ? (*dev->dev_pwritev)(fd, iov, iovcnt, fd->fd_offset)
+		       : (*dev->dev_preadv)(fd, iov, iovcnt, fd->fd_offset);
+		if (m > 0)
+			fd->fd_offset += m;
+		return m;
+	}
+
+	for (tot = 0, i = 0; i < iovcnt; i++) {
+		m = wr ? write(fdnum, iov[i].iov_base, iov[i].iov_len)
+		       : readn(fdnum, iov[i].iov_base, iov[i].iov_len);
+		if (m < 0)
+			return tot ? tot : m;
+		tot += m;
+		if (m < iov[i].iov_len)
+			break;
+	}
+	return tot;
+}
+
+ssize_t
+readv(int fdnum, const struct iovec *iov, int iovcnt)
+{
+	return rwv(fdnum, iov, iovcnt, 0);
+}
+
+ssize_t
+writev(int fdnum, const struct iovec *iov, int iovcnt)
+{
+	return rwv(fdnum, iov, iovcnt, 1);
+}
+
 int
 seek(int fdnum, off_t offset)
 {
 	int r;
 	struct Fd *fd;
 
-	if ((r = fd_lookup(fdnum, &fd)) < 0)
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = fd_drain(fd)) < 0)
 		return r;
 	fd->fd_offset = offset;
 	return 0;
@@ -1,5 +1,6 @@
 #include <inc/fs.h>
 #include <inc/string.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 #ifdef debug
@@ -10,26 +11,432 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Map requests can be made from the mmap page fault handler while a
+// request is being built in fsipcbuf, so they use their own page.
+static union Fsipc fsipcmapbuf __attribute__((aligned(PGSIZE)));
+
+// Pread and pwrite requests are built in a request page at FSBULKVA
+// and carry their data in the FSBULKPAGES pages that follow it.
+#define FSBULKVA	0xC8000000
+#define fsbulkbuf	((union Fsipc *) FSBULKVA)
+#define FSBULKDATA	((char *) FSBULKVA + PGSIZE)
+#define FSBULKSIZE	(FSBULKPAGES * PGSIZE)
+
+// Our request ring, set up by the first open.  The pages are PTE_SHARE
+// so that fork leaves them shared with the file server instead of
+// making our copies private.  A child gets its own ring when it first
+// opens a file, and until then uses IPC.
+#define FSRINGVA	0xC9000000
+#define fsring_sq	((struct FsSq *) FSRINGVA)
+#define fsring_cq	((struct FsCq *) (FSRINGVA + PGSIZE))
+#define fsring_reqs	((union Fsipc *) (FSRINGVA + 2 * PGSIZE))
+
+static envid_t fsring_env;		// environment the ring is set up for
+static bool fsring_broken;		// the file server refused the ring
+static uint32_t fsring_tail;		// entries queued but not yet submitted
+static bool fsring_busy[FSRING_SIZE];	// slot handed out by fsring_prep
+static bool fsring_done[FSRING_SIZE];	// slot's request has completed
+static int32_t fsring_res[FSRING_SIZE];
+
+// Client-side buffer of an open file, kept in the spare space at the
+// end of its Fd page.  Small reads fill it with up to FDBUFSIZE bytes
+// from the file position on, and small sequential writes collect in it
+// until it is full, so that each costs a request only once per buffer.
+// The buffer holds either data read or data not yet written, never
+// both.
+//
+// Every environment sharing an Fd page would share its buffer, with no
+// way to keep them from racing on it, so the buffer is only used while
+// the file server and we are the only ones with the page mapped.  Fork,
+// spawn, dup and mmap, which share it, write it out first.
+#define FDBUFSIZE	(PGSIZE - 64)
+
+enum {
+	FB_EMPTY = 0,
+	FB_READ,		// holds file data from fb_off on
+	FB_WRITE,		// holds data to be written at fb_off
+	FB_OFF,			// opened with O_NOBUF
+	FB_DIRECT,		// opened with O_DIRECT: no buffer either
+};
+
+struct FdBuf {
+	int fb_state;
+	off_t fb_off;
+	size_t fb_len;
+	char fb_buf[FDBUFSIZE];
+};
+
+static struct FdBuf *
+fd2buf(struct Fd *fd)
+{
+	static_assert(sizeof(struct Fd) + sizeof(struct FdBuf) <= PGSIZE,
+		      "no room for struct FdBuf");
+	static_assert(FDBUFSIZE <= sizeof(fsipcbuf.write.req_buf),
+		      "FDBUFSIZE too large");
+	return (struct FdBuf *) ((char *) fd + PGSIZE - sizeof(struct FdBuf));
+}
+
+static envid_t
+fs_env(void)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in *req, and parts of the
+// response may be written back to *req.  The 'npages' - 1 pages after
+// *req go along with it.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
+fsipc_req(unsigned type, union Fsipc *req, size_t npages, void *dstva)
+{
+	static_assert(sizeof(*req) == PGSIZE, "Invalid fsipcbuf size");
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
+
+	ipc_send_pages(fs_env(), type, req, npages, PTE_P | PTE_W | PTE_U);
+	return ipc_recv(NULL, dstva, NULL);
+}
+
+// Send the request in fsipcbuf.  Requests queued on the ring go first.
+static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	fsring_submit();
+	return fsipc_req(type, &fsipcbuf, 1, dstva);
+}
 
-	static_assert(sizeof(fsipcbuf) == PGSIZE, "Invalid fsipcbuf size");
+// Make sure the bulk request page and the first 'npages' data pages
+// are our own writable pages, so the file server shares them with us.
+// Pages we inherited copy-on-write from fork are replaced.
+static int
+fsbulk_prepare(size_t npages)
+{
+	uintptr_t va;
+	int r;
+
+	for (va = FSBULKVA; va < (uintptr_t) FSBULKDATA + npages * PGSIZE; va += PGSIZE) {
+		if ((uvpd[PDX(va)] & PTE_P)
+		    && (uvpt[PGNUM(va)] & (PTE_P | PTE_W)) == (PTE_P | PTE_W))
+			continue;
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_W | PTE_U)) < 0)
+			return r;
+#ifdef SANITIZE_USER_SHADOW_BASE
+		platform_asan_unpoison((void *) va, PGSIZE);
+#endif
+	}
+	return 0;
+}
+
+// Copy up to 'n' bytes between 'buf' and the buffers of iov, starting
+// 'skip' bytes into iov[*pi], and move *pi and *pskip past them.  Bytes
+// go into iov if 'to_iov' is set.  A null 'buf' only moves the position.
+// Returns the number of bytes copied.
+static size_t
+iov_copy(const struct iovec *iov, int iovcnt, int *pi, size_t *pskip,
+	 char *buf, size_t n, bool to_iov)
+{
+	size_t m, tot;
+
+	for (tot = 0; tot < n && *pi < iovcnt; ) {
+		m = MIN(n - tot, iov[*pi].iov_len - *pskip);
+		if (buf && to_iov)
+			memmove((char *) iov[*pi].iov_base + *pskip, buf + tot, m);
+		else if (buf)
+			memmove(buf + tot, (char *) iov[*pi].iov_base + *pskip, m);
+		tot += m;
+		if ((*pskip += m) == iov[*pi].iov_len) {
+			++*pi;
+			*pskip = 0;
+		}
+	}
+	return tot;
+}
+
+// Move data between the buffers of iov and 'fd' at 'offset', up to
+// FSBULKSIZE bytes per request.  Stops at the first short transfer.
+// Returns the number of bytes moved, or < 0 on error.
+static ssize_t
+devfile_pio(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset,
+	    bool write)
+{
+	int i = 0, j;
+	size_t skip = 0, jskip, n;
+	ssize_t tot = 0;
+	int r;
+
+	if ((r = devfile_drain(fd)) < 0)
+		return r;
+	for (n = 0, j = 0; j < iovcnt && n < FSBULKSIZE; j++)
+		n += MIN(iov[j].iov_len, FSBULKSIZE);
+	if ((r = fsbulk_prepare(ROUNDUP(MIN(n, FSBULKSIZE), PGSIZE) / PGSIZE)) < 0)
+		return r;
 
+	while (i < iovcnt) {
+		j = i;
+		jskip = skip;
+		n = iov_copy(iov, iovcnt, &j, &jskip,
+			     write ? FSBULKDATA : NULL, FSBULKSIZE, 0);
+		if (n == 0)
+			break;
+
+		fsring_submit();
+		fsbulkbuf->pio.req_fileid = fd->fd_file.id;
+		fsbulkbuf->pio.req_offset = offset;
+		fsbulkbuf->pio.req_n = n;
+		r = fsipc_req(write ? FSREQ_PWRITE : FSREQ_PREAD, fsbulkbuf,
+			      1 + ROUNDUP(n, PGSIZE) / PGSIZE, NULL);
+		if (r < 0)
+			return tot ? tot : r;
+		assert(r <= n);
+		iov_copy(iov, iovcnt, &i, &skip, write ? NULL : FSBULKDATA, r, 1);
+		tot += r;
+		offset += r;
+		if (r < n)
+			break;
+	}
+	return tot;
+}
+
+static bool
+fsring_up(void)
+{
+	return fsring_env == thisenv->env_id && !fsring_broken;
+}
+
+// Give the file server a request ring for this environment, unless
+// there is one already or the server turned us down.
+static void
+fsring_setup(void)
+{
+	uintptr_t va;
+	int r;
+
+	if (fsring_env == thisenv->env_id)
+		return;
+	fsring_env = thisenv->env_id;
+	fsring_broken = 1;
+	fsring_tail = 0;
+	memset(fsring_busy, 0, sizeof(fsring_busy));
+
+	// Fresh pages, so none of a parent's ring is left in them.
+	for (va = FSRINGVA; va < FSRINGVA + FSRING_PAGES * PGSIZE; va += PGSIZE) {
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_W | PTE_U | PTE_SHARE)) < 0)
+			goto fail;
+#ifdef SANITIZE_USER_SHADOW_BASE
+		platform_asan_unpoison((void *) va, PGSIZE);
+#endif
+	}
+	if ((r = fsipc_req(FSREQ_RING_SETUP, (union Fsipc *) FSRINGVA,
+			   FSRING_PAGES, NULL)) < 0)
+		goto fail;
+	fsring_broken = 0;
+	return;
+
+fail:
+	for (va = FSRINGVA; va < FSRINGVA + FSRING_PAGES * PGSIZE; va += PGSIZE)
+		(void) sys_page_unmap(0, (void *) va);
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsring_setup: %i\n", thisenv->env_id, r);
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// Take a free slot of the request ring for a request of type 'type',
+// and point *req at the page to fill in its arguments.  The request is
+// queued, and goes to the file server with the next fsring_submit or
+// fsring_wait.  Only requests that pass no pages can go on the ring.
+// Returns the slot, or < 0 on error.  Errors are:
+//	-E_NOT_SUPP if there is no ring (no file has been opened).
+//	-E_NO_MEM if every slot is taken.
+int
+fsring_prep(unsigned type, union Fsipc **req)
+{
+	struct FsSqe *sqe;
+	int slot;
+
+	if (!fsring_up())
+		return -E_NOT_SUPP;
+	for (slot = 0; slot < FSRING_SIZE && fsring_busy[slot]; slot++)
+		/* do nothing */;
+	if (slot == FSRING_SIZE)
+		return -E_NO_MEM;
+
+	fsring_busy[slot] = 1;
+	fsring_done[slot] = 0;
+	// At most FSRING_SIZE slots are busy, so the entry is free.
+	sqe = &fsring_sq->sq_ents[fsring_tail++ % FSRING_SIZE];
+	sqe->sqe_type = type;
+	sqe->sqe_slot = slot;
+	*req = &fsring_reqs[slot];
+	return slot;
+}
+
+// Hand the requests queued since the last submit to the file server.
+// The server is only woken up if it had run everything before them.
+void
+fsring_submit(void)
+{
+	uint32_t tail;
+
+	if (!fsring_up() || fsring_sq->sq_tail == fsring_tail)
+		return;
+	tail = fsring_sq->sq_tail;
+	barrier();
+	fsring_sq->sq_tail = fsring_tail;
+	barrier();
+	if (fsring_sq->sq_head == tail)
+		ipc_send(fs_env(), FSREQ_RING_KICK, NULL, 0);
+}
+
+// Wait for the request in 'slot' to complete, and free the slot.  Any
+// reply is in the slot's request page until the slot is taken again.
+// Returns the request's result.
+int
+fsring_wait(int slot)
+{
+	struct FsCqe *cqe;
+
+	if (!fsring_up() || slot < 0 || slot >= FSRING_SIZE || !fsring_busy[slot])
+		return -E_INVAL;
+	fsring_submit();
+	while (!fsring_done[slot]) {
+		while (fsring_cq->cq_head != fsring_cq->cq_tail) {
+			barrier();
+			cqe = &fsring_cq->cq_ents[fsring_cq->cq_head % FSRING_SIZE];
+			if (cqe->cqe_slot < FSRING_SIZE) {
+				fsring_done[cqe->cqe_slot] = 1;
+				fsring_res[cqe->cqe_slot] = cqe->cqe_res;
+			}
+			barrier();
+			fsring_cq->cq_head++;
+		}
+		if (!fsring_done[slot])
+			sys_yield();
+	}
+	fsring_busy[slot] = 0;
+	return fsring_res[slot];
+}
+
+// Start a request of type 'type' and return the page to put its
+// arguments in: a ring slot, stored in *slot, if we have a ring and a
+// slot is free, or fsipcbuf with *slot < 0.  Finish it with fsreq_end.
+static union Fsipc *
+fsreq_begin(unsigned type, int *slot)
+{
+	union Fsipc *req;
+
+	if ((*slot = fsring_prep(type, &req)) >= 0)
+		return req;
+	return &fsipcbuf;
+}
+
+// Send the request started by fsreq_begin and wait for its result.
+static int
+fsreq_end(unsigned type, int slot)
+{
+	if (slot >= 0)
+		return fsring_wait(slot);
+	return fsipc(type, NULL);
+}
+
+// Return the buffer of 'fd' if it can be used: 'fd' is a whole Fd
+// page that only we and the file server map, and buffering is on.
+static struct FdBuf *
+fdbuf(struct Fd *fd)
+{
+	struct FdBuf *b;
+
+	if (PGOFF(fd) || pageref(fd) != 2)
+		return NULL;
+	b = fd2buf(fd);
+	return b->fb_state == FB_OFF || b->fb_state == FB_DIRECT ? NULL : b;
+}
+
+// Was 'fd' opened with O_DIRECT?  Its transfers of whole blocks then
+// go in bulk, which the file server moves to and from the disk
+// directly.
+static bool
+fd_direct(struct Fd *fd)
+{
+	return !PGOFF(fd) && fd2buf(fd)->fb_state == FB_DIRECT;
+}
+
+// Fill the buffer with file data from the file position on.  The
+// position itself is left alone.
+// Returns the number of bytes buffered, or < 0 on error.
+static int
+fdbuf_fill(struct Fd *fd, struct FdBuf *b)
+{
+	union Fsipc *req;
+	off_t off = fd->fd_offset;
+	int r, slot;
+
+	req = fsreq_begin(FSREQ_READ, &slot);
+	req->read.req_fileid = fd->fd_file.id;
+	req->read.req_n = FDBUFSIZE;
+	r = fsreq_end(FSREQ_READ, slot);
+	// The file server moved the position past what it read.
+	fd->fd_offset = off;
+	if (r < 0)
+		return r;
+	assert(r <= FDBUFSIZE);
+	memmove(b->fb_buf, req->readRet.ret_buf, r);
+	b->fb_state = r ? FB_READ : FB_EMPTY;
+	b->fb_off = off;
+	b->fb_len = r;
+	return r;
+}
+
+// Write the data collected in the buffer to the file at fb_off, and
+// empty the buffer.  Returns 0 on success, < 0 on error.
+static int
+fdbuf_flush(struct Fd *fd, struct FdBuf *b)
+{
+	union Fsipc *req;
+	off_t off = fd->fd_offset;
+	int r = 0, slot;
+	size_t done;
+
+	for (done = 0; done < b->fb_len; done += r) {
+		// FSREQ_WRITE writes at the file position.
+		fd->fd_offset = b->fb_off + done;
+		req = fsreq_begin(FSREQ_WRITE, &slot);
+		req->write.req_fileid = fd->fd_file.id;
+		req->write.req_n = b->fb_len - done;
+		memmove(req->write.req_buf, b->fb_buf + done, b->fb_len - done);
+		if ((r = fsreq_end(FSREQ_WRITE, slot)) <= 0) {
+			if (r == 0)
+				r = -E_NO_DISK;
+			break;
+		}
+	}
+	fd->fd_offset = off;
+	b->fb_state = FB_EMPTY;
+	b->fb_len = 0;
+	return r < 0 ? r : 0;
+}
+
+// Write out the data buffered for 'fd', if any, and forget buffered
+// reads, so that the file server has the file as we see it.
+// Returns 0 on success, < 0 if the buffered data could not be written.
+int
+devfile_drain(struct Fd *fd)
+{
+	struct FdBuf *b;
+
+	if (PGOFF(fd))
+		return 0;
+	b = fd2buf(fd);
+	if (b->fb_state == FB_WRITE)
+		return fdbuf_flush(fd, b);
+	if (b->fb_state == FB_READ)
+		b->fb_state = FB_EMPTY;
+	return 0;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -37,6 +444,8 @@ static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static ssize_t devfile_preadv(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
+static ssize_t devfile_pwritev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset);
 
 struct Dev devfile =
 {
@@ -46,7 +455,9 @@ struct Dev devfile =
 	.dev_close =	devfile_flush,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
-	.dev_trunc =	devfile_trunc
+	.dev_trunc =	devfile_trunc,
+	.dev_preadv =	devfile_preadv,
+	.dev_pwritev =	devfile_pwritev
 };
 
 // Open a file (or directory).
@@ -88,6 +499,11 @@ open(const char *path, int mode)
 		fd_close(fd, 0);
 		return r;
 	}
+	if (mode & O_DIRECT)
+		fd2buf(fd)->fb_state = FB_DIRECT;
+	else if (mode & O_NOBUF)
+		fd2buf(fd)->fb_state = FB_OFF;
+	fsring_setup();
 
 	return fd2num(fd);
 }
@@ -103,8 +519,22 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	// Drop the block mapped by read_map, if any.
+	(void) sys_page_unmap(0, fd2data(fd));
+
+	union Fsipc *req;
+	int r, r2, slot;
+
+	// Report a failure to write buffered data even though the flush
+	// itself goes ahead.
+	r = devfile_drain(fd);
+	req = fsreq_begin(FSREQ_FLUSH, &slot);
+	req->flush.req_fileid = fd->fd_file.id;
+	req->flush.req_offset = 0;
+	req->flush.req_len = 0;
+	req->flush.req_commit = 0;
+	r2 = fsreq_end(FSREQ_FLUSH, slot);
+	return r < 0 ? r : r2;
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -119,15 +549,48 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
-	int r;
+	union Fsipc *req;
+	struct FdBuf *b;
+	int r, slot;
 
-	fsipcbuf.read.req_fileid = fd->fd_file.id;
-	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	// Small reads are served from the buffer, filling it first if it
+	// does not hold the data at the file position.
+	if ((b = fdbuf(fd)) != NULL) {
+		if (b->fb_state == FB_WRITE && (r = fdbuf_flush(fd, b)) < 0)
+			return r;
+		if (b->fb_state != FB_READ || fd->fd_offset < b->fb_off
+		    || fd->fd_offset >= b->fb_off + b->fb_len) {
+			b->fb_state = FB_EMPTY;
+			if (n >= FDBUFSIZE)
+				goto unbuffered;
+			if ((r = fdbuf_fill(fd, b)) <= 0)
+				return r;
+		}
+		r = MIN(n, b->fb_off + b->fb_len - fd->fd_offset);
+		memmove(buf, b->fb_buf + (fd->fd_offset - b->fb_off), r);
+		fd->fd_offset += r;
+		return r;
+	}
+
+unbuffered:
+	// Reads of more than a page go in bulk at our idea of the offset,
+	// as do reads of whole blocks with O_DIRECT.
+	if (n > sizeof(fsipcbuf.readRet.ret_buf) || (fd_direct(fd) && n >= BLKSIZE)) {
+		struct iovec iov = { buf, n };
+
+		if ((r = devfile_pio(fd, &iov, 1, fd->fd_offset, 0)) > 0)
+			fd->fd_offset += r;
+		return r;
+	}
+
+	req = fsreq_begin(FSREQ_READ, &slot);
+	req->read.req_fileid = fd->fd_file.id;
+	req->read.req_n = n;
+	if ((r = fsreq_end(FSREQ_READ, slot)) < 0)
 		return r;
 	assert(r <= n);
 	assert(r <= PGSIZE);
-	memmove(buf, &fsipcbuf, r);
+	memmove(buf, req->readRet.ret_buf, r);
 	return r;
 }
 
@@ -145,16 +608,53 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
 	// LAB 10: Your code here
+	union Fsipc *req;
+	struct FdBuf *b;
 	ssize_t err;
+	int slot;
+
+	// Small writes that follow each other collect in the buffer, which
+	// goes to the file server once it is full.
+	if ((b = fdbuf(fd)) != NULL) {
+		if (b->fb_state == FB_READ)
+			b->fb_state = FB_EMPTY;
+		if (b->fb_state == FB_WRITE
+		    && (fd->fd_offset != b->fb_off + b->fb_len
+			|| b->fb_len + n > FDBUFSIZE)
+		    && (err = fdbuf_flush(fd, b)) < 0)
+			return err;
+		if (n < FDBUFSIZE) {
+			if (b->fb_state != FB_WRITE) {
+				b->fb_state = FB_WRITE;
+				b->fb_off = fd->fd_offset;
+				b->fb_len = 0;
+			}
+			memmove(b->fb_buf + b->fb_len, buf, n);
+			b->fb_len += n;
+			fd->fd_offset += n;
+			if (b->fb_len == FDBUFSIZE && (err = fdbuf_flush(fd, b)) < 0)
+				return err;
+			return n;
+		}
+	}
+
+	if (n > sizeof(fsipcbuf.write.req_buf) || (fd_direct(fd) && n >= BLKSIZE)) {
+		struct iovec iov = { (void *) buf, n };
+
+		if ((err = devfile_pio(fd, &iov, 1, fd->fd_offset, 1)) > 0)
+			fd->fd_offset += err;
+		return err;
+	}
 
-	fsipcbuf.write.req_fileid = fd->fd_file.id;
-	fsipcbuf.write.req_n = n;
 	// As per the struct Fsreq_write definition,
 	// the req_buf size is PGSIZE - (sizeof(int) + sizeof(size_t))
-	assert(n <= PGSIZE - (sizeof(int) + sizeof(size_t)));
-	memmove(fsipcbuf.write.req_buf, buf, n);
+	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
+	req = fsreq_begin(FSREQ_WRITE, &slot);
+	req->write.req_fileid = fd->fd_file.id;
+	req->write.req_n = n;
+	memmove(req->write.req_buf, buf, n);
 
-	if ((err = fsipc(FSREQ_WRITE, NULL)) < 0)
+	if ((err = fsreq_end(FSREQ_WRITE, slot)) < 0)
 	{
 		return err;
 	}
@@ -164,17 +664,33 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	return err;
 }
 
+static ssize_t
+devfile_preadv(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return devfile_pio(fd, iov, iovcnt, offset, 0);
+}
+
+static ssize_t
+devfile_pwritev(struct Fd *fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return devfile_pio(fd, iov, iovcnt, offset, 1);
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
-	int r;
+	union Fsipc *req;
+	int r, slot;
 
-	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
+	if ((r = devfile_drain(fd)) < 0)
 		return r;
-	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-	st->st_size = fsipcbuf.statRet.ret_size;
-	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	req = fsreq_begin(FSREQ_STAT, &slot);
+	req->stat.req_fileid = fd->fd_file.id;
+	if ((r = fsreq_end(FSREQ_STAT, slot)) < 0)
+		return r;
+	strcpy(st->st_name, req->statRet.ret_name);
+	st->st_size = req->statRet.ret_size;
+	st->st_isdir = req->statRet.ret_isdir;
 	return 0;
 }
 
@@ -182,11 +698,30 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	union Fsipc *req;
+	int r, slot;
+
+	if ((r = devfile_drain(fd)) < 0)
+		return r;
+	req = fsreq_begin(FSREQ_SET_SIZE, &slot);
+	req->set_size.req_fileid = fd->fd_file.id;
+	req->set_size.req_size = newsize;
+	return fsreq_end(FSREQ_SET_SIZE, slot);
 }
 
+// Delete a file.  Returns -E_BUSY if the file is open or mapped.
+int
+remove(const char *path)
+{
+	union Fsipc *req;
+	int slot;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	req = fsreq_begin(FSREQ_REMOVE, &slot);
+	strcpy(req->remove.req_path, path);
+	return fsreq_end(FSREQ_REMOVE, slot);
+}
 
 // Synchronize disk with buffer cache
 int
@@ -195,6 +730,147 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	int slot;
+
+	fsreq_begin(FSREQ_SYNC, &slot);
+	return fsreq_end(FSREQ_SYNC, slot);
 }
 
+
+// Get the file system server's statistics
+int
+fsstats(struct FsStats *st)
+{
+	union Fsipc *req;
+	int r, slot;
+
+	req = fsreq_begin(FSREQ_STATS, &slot);
+	if ((r = fsreq_end(FSREQ_STATS, slot)) < 0)
+		return r;
+	*st = req->statsRet.ret_stats;
+	return 0;
+}
+
+// Map the block of the file open as 'fd' that holds byte 'offset' at
+// page 'dstva', straight from the file server's block cache.  The page
+// is writable, and writes go to the file, if 'write' is set.  If
+// 'share' is set, the page is for a shared mapping, which must see
+// later writes to the file, so small files kept inline are moved to a
+// block for it rather than failing with -E_NOT_SUPP.
+// Returns the number of bytes of the file from 'offset' to the end of
+// the block, 0 at end of file (nothing is mapped), or < 0 on error.
+int
+devfile_map(struct Fd *fd, off_t offset, void *dstva, bool write, bool share)
+{
+	int r;
+
+	fsipcmapbuf.read_map.req_fileid = fd->fd_file.id;
+	fsipcmapbuf.read_map.req_offset = offset;
+	fsipcmapbuf.read_map.req_write = write;
+	fsipcmapbuf.read_map.req_share = share;
+	if ((r = fsipc_req(FSREQ_READ_MAP, &fsipcmapbuf, 1, dstva)) > 0)
+		assert(r <= PGSIZE - offset % PGSIZE);
+	return r;
+}
+
+// Tell the file server that the blocks of 'fd' in
+// [offset, offset + len) were written through a mapping, and have it
+// write them and the file's metadata out to disk.
+int
+devfile_sync(struct Fd *fd, off_t offset, size_t len)
+{
+	union Fsipc *req;
+	int r, slot;
+
+	if ((r = devfile_drain(fd)) < 0)
+		return r;
+	req = fsreq_begin(FSREQ_FLUSH, &slot);
+	req->flush.req_fileid = fd->fd_file.id;
+	req->flush.req_offset = offset;
+	req->flush.req_len = len;
+	req->flush.req_commit = 1;
+	return fsreq_end(FSREQ_FLUSH, slot);
+}
+
+// Map the block of the file open as 'fdnum' that holds byte 'offset'
+// read-only into our address space, straight from the file server's
+// block cache, and point *blk at that byte.  The mapping replaces the
+// one from the previous read_map on the same fd and goes away when the
+// fd is closed.  The seek position is not changed.
+//
+// Returns:
+//	The number of bytes of the file available at *blk.
+//	0 at end of file.
+//	-E_NOT_SUPP if fdnum is not an open file, or the file is small
+//		enough to be kept inline and has no block to map.
+//	< 0 for other errors.
+int
+read_map(int fdnum, off_t offset, void **blk)
+{
+	struct Fd *fd;
+	char *va;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	va = fd2data(fd);
+	if ((r = devfile_map(fd, offset, va, 0, 0)) <= 0)
+		return r;
+	*blk = va + offset % PGSIZE;
+	return r;
+}
+
+// Read the entries of the directory open as 'fdnum' into 'buf', which
+// has room for 'n' bytes, packed as struct Dirents; step from one to the
+// next by d_reclen.  Each call goes on where the last one stopped, and
+// takes as many entries as fit in one request.
+//
+// Returns:
+//	The number of bytes of entries in buf.
+//	0 at the end of the directory.
+//	-E_NOT_SUPP if fdnum is not an open file.
+//	-E_INVAL if fdnum is not a directory, or not even one entry fits.
+//	< 0 for other errors.
+ssize_t
+readdir(int fdnum, void *buf, size_t n)
+{
+	union Fsipc *req;
+	struct Fd *fd;
+	int r, slot;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = devfile_drain(fd)) < 0)
+		return r;
+
+	req = fsreq_begin(FSREQ_READDIR, &slot);
+	req->readdir.req_fileid = fd->fd_file.id;
+	req->readdir.req_cookie = fd->fd_offset;
+	req->readdir.req_n = n;
+	if ((r = fsreq_end(FSREQ_READDIR, slot)) < 0)
+		return r;
+	fd->fd_offset = req->readdirRet.ret_cookie;
+	memmove(buf, req->readdirRet.ret_buf, req->readdirRet.ret_n);
+	return req->readdirRet.ret_n;
+}
+
+// Write out whatever is buffered for file descriptor 'fdnum' and have
+// the file server write the file to disk.
+// Returns 0 on success, < 0 on error.
+int
+fsync(int fdnum)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return 0;
+	return devfile_sync(fd, 0, 0);
+}
@@ -26,6 +26,11 @@ pgfault(struct UTrapframe *utf)
 	// LAB 9: Your code here.
 	
 	int err0;
+
+	// Faults in memory-mapped files are handled by the mmap code.
+	if (mmap_pgfault(utf))
+		return;
+
 	if (!(err & FEC_WR || uvpt[PGNUM(addr)] & PTE_COW)) {
 		panic("pgfault addr=%p, err=%d, pte=%x", addr, err, uvpt[PGNUM(addr)]);
 	}
@@ -118,6 +123,11 @@ fork(void)
     int r;
 
 	set_pgfault_handler(pgfault);
+	// The child shares our file descriptors, so it must not inherit
+	// data buffered in them, nor output buffered in streams, which
+	// it would write out a second time.
+	fflush(NULL);
+	drain_all();
 
     if ((e = sys_exofork()) < 0) {
         panic("fork error: %i\n", (int) e);
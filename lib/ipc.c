@@ -21,12 +21,20 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_pages(from_env_store, pg, 1, perm_store);
+}
+
+// Like ipc_recv, but accept up to 'npages' pages, mapped from 'pg' on.
+// thisenv->env_ipc_npages says how many arrived.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t npages, int *perm_store)
 {
 	// LAB 9: Your code here.
 	//panic("ipc_recv not implemented");
 	int err;
 	pg = (pg) ? pg : (void *) UTOP;
-	if ((err = sys_ipc_recv(pg)) < 0) {
+	if ((err = sys_ipc_recv(pg, npages, IPC_RECV_BLOCK)) < 0) {
 		if (from_env_store) {
 			*from_env_store = 0;
 		}
@@ -43,11 +51,48 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	}
 
 #ifdef SANITIZE_USER_SHADOW_BASE
-	 platform_asan_unpoison(pg, PGSIZE);
+	if (thisenv->env_ipc_npages)
+		platform_asan_unpoison(pg, thisenv->env_ipc_npages * PGSIZE);
 #endif
 	return thisenv->env_ipc_value;
 }
 
+// Start receiving a message, and up to 'npages' pages at 'pg', without
+// waiting for it to arrive.  Use ipc_recv_poll to collect it.
+// Returns 0 on success, < 0 on error.
+int
+ipc_recv_start(void *pg, size_t npages)
+{
+	return sys_ipc_recv(pg ? pg : (void *) UTOP, npages, IPC_RECV_START);
+}
+
+// Collect the message of the receive begun by ipc_recv_start, storing
+// its sender, value and page permission like ipc_recv does.  If it has
+// not arrived yet, wait for it if 'wait' is set, or return 0 if not.
+// Returns 1 once the message is collected.
+int
+ipc_recv_poll(envid_t *from_env_store, uint32_t *value_store, int *perm_store,
+	      bool wait)
+{
+	while (thisenv->env_ipc_recving) {
+		if (!wait)
+			return 0;
+		sys_ipc_recv(NULL, 0, IPC_RECV_WAIT);
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (value_store)
+		*value_store = thisenv->env_ipc_value;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+#ifdef SANITIZE_USER_SHADOW_BASE
+	if (thisenv->env_ipc_npages)
+		platform_asan_unpoison(thisenv->env_ipc_dstva,
+				       thisenv->env_ipc_npages * PGSIZE);
+#endif
+	return 1;
+}
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
 // This function keeps trying until it succeeds.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
@@ -58,6 +103,13 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	ipc_send_pages(to_env, val, pg, 1, perm);
+}
+
+// Like ipc_send, but send the 'npages' pages starting at 'pg'.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
 {
 	// LAB 9: Your code here.
 	//panic("ipc_send not implemented");
@@ -66,7 +118,7 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (!pg) {
         pg = (void *) UTOP;
 	}
-	while ((err = sys_ipc_try_send(to_env, val, pg, perm))) {
+	while ((err = sys_ipc_try_send(to_env, val, pg, perm, npages))) {
 		if (err < 0 && err != -E_IPC_NOT_RECV) {
 			panic("ipc_send error: sys_ipc_try_send: %i\n", err);
 		}
@@ -0,0 +1,329 @@
+// Memory-mapped files.
+//
+// A mapping is a range of the MMAPBASE..MMAPTOP area whose pages are
+// filled in lazily by the page fault handler, which asks the file
+// server for the block cache page holding that part of the file.
+// Shared mappings use the server's page itself, so they see writes made
+// through the file server, and writes to writable ones go straight to
+// the cache; msync tells the server which pages we wrote so that it
+// writes them out.  Private mappings map the cache page copy-on-write.
+// Pages past the end of the file are zero-filled and private to us, and
+// so are private copies of small files the server keeps inline, which
+// have no cache page.  For a shared mapping the server moves such a
+// file to a block first.
+//
+// Every mapping keeps its own reference to the open file's Fd page, so
+// the mapping stays valid when the file descriptor is closed.
+
+#include <inc/lib.h>
+
+// PTE_COW marks copy-on-write page table entries (see fork.c).
+#define PTE_COW		0x800
+
+// Area the mappings are placed in
+#define MMAPBASE	0xA0000000
+#define MMAPTOP		0xC0000000
+// Most mappings at once
+#define NMMAP		16
+// Where the Fd page of mapping i is kept
+#define MMAPFD(i)	((struct Fd *) (MMAPTOP + (i) * PGSIZE))
+
+struct Mmap {
+	uintptr_t mm_va;	// first page; 0 if the slot is free
+	size_t mm_len;		// length in bytes, a multiple of PGSIZE
+	off_t mm_offset;	// file offset of the first page
+	int mm_prot;
+	int mm_flags;
+};
+
+static struct Mmap mmaps[NMMAP];
+
+// The page fault handler that was installed before our first mapping
+static void (*mmap_prev_handler)(struct UTrapframe *utf);
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+static struct Mmap *
+mmap_find(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaps[i].mm_va && va >= mmaps[i].mm_va
+		    && va < mmaps[i].mm_va + mmaps[i].mm_len)
+			return &mmaps[i];
+	return NULL;
+}
+
+// Find the lowest free range of 'len' bytes in the mapping area.
+// Returns 0 if there is none.
+static uintptr_t
+mmap_place(size_t len)
+{
+	uintptr_t va;
+	int i;
+
+	for (va = MMAPBASE; va + len <= MMAPTOP && va + len > va; ) {
+		for (i = 0; i < NMMAP; i++)
+			if (mmaps[i].mm_va && va < mmaps[i].mm_va + mmaps[i].mm_len
+			    && mmaps[i].mm_va < va + len)
+				break;
+		if (i == NMMAP)
+			return va;
+		va = mmaps[i].mm_va + mmaps[i].mm_len;
+	}
+	return 0;
+}
+
+static bool
+mmap_is_shared_write(const struct Mmap *mm)
+{
+	return (mm->mm_flags & MAP_SHARED) && (mm->mm_prot & PROT_WRITE);
+}
+
+// Replace the page at 'va' by a private copy, with the part from
+// 'keep' bytes onward zeroed, mapped with permissions 'perm'.
+static void
+mmap_copy_page(uintptr_t va, size_t keep, int perm)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("mmap: sys_page_alloc: %i", r);
+	memmove((void *) PFTEMP, (void *) va, keep);
+	if ((r = sys_page_map(0, (void *) PFTEMP, 0, (void *) va, perm)) < 0)
+		panic("mmap: sys_page_map: %i", r);
+	if ((r = sys_page_unmap(0, (void *) PFTEMP)) < 0)
+		panic("mmap: sys_page_unmap: %i", r);
+}
+
+// Fill the page at 'va' of mapping 'mm' with a private copy of the
+// file's contents, read through the file server.
+static void
+mmap_read_page(struct Mmap *mm, uintptr_t va)
+{
+	struct iovec iov;
+	ssize_t n;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("mmap: sys_page_alloc: %i", r);
+	iov.iov_base = (void *) PFTEMP;
+	iov.iov_len = PGSIZE;
+	if ((n = devfile.dev_preadv(MMAPFD(mm - mmaps), &iov, 1,
+				    mm->mm_offset + (va - mm->mm_va))) < 0)
+		panic("mmap: read at %08x: %i", va, n);
+	if ((r = sys_page_map(0, (void *) PFTEMP, 0, (void *) va, PTE_P | PTE_U
+			      | (mm->mm_prot & PROT_WRITE ? PTE_W : 0))) < 0)
+		panic("mmap: sys_page_map: %i", r);
+	if ((r = sys_page_unmap(0, (void *) PFTEMP)) < 0)
+		panic("mmap: sys_page_unmap: %i", r);
+}
+
+// Handle a page fault in a mapping: bring in the missing page, or
+// copy a private page on the first write to it.
+// Returns false if the fault is not ours to handle.
+bool
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	bool write = (utf->utf_err & FEC_WR) != 0;
+	struct Mmap *mm;
+	int perm, r;
+
+	if (!(mm = mmap_find(va)))
+		return 0;
+	if (write && !(mm->mm_prot & PROT_WRITE))
+		return 0;
+
+	if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)) {
+		if (!write || !(uvpt[PGNUM(va)] & PTE_COW))
+			return 0;
+		mmap_copy_page(va, PGSIZE, PTE_P | PTE_U | PTE_W);
+		return 1;
+	}
+
+	r = devfile_map(MMAPFD(mm - mmaps), mm->mm_offset + (va - mm->mm_va),
+			(void *) va, mmap_is_shared_write(mm),
+			(mm->mm_flags & MAP_SHARED) != 0);
+	if (r == -E_NOT_SUPP) {
+		// A small file kept inline has no cache page to share, so
+		// read it into a private page.  Shared mappings never get
+		// here: the server moves the file to a block.
+		mmap_read_page(mm, va);
+		return 1;
+	}
+	if (r < 0)
+		panic("mmap: fault at %08x: %i", utf->utf_fault_va, r);
+
+	perm = PTE_P | PTE_U;
+	if (mmap_is_shared_write(mm))
+		perm |= PTE_W | PTE_SHARE;
+	else if (mm->mm_prot & PROT_WRITE)
+		perm |= PTE_COW;
+
+	if (r == 0) {
+		// Past the end of the file
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_U
+					| (mm->mm_prot & PROT_WRITE ? PTE_W : 0))) < 0)
+			panic("mmap: sys_page_alloc: %i", r);
+	} else if (r < PGSIZE && !(mm->mm_flags & MAP_SHARED))
+		// Zero the rest of the file's last page.  Shared mappings
+		// keep the cache page, to see what is written to it later.
+		mmap_copy_page(va, r, PTE_P | PTE_U
+			       | (mm->mm_prot & PROT_WRITE ? PTE_W : 0));
+	else if ((r = sys_page_map(0, (void *) va, 0, (void *) va, perm)) < 0)
+		panic("mmap: sys_page_map: %i", r);
+	return 1;
+}
+
+static void
+mmap_handler(struct UTrapframe *utf)
+{
+	if (mmap_pgfault(utf))
+		return;
+	if (mmap_prev_handler)
+		mmap_prev_handler(utf);
+	else
+		panic("page fault at %08x, eip %08x, err %x", utf->utf_fault_va,
+		      utf->utf_eip, utf->utf_err);
+}
+
+// Map 'len' bytes of the file open as 'fdnum', starting at 'offset',
+// into our address space and set *addr to where they are.
+// prot is PROT_READ, optionally with PROT_WRITE; flags is MAP_SHARED
+// or MAP_PRIVATE.  Pages are read in when first touched.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if offset is not page-aligned, len is 0, prot or flags
+//		are bad, or the mapping is shared and writable but the
+//		file is not open for writing.
+//	-E_NOT_SUPP if fdnum is not an open file.
+//	-E_NO_MEM if there is no room for the mapping.
+int
+mmap(int fdnum, off_t offset, size_t len, int prot, int flags, void **addr)
+{
+	struct Fd *fd;
+	struct Mmap *mm;
+	uintptr_t va;
+	int i, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (offset < 0 || PGOFF(offset) || len == 0 || !(prot & PROT_READ)
+	    || prot & ~(PROT_READ | PROT_WRITE)
+	    || (flags != MAP_SHARED && flags != MAP_PRIVATE))
+		return -E_INVAL;
+	if (flags == MAP_SHARED && (prot & PROT_WRITE)
+	    && (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+
+	len = ROUNDUP(len, PGSIZE);
+	for (i = 0; i < NMMAP && mmaps[i].mm_va; i++)
+		/* do nothing */;
+	if (i == NMMAP || !len || !(va = mmap_place(len)))
+		return -E_NO_MEM;
+	mm = &mmaps[i];
+
+	// Mapped pages must show what we wrote, and the fd stops being
+	// buffered while we hold the second mapping of it.
+	if ((r = devfile_drain(fd)) < 0
+	    || (r = sys_page_map(0, fd, 0, MMAPFD(i), uvpt[PGNUM(fd)] & PTE_SYSCALL)) < 0)
+		return r;
+	if (_pgfault_handler != mmap_handler) {
+		mmap_prev_handler = _pgfault_handler;
+		set_pgfault_handler(mmap_handler);
+	}
+
+	mm->mm_va = va;
+	mm->mm_len = len;
+	mm->mm_offset = offset;
+	mm->mm_prot = prot;
+	mm->mm_flags = flags;
+	*addr = (void *) va;
+	return 0;
+}
+
+// Find the mapping that contains all of [addr, addr + len).
+static struct Mmap *
+mmap_lookup(void *addr, size_t len)
+{
+	struct Mmap *mm = mmap_find((uintptr_t) addr);
+
+	if (!mm || (uintptr_t) addr + len > mm->mm_va + mm->mm_len
+	    || (uintptr_t) addr + len < (uintptr_t) addr)
+		return NULL;
+	return mm;
+}
+
+// Have the file server write out the pages in [addr, addr + len) that
+// we wrote through a shared mapping.  The range must lie in a single
+// mapping.  Returns 0 on success, < 0 on error.
+int
+msync(void *addr, size_t len)
+{
+	struct Mmap *mm;
+	uintptr_t va, end, start;
+	int r;
+
+	if (!(mm = mmap_lookup(addr, len)))
+		return -E_INVAL;
+	if (!mmap_is_shared_write(mm))
+		return 0;
+
+	// Clear the dirty bits before reporting the pages, so writes
+	// from now on are seen by the next msync.
+	end = ROUNDUP((uintptr_t) addr + len, PGSIZE);
+	for (va = ROUNDDOWN((uintptr_t) addr, PGSIZE); va < end; ) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			continue;
+		}
+		for (start = va; va < end && (uvpd[PDX(va)] & PTE_P)
+			     && (uvpt[PGNUM(va)] & (PTE_P | PTE_D)) == (PTE_P | PTE_D);
+		     va += PGSIZE)
+			if ((r = sys_page_map(0, (void *) va, 0, (void *) va,
+					      uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				return r;
+		if (va == start) {
+			va += PGSIZE;
+			continue;
+		}
+		if ((r = devfile_sync(MMAPFD(mm - mmaps),
+				      mm->mm_offset + (start - mm->mm_va),
+				      va - start)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Remove the mapping that starts at 'addr' and is 'len' bytes long,
+// writing out the pages written through it first if it is shared.
+// Returns 0 on success, < 0 on error.
+int
+munmap(void *addr, size_t len)
+{
+	struct Mmap *mm;
+	uintptr_t va;
+	int r;
+
+	if (!(mm = mmap_lookup(addr, len)) || (uintptr_t) addr != mm->mm_va
+	    || ROUNDUP(len, PGSIZE) != mm->mm_len)
+		return -E_INVAL;
+	if ((r = msync(addr, len)) < 0)
+		return r;
+
+	for (va = mm->mm_va; va < mm->mm_va + mm->mm_len; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		if ((uvpt[PGNUM(va)] & PTE_P) && (r = sys_page_unmap(0, (void *) va)) < 0)
+			return r;
+	}
+	if ((r = sys_page_unmap(0, MMAPFD(mm - mmaps))) < 0)
+		return r;
+	mm->mm_va = 0;
+	return 0;
+}
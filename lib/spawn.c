@@ -136,7 +136,9 @@ spawn(const char *prog, const char **argv)
 	close(fd);
 	fd = -1;
 
-	// Copy shared library state.
+	// Copy shared library state, with nothing left buffered in the
+	// file descriptors the child gets.
+	drain_all();
 	if ((r = copy_shared_pages(child)) < 0)
 		panic("copy_shared_pages: %i", r);
 
@@ -279,6 +281,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
 	int i, r;
+	void *blk;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -294,6 +297,15 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+		} else if (!(perm & PTE_W) && MIN(memsz, i + PGSIZE) <= filesz
+			   && (r = read_map(fd, fileoffset + i, &blk)) > 0
+			   && r >= (int) MIN(PGSIZE, filesz - i)
+			   && PGOFF(blk) == 0) {
+			// Read-only and nothing to zero: share the file
+			// server's cached page, so that all instances of a
+			// program use the same copy of its text.
+			if ((r = sys_page_map(0, blk, child, (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %i", r);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
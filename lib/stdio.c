@@ -0,0 +1,429 @@
+// Buffered streams on top of file descriptors.
+//
+// A FILE collects small reads and writes in a buffer, so that reading
+// or writing a line at a time costs one read or write on the file
+// descriptor per buffer, not one per call.  Buffers are pages at
+// STDIOBUF, one per stream, allocated the first time a stream is used.
+//
+// Writes reach the file descriptor when the buffer fills, on fflush and
+// fclose, and at exit and fork.  A line buffered stream also writes at
+// every newline.  stdin and stdout are line buffered on the console and
+// fully buffered otherwise; stderr is unbuffered.
+
+#include <inc/lib.h>
+
+#define STDIOBUF	0xC0400000
+#define F2BUF(f)	((char *) (STDIOBUF + ((f) - files) * PGSIZE))
+
+enum {
+	F_READ	= 0x01,	// opened for reading
+	F_WRITE	= 0x02,	// opened for writing
+	F_EOF	= 0x04,	// a read hit end of file
+	F_SETUP	= 0x08,	// buffer and buffering mode chosen
+};
+
+enum {
+	F_IDLE = 0,	// buffer holds nothing
+	F_READING,	// buffer holds data read ahead
+	F_WRITING,	// buffer holds data not yet written
+};
+
+struct FILE {
+	int f_flags;	// F_*; 0 if the slot is free
+	int f_fd;	// underlying file descriptor
+	int f_mode;	// _IOFBF, _IOLBF or _IONBF
+	int f_state;	// F_IDLE, F_READING or F_WRITING
+	int f_err;	// first error, or 0
+	char *f_buf;
+	size_t f_size;	// size of f_buf
+	size_t f_pos;	// next byte of f_buf to read or write
+	size_t f_len;	// bytes of f_buf holding data, when reading
+	char f_ch;	// one-byte buffer of unbuffered streams
+};
+
+static FILE files[FOPEN_MAX] = {
+	{ .f_flags = F_READ, .f_fd = 0 },
+	{ .f_flags = F_WRITE, .f_fd = 1 },
+	{ .f_flags = F_WRITE, .f_fd = 2, .f_mode = _IONBF },
+};
+
+FILE *stdin = &files[0];
+FILE *stdout = &files[1];
+FILE *stderr = &files[2];
+
+// Choose the buffering mode of 'f', unless setvbuf did, and give it a
+// buffer.  Returns 0 on success, < 0 on error.
+static int
+fsetup(FILE *f)
+{
+	char *buf;
+	int r;
+
+	if (f->f_flags & F_SETUP)
+		return 0;
+	if ((f == stdin || f == stdout) && iscons(f->f_fd) > 0)
+		f->f_mode = _IOLBF;
+
+	if (f->f_mode == _IONBF) {
+		f->f_buf = &f->f_ch;
+		f->f_size = 1;
+	} else {
+		buf = F2BUF(f);
+		if (!(uvpd[PDX(buf)] & PTE_P) || !(uvpt[PGNUM(buf)] & PTE_P)) {
+			if ((r = sys_page_alloc(0, buf, PTE_P | PTE_U | PTE_W)) < 0)
+				return f->f_err = r;
+#ifdef SANITIZE_USER_SHADOW_BASE
+			platform_asan_unpoison(buf, PGSIZE);
+#endif
+		}
+		f->f_buf = buf;
+		f->f_size = PGSIZE;
+	}
+	f->f_flags |= F_SETUP;
+	return 0;
+}
+
+// Write out whatever 'f' has buffered for writing, or give back what it
+// read ahead by moving the file position back to where the reader is.
+// Returns 0 on success, < 0 on error.
+static int
+fdrain(FILE *f)
+{
+	struct Fd *fd;
+	ssize_t r;
+	size_t done;
+
+	if (f->f_state == F_WRITING) {
+		for (done = 0; done < f->f_pos; done += r)
+			if ((r = write(f->f_fd, f->f_buf + done, f->f_pos - done)) <= 0) {
+				// Keep what was not written, to try again.
+				memmove(f->f_buf, f->f_buf + done, f->f_pos - done);
+				f->f_pos -= done;
+				if (!f->f_err)
+					f->f_err = r < 0 ? r : -E_NO_DISK;
+				return f->f_err;
+			}
+	} else if (f->f_state == F_READING && f->f_pos < f->f_len
+		   && fd_lookup(f->f_fd, &fd) == 0 && fd->fd_dev_id == devfile.dev_id)
+		seek(f->f_fd, fd->fd_offset - (f->f_len - f->f_pos));
+	f->f_state = F_IDLE;
+	f->f_pos = f->f_len = 0;
+	return 0;
+}
+
+// Open a stream on file descriptor 'fdnum'.  'mode' is as for fopen;
+// only whether it reads, writes or both matters.
+// Returns NULL if too many streams are open.
+FILE *
+fdopen(int fdnum, const char *mode)
+{
+	FILE *f;
+
+	for (f = files; f < files + FOPEN_MAX; f++)
+		if (!f->f_flags)
+			break;
+	if (f == files + FOPEN_MAX)
+		return NULL;
+
+	memset(f, 0, sizeof(*f));
+	f->f_fd = fdnum;
+	if (mode[0] == 'r')
+		f->f_flags = F_READ;
+	else
+		f->f_flags = F_WRITE;
+	if (strchr(mode, '+'))
+		f->f_flags = F_READ | F_WRITE;
+	return f;
+}
+
+// Open the file 'path' as a stream.  'mode' is "r", "w" or "a",
+// optionally followed by "+", as in C.  There is no append mode in the
+// file server, so "a" writes from the end of the file as it was when
+// it was opened.
+// Returns NULL on error.
+FILE *
+fopen(const char *path, const char *mode)
+{
+	struct Stat st;
+	FILE *f;
+	int fdnum, omode;
+
+	switch (mode[0]) {
+	case 'r':
+		omode = 0;
+		break;
+	case 'w':
+		omode = O_CREAT | O_TRUNC;
+		break;
+	case 'a':
+		omode = O_CREAT;
+		break;
+	default:
+		return NULL;
+	}
+	if (strchr(mode, '+'))
+		omode |= O_RDWR;
+	else if (mode[0] != 'r')
+		omode |= O_WRONLY;
+
+	if ((fdnum = open(path, omode)) < 0)
+		return NULL;
+	if (mode[0] == 'a') {
+		if (fstat(fdnum, &st) < 0) {
+			close(fdnum);
+			return NULL;
+		}
+		seek(fdnum, st.st_size);
+	}
+	if (!(f = fdopen(fdnum, mode)))
+		close(fdnum);
+	return f;
+}
+
+// Write out what 'f' has buffered and close it, and its file descriptor.
+// Returns 0 on success, EOF on error.
+int
+fclose(FILE *f)
+{
+	int r;
+
+	r = fdrain(f);
+	if (close(f->f_fd) < 0)
+		r = -1;
+	f->f_flags = 0;
+	return r < 0 ? EOF : 0;
+}
+
+// Write out what 'f' has buffered for writing.  If 'f' was reading,
+// drop what it read ahead, leaving the file position at the next byte
+// the reader would have seen.  fflush(NULL) writes out every stream.
+// Returns 0 on success, EOF on error.
+int
+fflush(FILE *f)
+{
+	int r = 0;
+
+	if (f)
+		return fdrain(f) < 0 ? EOF : 0;
+	for (f = files; f < files + FOPEN_MAX; f++)
+		if (f->f_state == F_WRITING && fdrain(f) < 0)
+			r = EOF;
+	return r;
+}
+
+// Set the buffering mode of 'f' to 'mode': _IOFBF, _IOLBF or _IONBF.
+// A 'buf' of 'size' bytes, if given, is used as the buffer instead of
+// the stream's own page.  Must come before any other use of 'f'.
+// Returns 0 on success, < 0 on error.
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if ((f->f_flags & F_SETUP) || mode < _IOFBF || mode > _IONBF)
+		return -E_INVAL;
+	f->f_mode = mode;
+	if (buf && size && mode != _IONBF) {
+		f->f_buf = buf;
+		f->f_size = size;
+		f->f_flags |= F_SETUP;
+	}
+	return 0;
+}
+
+// Get 'f' ready for a read (F_READING) or a write (F_WRITING).
+// Returns 0 on success, < 0 on error.
+static int
+fprepare(FILE *f, int state)
+{
+	int r;
+
+	if (!(f->f_flags & (state == F_READING ? F_READ : F_WRITE)))
+		return -E_INVAL;
+	if ((r = fsetup(f)) < 0)
+		return r;
+	if (f->f_state != state) {
+		if ((r = fdrain(f)) < 0)
+			return r;
+		f->f_state = state;
+	}
+	return 0;
+}
+
+// Refill the buffer of 'f', which is reading and has used it all up.
+// Returns the number of bytes read, 0 at end of file, < 0 on error.
+static ssize_t
+ffill(FILE *f)
+{
+	ssize_t n;
+
+	// Someone reading a line at a time wants to see what they wrote
+	// before, such as a prompt.
+	if (f->f_mode != _IOFBF && stdout->f_state == F_WRITING)
+		fdrain(stdout);
+
+	f->f_pos = f->f_len = 0;
+	if ((n = read(f->f_fd, f->f_buf, f->f_size)) < 0) {
+		if (!f->f_err)
+			f->f_err = n;
+		return n;
+	}
+	if (n == 0)
+		f->f_flags |= F_EOF;
+	f->f_len = n;
+	return n;
+}
+
+// Read up to 'n' items of 'size' bytes from 'f' into 'buf'.
+// Returns the number of whole items read, which is less than 'n' only
+// at end of file or on error.
+size_t
+fread(void *buf, size_t size, size_t n, FILE *f)
+{
+	size_t want = size * n, done = 0, m;
+	ssize_t r;
+
+	if (!want || fprepare(f, F_READING) < 0)
+		return 0;
+	while (done < want) {
+		if (f->f_pos == f->f_len) {
+			// Large reads skip the buffer.
+			if (want - done >= f->f_size) {
+				f->f_pos = f->f_len = 0;
+				if ((r = readn(f->f_fd, (char *) buf + done, want - done)) < 0) {
+					if (!f->f_err)
+						f->f_err = r;
+					break;
+				}
+				if (r < want - done)
+					f->f_flags |= F_EOF;
+				done += r;
+				break;
+			}
+			if (ffill(f) <= 0)
+				break;
+		}
+		m = MIN(want - done, f->f_len - f->f_pos);
+		memmove((char *) buf + done, f->f_buf + f->f_pos, m);
+		f->f_pos += m;
+		done += m;
+	}
+	return done / size;
+}
+
+// Write 'n' items of 'size' bytes from 'buf' to 'f'.
+// Returns the number of whole items taken, which is less than 'n' only
+// on error.
+size_t
+fwrite(const void *buf, size_t size, size_t n, FILE *f)
+{
+	size_t want = size * n, done = 0;
+	ssize_t r;
+
+	if (!want || fprepare(f, F_WRITING) < 0)
+		return 0;
+	// Writes that do not fit in the buffer, and every write to an
+	// unbuffered stream, go straight to the file descriptor.
+	if (f->f_pos + want > f->f_size) {
+		if (fdrain(f) < 0)
+			return 0;
+		f->f_state = F_WRITING;
+		if (want >= f->f_size) {
+			for (; done < want; done += r)
+				if ((r = write(f->f_fd, (const char *) buf + done,
+					       want - done)) <= 0) {
+					if (!f->f_err)
+						f->f_err = r < 0 ? r : -E_NO_DISK;
+					break;
+				}
+			return done / size;
+		}
+	}
+	memmove(f->f_buf + f->f_pos, buf, want);
+	f->f_pos += want;
+	if (f->f_pos == f->f_size
+	    || (f->f_mode == _IOLBF && memfind(buf, '\n', want) != (const char *) buf + want))
+		if (fdrain(f) < 0)
+			return 0;
+	return n;
+}
+
+// Read one character from 'f'.
+// Returns it as an unsigned char, or EOF at end of file or on error.
+int
+fgetc(FILE *f)
+{
+	unsigned char c;
+
+	return fread(&c, 1, 1, f) == 1 ? c : EOF;
+}
+
+// Write the character 'c' to 'f'.
+// Returns 'c', or EOF on error.
+int
+fputc(int c, FILE *f)
+{
+	unsigned char ch = c;
+
+	return fwrite(&ch, 1, 1, f) == 1 ? ch : EOF;
+}
+
+// Read a line from 'f' into 's', which has room for 'n' bytes, keeping
+// the newline.  Stops early when 's' is full or at end of file.
+// Returns 's', or NULL if nothing could be read.
+char *
+fgets(char *s, int n, FILE *f)
+{
+	const char *nl;
+	size_t m;
+	int i = 0;
+
+	if (n <= 0 || fprepare(f, F_READING) < 0)
+		return NULL;
+	while (i < n - 1) {
+		if (f->f_pos == f->f_len && ffill(f) <= 0)
+			break;
+		m = MIN(n - 1 - i, f->f_len - f->f_pos);
+		nl = memfind(f->f_buf + f->f_pos, '\n', m);
+		if (nl != f->f_buf + f->f_pos + m)
+			m = nl - (f->f_buf + f->f_pos) + 1;
+		memmove(s + i, f->f_buf + f->f_pos, m);
+		f->f_pos += m;
+		i += m;
+		if (s[i - 1] == '\n')
+			break;
+	}
+	if (i == 0)
+		return NULL;
+	s[i] = '\0';
+	return s;
+}
+
+// Write the string 's' to 'f'.
+// Returns 0 on success, EOF on error.
+int
+fputs(const char *s, FILE *f)
+{
+	size_t n = strlen(s);
+
+	return fwrite(s, 1, n, f) == n ? 0 : EOF;
+}
+
+// Has a read from 'f' hit end of file?
+int
+feof(FILE *f)
+{
+	return (f->f_flags & F_EOF) != 0;
+}
+
+// Returns the first error on 'f', or 0 if there was none.
+int
+ferror(FILE *f)
+{
+	return f->f_err;
+}
+
+// Returns the file descriptor under 'f'.
+int
+fileno(FILE *f)
+{
+	return f->f_fd;
+}
@@ -111,18 +111,49 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 }
 
 int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm, size_t npages)
 {
-	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, npages);
 }
 
 int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, size_t npages, int how)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, how, 0, 0);
 }
 
 int sys_gettime(void)
 {
 	return syscall(SYS_gettime, 0, 0, 0, 0, 0, 0);
-}
\ No newline at end of file
+}
+
+int
+sys_page_phys(void *va)
+{
+	return syscall(SYS_page_phys, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_page_alloc_contig(void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_contig, 0, (uint32_t) va, npages, perm, 0, 0);
+}
+
+int
+sys_page_move(void *srcva, void *dstva, size_t npages, int perm)
+{
+	return syscall(SYS_page_move, 1, (uint32_t) srcva, (uint32_t) dstva,
+		       npages, perm, 0);
+}
+
+int
+sys_irq_listen(int irq)
+{
+	return syscall(SYS_irq_listen, 1, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 1, irq, 0, 0, 0, 0);
+}
@@ -0,0 +1,64 @@
+// File system metadata benchmark: fills the root directory with files,
+// times opening them by name and looking up names that miss, then
+// removes them again.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define DEFAULT_NFILES	256
+
+static void
+report(const char *what, uint64_t cycles, int n)
+{
+	printf("%-12s %6d ops %10u cycles/op\n", what, n,
+	       (uint32_t) (cycles / n));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, fd, nfiles;
+	char name[MAXPATHLEN];
+	uint64_t start;
+
+	binaryname = "fsbench";
+	nfiles = DEFAULT_NFILES;
+	if (argc > 1 && (nfiles = strtol(argv[1], 0, 0)) <= 0) {
+		printf("usage: fsbench [nfiles]\n");
+		exit();
+	}
+
+	start = read_tsc();
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof name, "/fsbench.%d", i);
+		if ((fd = open(name, O_WRONLY | O_CREAT)) < 0)
+			panic("create %s: %i", name, fd);
+		close(fd);
+	}
+	report("create", read_tsc() - start, nfiles);
+
+	start = read_tsc();
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof name, "/fsbench.%d", i);
+		if ((fd = open(name, O_RDONLY)) < 0)
+			panic("open %s: %i", name, fd);
+		close(fd);
+	}
+	report("open", read_tsc() - start, nfiles);
+
+	start = read_tsc();
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof name, "/fsbench.miss.%d", i);
+		if ((fd = open(name, O_RDONLY)) != -E_NOT_FOUND)
+			panic("open %s: %i", name, fd);
+	}
+	report("open-miss", read_tsc() - start, nfiles);
+
+	start = read_tsc();
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof name, "/fsbench.%d", i);
+		if ((fd = remove(name)) < 0)
+			panic("remove %s: %i", name, fd);
+	}
+	report("remove", read_tsc() - start, nfiles);
+}
@@ -0,0 +1,62 @@
+// Print the file system server's statistics.
+
+#include <inc/lib.h>
+
+// Print the latency that 'pct' percent of requests stayed under, as
+// far as the server's histogram tells.
+static void
+print_latency(struct FsStats *st, int pct)
+{
+	uint64_t seen = 0;
+	int b;
+
+	if (st->fs_reqs == 0)
+		return;
+	for (b = 0; b < FSLAT_NBUCKETS - 1; b++) {
+		seen += st->fs_lat_hist[b];
+		if (seen * 100 >= (uint64_t) st->fs_reqs * pct)
+			break;
+	}
+	printf("p%-2d request latency     < %llu cycles\n", pct,
+	       (unsigned long long) 2 << b);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st;
+	int r;
+
+	binaryname = "fsstat";
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %i", r);
+
+	printf("block cache hits        %u\n", st.fs_bc_hits);
+	printf("block cache misses      %u\n", st.fs_bc_misses);
+	printf("blocks read ahead       %u\n", st.fs_bc_prefetched);
+	printf("read-ahead disk reads   %u\n", st.fs_bc_prefetch_ios);
+	printf("blocks evicted          %u\n", st.fs_bc_evictions);
+	printf("dirty blocks evicted    %u\n", st.fs_bc_writebacks);
+	printf("blocks cached           %u of %u\n", st.fs_bc_resident,
+	       st.fs_bc_budget);
+	printf("disk commands (DMA)     %u\n", st.fs_ide_dma);
+	printf("disk commands (PIO)     %u\n", st.fs_ide_pio);
+	printf("disk commands (virtio)  %u in %u batches\n", st.fs_vblk_reqs,
+	       st.fs_vblk_kicks);
+	printf("ring requests           %u in %u wakeups\n", st.fs_ring_reqs,
+	       st.fs_ring_drains);
+	printf("requests                %u, %u waited for the disk\n",
+	       st.fs_reqs, st.fs_reqs_parked);
+	printf("delayed allocations     %u blocks in %u runs\n",
+	       st.fs_delayed, st.fs_delay_runs);
+	printf("inline files promoted   %u\n", st.fs_promoted);
+	printf("journal commits         %u, %u blocks, %u checkpoints\n",
+	       st.fs_jcommits, st.fs_jblocks, st.fs_jcheckpoints);
+	printf("blocks moved directly   %u\n", st.fs_direct);
+	print_latency(&st, 50);
+	print_latency(&st, 90);
+	print_latency(&st, 99);
+	if (st.fs_bc_hits + st.fs_bc_misses)
+		printf("hit rate                %u%%\n",
+		       st.fs_bc_hits * 100 / (st.fs_bc_hits + st.fs_bc_misses));
+}
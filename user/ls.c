@@ -1,6 +1,7 @@
 #include <inc/lib.h>
 
 int flag[256];
+char buf[PGSIZE];
 
 void lsdir(const char*, const char*);
 void ls1(const char*, bool, off_t, const char*);
@@ -22,18 +23,19 @@ ls(const char *path, const char *prefix)
 void
 lsdir(const char *path, const char *prefix)
 {
-	int fd, n;
-	struct File f;
+	int fd, n, i;
+	struct Dirent *d;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
 		panic("open %s: %i", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
+	while ((n = readdir(fd, buf, sizeof buf)) > 0)
+		for (i = 0; i < n; i += d->d_reclen) {
+			d = (struct Dirent *) &buf[i];
+			ls1(prefix, d->d_type==FTYPE_DIR, d->d_size, d->d_name);
+		}
 	if (n < 0)
 		panic("error reading directory %s: %i", path, n);
+	close(fd);
 }
 
 void
@@ -4,42 +4,43 @@ int bol = 1;
 int line = 0;
 
 void
-num(int f, const char *s)
+num(FILE *f, const char *s)
 {
-	long n;
-	int r;
-	char c;
+	char prefix[16];
+	int c;
 
-	while ((n = read(f, &c, 1)) > 0) {
+	while ((c = fgetc(f)) != EOF) {
 		if (bol) {
-			printf("%5d ", ++line);
+			snprintf(prefix, sizeof(prefix), "%5d ", ++line);
+			fputs(prefix, stdout);
 			bol = 0;
 		}
-		if ((r = write(1, &c, 1)) != 1)
-			panic("write error copying %s: %i", s, r);
+		if (fputc(c, stdout) == EOF)
+			panic("write error copying %s: %i", s, ferror(stdout));
 		if (c == '\n')
 			bol = 1;
 	}
-	if (n < 0)
-		panic("error reading %s: %i", s, (int) n);
+	if (ferror(f))
+		panic("error reading %s: %i", s, ferror(f));
 }
 
 void
 umain(int argc, char **argv)
 {
-	int f, i;
+	FILE *f;
+	int i;
 
 	binaryname = "num";
 	if (argc == 1)
-		num(0, "<stdin>");
+		num(stdin, "<stdin>");
 	else
 		for (i = 1; i < argc; i++) {
-			f = open(argv[i], O_RDONLY);
-			if (f < 0)
-				panic("can't open %s: %i", argv[i], f);
+			f = fopen(argv[i], "r");
+			if (!f)
+				panic("can't open %s", argv[i]);
 			else {
 				num(f, argv[i]);
-				close(f);
+				fclose(f);
 			}
 		}
 	exit();
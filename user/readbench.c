@@ -0,0 +1,44 @@
+// Sequential read benchmark: reads a file from start to end and
+// reports the cost per kilobyte and the disk commands it caused.
+// The first run after boot reads from the disk; later runs mostly hit
+// the file server's block cache.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+char buf[8192];
+
+void
+umain(int argc, char **argv)
+{
+	int fd, n;
+	uint32_t total;
+	uint64_t start, cycles;
+	struct FsStats before, after;
+
+	binaryname = "readbench";
+	if (argc != 2) {
+		printf("usage: readbench file\n");
+		exit();
+	}
+	if ((fd = open(argv[1], O_RDONLY)) < 0)
+		panic("open %s: %i", argv[1], fd);
+
+	fsstats(&before);
+	start = read_tsc();
+	for (total = 0; (n = read(fd, buf, sizeof buf)) > 0; total += n)
+		/* do nothing */;
+	cycles = read_tsc() - start;
+	fsstats(&after);
+	if (n < 0)
+		panic("read %s: %i", argv[1], n);
+	close(fd);
+
+	printf("%u bytes, %u cycles/KB\n", total,
+	       (uint32_t) (cycles / MAX(total / 1024, 1)));
+	printf("disk commands: %u DMA, %u PIO, %u virtio; %u blocks read ahead\n",
+	       after.fs_ide_dma - before.fs_ide_dma,
+	       after.fs_ide_pio - before.fs_ide_pio,
+	       after.fs_vblk_reqs - before.fs_vblk_reqs,
+	       after.fs_bc_prefetched - before.fs_bc_prefetched);
+}
@@ -0,0 +1,121 @@
+// Test delayed block allocation: two files appended to at the same time
+// come out whole and in few runs of disk blocks, data is readable
+// before it has disk blocks, and truncation drops waiting blocks.
+
+#include <inc/lib.h>
+
+#define NBLOCKS		32
+
+static char buf[BLKSIZE];
+
+static char
+pattern(int file, off_t off)
+{
+	return (off / BLKSIZE) * 7 + off + file;
+}
+
+static void
+fill(int file, off_t off)
+{
+	int i;
+
+	for (i = 0; i < BLKSIZE; i++)
+		buf[i] = pattern(file, off + i);
+}
+
+static void
+check(const char *path, int file)
+{
+	struct Stat st;
+	off_t off;
+	int fd, i, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %i", path, fd);
+	if ((r = fstat(fd, &st)) < 0 || st.st_size != NBLOCKS * BLKSIZE)
+		panic("%s: size %d", path, st.st_size);
+	for (off = 0; off < NBLOCKS * BLKSIZE; off += BLKSIZE) {
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("%s: read at %d: %i", path, off, r);
+		for (i = 0; i < BLKSIZE; i++)
+			if (buf[i] != pattern(file, off + i))
+				panic("%s: byte %d is wrong", path, off + i);
+	}
+	close(fd);
+}
+
+// Append NBLOCKS blocks to 'path' a block at a time, giving the other
+// writer a turn after each, and check them before closing the file.
+static void
+writer(const char *path, int file)
+{
+	off_t off;
+	int fd, r;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %i", path, fd);
+	for (off = 0; off < NBLOCKS * BLKSIZE; off += BLKSIZE) {
+		fill(file, off);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write %s: %i", path, r);
+		sys_yield();
+	}
+	check(path, file);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st0, st1;
+	envid_t a, b;
+	int fd, i, r;
+
+	fsstats(&st0);
+	if ((a = fork()) < 0)
+		panic("fork: %i", a);
+	if (a == 0) {
+		writer("/testdelalloc.a", 0);
+		exit();
+	}
+	if ((b = fork()) < 0)
+		panic("fork: %i", b);
+	if (b == 0) {
+		writer("/testdelalloc.b", 1);
+		exit();
+	}
+	wait(a);
+	wait(b);
+	fsstats(&st1);
+
+	check("/testdelalloc.a", 0);
+	check("/testdelalloc.b", 1);
+	cprintf("%u blocks allocated late, in %u runs\n",
+		st1.fs_delayed - st0.fs_delayed,
+		st1.fs_delay_runs - st0.fs_delay_runs);
+	if (st1.fs_delayed - st0.fs_delayed < 2 * NBLOCKS)
+		panic("only %d blocks were allocated late",
+		      st1.fs_delayed - st0.fs_delayed);
+	if (st1.fs_delay_runs - st0.fs_delay_runs > 8)
+		panic("two files took %d runs", st1.fs_delay_runs - st0.fs_delay_runs);
+
+	// Blocks cut off before they had disk blocks read back as zeros.
+	if ((fd = open("/testdelalloc.a", O_RDWR | O_TRUNC)) < 0)
+		panic("open: %i", fd);
+	memset(buf, 'x', BLKSIZE);
+	for (i = 0; i < 3; i++)
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %i", r);
+	if ((r = ftruncate(fd, BLKSIZE)) < 0 || (r = ftruncate(fd, 3 * BLKSIZE)) < 0)
+		panic("ftruncate: %i", r);
+	if ((r = pread(fd, buf, BLKSIZE, 2 * BLKSIZE)) != BLKSIZE)
+		panic("pread: %i", r);
+	for (i = 0; i < BLKSIZE; i++)
+		if (buf[i] != 0)
+			panic("byte %d of a truncated block is %02x", 2 * BLKSIZE + i, buf[i]);
+	close(fd);
+
+	remove("/testdelalloc.a");
+	remove("/testdelalloc.b");
+	cprintf("testdelalloc OK\n");
+}
@@ -0,0 +1,124 @@
+// Test O_DIRECT: a file streamed in and out with it goes between the
+// disk and our pages without filling the block cache, and reads and
+// writes of blocks that are cached anyway see what the cache holds.
+
+#include <inc/lib.h>
+
+#define FILE		"/testdirect"
+#define NBLOCKS		128
+#define CHUNK		(16 * BLKSIZE)
+
+static char buf[CHUNK];
+
+static char
+pattern(off_t off, int gen)
+{
+	return (off / BLKSIZE) * 3 + off + gen;
+}
+
+static void
+fill(off_t off, size_t n, int gen)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = pattern(off + i, gen);
+}
+
+static void
+check(const char *what, off_t off, size_t n, int gen)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (buf[i] != pattern(off + i, gen))
+			panic("%s: byte %d is %02x, want %02x", what, off + i,
+			      buf[i], pattern(off + i, gen));
+}
+
+static void
+stats(struct FsStats *st)
+{
+	int r;
+
+	if ((r = fsstats(st)) < 0)
+		panic("fsstats: %i", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st0, st1;
+	off_t off;
+	int fd, fd2, r;
+
+	// Stream the file out.
+	stats(&st0);
+	if ((fd = open(FILE, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT)) < 0)
+		panic("open %s: %i", FILE, fd);
+	for (off = 0; off < NBLOCKS * BLKSIZE; off += CHUNK) {
+		fill(off, CHUNK, 0);
+		if ((r = write(fd, buf, CHUNK)) != CHUNK)
+			panic("write at %d: %i", off, r);
+	}
+	close(fd);
+	stats(&st1);
+	cprintf("wrote %u blocks directly, cache went from %u to %u blocks\n",
+		st1.fs_direct - st0.fs_direct, st0.fs_bc_resident,
+		st1.fs_bc_resident);
+	if (st1.fs_direct - st0.fs_direct < NBLOCKS)
+		panic("only %d blocks were written directly",
+		      st1.fs_direct - st0.fs_direct);
+	if (st1.fs_bc_resident > st0.fs_bc_resident + NBLOCKS / 8)
+		panic("writing cached %d blocks",
+		      st1.fs_bc_resident - st0.fs_bc_resident);
+
+	// And back in.
+	if ((fd = open(FILE, O_RDONLY | O_DIRECT)) < 0)
+		panic("open %s: %i", FILE, fd);
+	stats(&st0);
+	for (off = 0; off < NBLOCKS * BLKSIZE; off += CHUNK) {
+		if ((r = readn(fd, buf, CHUNK)) != CHUNK)
+			panic("read at %d: %i", off, r);
+		check("direct read", off, CHUNK, 0);
+	}
+	stats(&st1);
+	close(fd);
+	if (st1.fs_direct - st0.fs_direct < NBLOCKS)
+		panic("only %d blocks were read directly",
+		      st1.fs_direct - st0.fs_direct);
+	if (st1.fs_bc_resident > st0.fs_bc_resident + NBLOCKS / 8)
+		panic("reading cached %d blocks",
+		      st1.fs_bc_resident - st0.fs_bc_resident);
+	cprintf("direct transfers are good\n");
+
+	// A block written through the cache, and not on disk yet, reads
+	// back directly as written.
+	if ((fd = open(FILE, O_RDWR)) < 0)
+		panic("open %s: %i", FILE, fd);
+	fill(3 * BLKSIZE, BLKSIZE, 1);
+	if ((r = pwrite(fd, buf, BLKSIZE, 3 * BLKSIZE)) != BLKSIZE)
+		panic("pwrite: %i", r);
+	// And block 5, now cached, is seen as it is written directly.
+	if ((r = pread(fd, buf, BLKSIZE, 5 * BLKSIZE)) != BLKSIZE)
+		panic("pread: %i", r);
+
+	if ((fd2 = open(FILE, O_RDWR | O_DIRECT)) < 0)
+		panic("open %s: %i", FILE, fd2);
+	if ((r = pread(fd2, buf, 4 * BLKSIZE, 2 * BLKSIZE)) != 4 * BLKSIZE)
+		panic("pread direct: %i", r);
+	check("block 2", 2 * BLKSIZE, BLKSIZE, 0);
+	memmove(buf, buf + BLKSIZE, BLKSIZE);
+	check("cached block 3", 3 * BLKSIZE, BLKSIZE, 1);
+	fill(5 * BLKSIZE, BLKSIZE, 2);
+	if ((r = pwrite(fd2, buf, BLKSIZE, 5 * BLKSIZE)) != BLKSIZE)
+		panic("pwrite direct: %i", r);
+	if ((r = pread(fd, buf, BLKSIZE, 5 * BLKSIZE)) != BLKSIZE)
+		panic("pread: %i", r);
+	check("cached block 5", 5 * BLKSIZE, BLKSIZE, 2);
+	close(fd2);
+	close(fd);
+
+	remove(FILE);
+	cprintf("testdirect OK\n");
+}
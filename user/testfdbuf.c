@@ -0,0 +1,102 @@
+// Test client-side file buffering: small reads and writes cost few
+// requests, data written is seen by readers once it is flushed by
+// seek, fstat, fork or close, and O_NOBUF turns buffering off.
+
+#include <inc/lib.h>
+
+#define FILE	"/testfdbuf"
+#define SIZE	5000
+
+static uint32_t
+nreqs(void)
+{
+	struct FsStats st;
+	int r;
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %i", r);
+	return st.fs_reqs;
+}
+
+static void
+check_file(const char *what, size_t size)
+{
+	struct Stat st;
+	char c;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("%s: open: %i", what, fd);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("%s: fstat: %i", what, r);
+	if (st.st_size != size)
+		panic("%s: size %d, want %d", what, st.st_size, size);
+	for (i = 0; i < size; i++) {
+		if ((r = read(fd, &c, 1)) != 1)
+			panic("%s: read at %d: %i", what, i, r);
+		if (c != 'a' + i % 26)
+			panic("%s: byte %d is %c", what, i, c);
+	}
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t before, n;
+	envid_t child;
+	char c;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open: %i", fd);
+	before = nreqs();
+	for (i = 0; i < SIZE; i++) {
+		c = 'a' + i % 26;
+		if ((r = write(fd, &c, 1)) != 1)
+			panic("write: %i", r);
+	}
+	n = nreqs() - before;
+	// fsstats itself is a request.
+	if (n > 3)
+		panic("%d one-byte writes took %d requests", SIZE, n - 1);
+
+	// Another reader sees what is left in the buffer once a fork
+	// writes it out.
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		check_file("child", SIZE);
+		exit();
+	}
+	wait(child);
+
+	seek(fd, 0);
+	before = nreqs();
+	for (i = 0; i < SIZE; i++) {
+		if ((r = read(fd, &c, 1)) != 1)
+			panic("read at %d: %i", i, r);
+		if (c != 'a' + i % 26)
+			panic("byte %d is %c", i, c);
+	}
+	if ((r = read(fd, &c, 1)) != 0)
+		panic("read at end of file: %i", r);
+	n = nreqs() - before;
+	if (n > 6)
+		panic("%d one-byte reads took %d requests", SIZE, n - 1);
+	close(fd);
+
+	// Unbuffered writes each go to the file server.
+	if ((fd = open(FILE, O_WRONLY | O_NOBUF)) < 0)
+		panic("open O_NOBUF: %i", fd);
+	before = nreqs();
+	for (i = 0; i < 10; i++)
+		if ((r = write(fd, "x", 1)) != 1)
+			panic("unbuffered write: %i", r);
+	if ((n = nreqs() - before) != 11)
+		panic("10 unbuffered writes took %d requests", n - 1);
+	close(fd);
+
+	remove(FILE);
+	cprintf("testfdbuf OK\n");
+}
@@ -0,0 +1,100 @@
+// Test that the file server serves several clients at once: readers
+// scanning a large file and a writer filling another one run side by
+// side, and every reader sees the right data.  How many requests had
+// to wait for the disk is printed at the end.
+
+#include <inc/lib.h>
+
+#define BIGFILE		"/testfsconc.big"
+#define LOGFILE		"/testfsconc.log"
+#define BIGSIZE		(128 * BLKSIZE)
+#define NREADERS	4
+#define CHUNK		(4 * PGSIZE)
+
+static char buf[CHUNK];
+
+static char
+pattern(off_t off)
+{
+	return (off / BLKSIZE) ^ (off * 13);
+}
+
+static void
+reader(int id)
+{
+	off_t off;
+	int fd, i, r;
+
+	if ((fd = open(BIGFILE, O_RDONLY)) < 0)
+		panic("reader %d: open: %i", id, fd);
+	// Start at different places, so the readers miss different blocks.
+	for (i = 0; i < BIGSIZE / CHUNK; i++) {
+		off = ((i + id * 8) % (BIGSIZE / CHUNK)) * CHUNK;
+		if ((r = pread(fd, buf, CHUNK, off)) != CHUNK)
+			panic("reader %d: pread at %d: %i", id, off, r);
+		for (r = 0; r < CHUNK; r++)
+			if (buf[r] != pattern(off + r))
+				panic("reader %d: byte %d is %02x", id, off + r,
+				      buf[r] & 0xFF);
+	}
+	close(fd);
+}
+
+static void
+writer(void)
+{
+	struct Stat st;
+	int fd, i, r;
+
+	if ((fd = open(LOGFILE, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("writer: open: %i", fd);
+	for (i = 0; i < 64; i++)
+		if ((r = fprintf(fd, "line %d\n", i)) < 0)
+			panic("writer: fprintf: %i", r);
+	close(fd);
+	if ((r = stat(LOGFILE, &st)) < 0)
+		panic("writer: stat: %i", r);
+	if (st.st_size != 10 * 7 + 54 * 8)
+		panic("writer: log has size %d", st.st_size);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NREADERS + 1];
+	struct FsStats st;
+	int fd, i, r;
+
+	if ((fd = open(BIGFILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %i", BIGFILE, fd);
+	for (i = 0; i < BIGSIZE; i += CHUNK) {
+		for (r = 0; r < CHUNK; r++)
+			buf[r] = pattern(i + r);
+		if ((r = write(fd, buf, CHUNK)) != CHUNK)
+			panic("write: %i", r);
+	}
+	close(fd);
+	sync();
+
+	for (i = 0; i <= NREADERS; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0) {
+			if (i < NREADERS)
+				reader(i);
+			else
+				writer();
+			exit();
+		}
+	}
+	for (i = 0; i <= NREADERS; i++)
+		wait(kids[i]);
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %i", r);
+	cprintf("requests %u, %u waited for the disk\n", st.fs_reqs,
+		st.fs_reqs_parked);
+	remove(BIGFILE);
+	remove(LOGFILE);
+	cprintf("testfsconc OK\n");
+}
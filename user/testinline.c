@@ -0,0 +1,153 @@
+// Test inline files: a small file has no block to map but reads back
+// whole, its shrunk tail reads as zeros, and it moves out to a block,
+// data and all, when it grows or is mapped for writing or shared.
+
+#include <inc/lib.h>
+
+#define FILE		"/testinline"
+#define MSG		"hello, inline world\n"
+#define BIGSIZE		3000
+
+static uint32_t
+npromoted(void)
+{
+	struct FsStats st;
+	int r;
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %i", r);
+	return st.fs_promoted;
+}
+
+// Check that byte i of FILE is what the steps below leave there.
+static void
+check_byte(const char *what, const char *p, int i, bool grown)
+{
+	char want;
+
+	if (i < 5)
+		want = MSG[i];
+	else if (i < strlen(MSG) || !grown)
+		want = 0;
+	else
+		want = 'x';
+	if (p[i] != want)
+		panic("%s: byte %d is %02x, want %02x", what, i, p[i], want);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char buf[BIGSIZE], *p;
+	void *blk, *va;
+	uint32_t n0;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = write(fd, MSG, strlen(MSG))) != strlen(MSG))
+		panic("write: %i", r);
+	close(fd);
+
+	// The data is in the file's directory entry, not in a block.
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = read_map(fd, 0, &blk)) != -E_NOT_SUPP)
+		panic("read_map of a small file: %i", r);
+	if ((r = readn(fd, buf, sizeof(buf))) != strlen(MSG))
+		panic("read %d bytes, want %d", r, strlen(MSG));
+	if (memcmp(buf, MSG, strlen(MSG)) != 0)
+		panic("read back \"%.*s\"", r, buf);
+	close(fd);
+
+	// What is cut off comes back as zeros.
+	if ((fd = open(FILE, O_RDWR)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = ftruncate(fd, 5)) < 0 || (r = ftruncate(fd, strlen(MSG))) < 0)
+		panic("ftruncate: %i", r);
+	if ((r = pread(fd, buf, sizeof(buf), 0)) != strlen(MSG))
+		panic("pread: %i", r);
+	for (i = 0; i < r; i++)
+		check_byte("after truncating", buf, i, 0);
+
+	// Private mappings get a copy.
+	if ((r = mmap(fd, 0, PGSIZE, PROT_READ, MAP_PRIVATE, &va)) < 0)
+		panic("mmap: %i", r);
+	p = va;
+	for (i = 0; i < PGSIZE; i++)
+		check_byte("private mapping", p, i, 0);
+	if ((r = munmap(va, PGSIZE)) < 0)
+		panic("munmap: %i", r);
+	cprintf("inline reads are good\n");
+
+	// Growing moves the data to a block.
+	n0 = npromoted();
+	memset(buf, 'x', sizeof(buf));
+	if ((r = pwrite(fd, buf, BIGSIZE - strlen(MSG), strlen(MSG)))
+	    != BIGSIZE - strlen(MSG))
+		panic("pwrite: %i", r);
+	close(fd);
+	if (npromoted() != n0 + 1)
+		panic("growing promoted %d files", npromoted() - n0);
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = read_map(fd, 0, &blk)) != BIGSIZE)
+		panic("read_map of a grown file: %i", r);
+	for (i = 0; i < BIGSIZE; i++)
+		check_byte("after growing", blk, i, 1);
+	close(fd);
+	cprintf("inline growth is good\n");
+
+	// So does mapping it to write through.  Files that got blocks keep
+	// them, so start from a new file.
+	if ((r = remove(FILE)) < 0)
+		panic("remove %s: %i", FILE, r);
+	if ((fd = open(FILE, O_RDWR | O_CREAT)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = write(fd, "abc", 3)) != 3)
+		panic("write: %i", r);
+	n0 = npromoted();
+	if ((r = mmap(fd, 0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, &va)) < 0)
+		panic("mmap shared: %i", r);
+	p = va;
+	if (memcmp(p, "abc", 3) != 0)
+		panic("shared mapping has \"%.3s\"", p);
+	p[0] = 'X';
+	if ((r = msync(va, PGSIZE)) < 0)
+		panic("msync: %i", r);
+	if ((r = munmap(va, PGSIZE)) < 0)
+		panic("munmap: %i", r);
+	if (npromoted() != n0 + 1)
+		panic("mapping promoted %d files", npromoted() - n0);
+	if ((r = pread(fd, buf, sizeof(buf), 0)) != 3 || memcmp(buf, "Xbc", 3) != 0)
+		panic("after writing through a mapping: %i \"%.*s\"", r, MAX(r, 0), buf);
+	close(fd);
+
+	// And so does a shared mapping that only reads, which must see
+	// what is written to the file afterwards.
+	if ((r = remove(FILE)) < 0)
+		panic("remove %s: %i", FILE, r);
+	if ((fd = open(FILE, O_RDWR | O_CREAT | O_NOBUF)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = write(fd, "abc", 3)) != 3)
+		panic("write: %i", r);
+	n0 = npromoted();
+	if ((r = mmap(fd, 0, PGSIZE, PROT_READ, MAP_SHARED, &va)) < 0)
+		panic("mmap shared read-only: %i", r);
+	p = va;
+	if (memcmp(p, "abc", 3) != 0)
+		panic("shared read-only mapping has \"%.3s\"", p);
+	if (npromoted() != n0 + 1)
+		panic("sharing promoted %d files", npromoted() - n0);
+	if ((r = pwrite(fd, "XY", 2, 1)) != 2)
+		panic("pwrite: %i", r);
+	if (memcmp(p, "aXY", 3) != 0)
+		panic("shared mapping missed a write: \"%.3s\"", p);
+	if ((r = munmap(va, PGSIZE)) < 0)
+		panic("munmap: %i", r);
+	close(fd);
+	cprintf("inline mappings are good\n");
+
+	remove(FILE);
+	cprintf("testinline OK\n");
+}
@@ -0,0 +1,72 @@
+// Test the metadata journal: creating many small files commits their
+// metadata to the log in a few large transactions rather than one per
+// file, and sync writes the log in place.
+
+#include <inc/lib.h>
+
+#define DIR		"/testjournal"
+#define NFILES		100
+
+static void
+stats(struct FsStats *st)
+{
+	int r;
+
+	if ((r = fsstats(st)) < 0)
+		panic("fsstats: %i", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st0, st1, st2;
+	char path[MAXPATHLEN], buf[64], want[64];
+	int i, fd, r, n;
+
+	if ((fd = open(DIR, O_RDONLY | O_MKDIR | O_CREAT)) < 0)
+		panic("mkdir: %i", fd);
+	close(fd);
+
+	stats(&st0);
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), DIR "/%d", i);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+			panic("create %s: %i", path, fd);
+		n = snprintf(buf, sizeof(buf), "file %d\n", i);
+		if ((r = write(fd, buf, n)) != n)
+			panic("write %s: %i", path, r);
+		close(fd);
+	}
+	stats(&st1);
+	cprintf("%d files: %u commits of %u blocks\n", NFILES,
+		st1.fs_jcommits - st0.fs_jcommits,
+		st1.fs_jblocks - st0.fs_jblocks);
+	if (st1.fs_jcommits - st0.fs_jcommits > NFILES / 10)
+		panic("%d files took %d commits", NFILES,
+		      st1.fs_jcommits - st0.fs_jcommits);
+
+	if ((r = sync()) < 0)
+		panic("sync: %i", r);
+	stats(&st2);
+	if (st2.fs_jcheckpoints == st1.fs_jcheckpoints)
+		panic("sync did not write the log in place");
+	if (st2.fs_jcommits == st0.fs_jcommits)
+		panic("no metadata went through the journal");
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), DIR "/%d", i);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			panic("open %s: %i", path, fd);
+		n = snprintf(want, sizeof(want), "file %d\n", i);
+		if ((r = readn(fd, buf, sizeof(buf))) != n
+		    || memcmp(buf, want, n) != 0)
+			panic("%s: read %i \"%.*s\"", path, r, MAX(r, 0), buf);
+		close(fd);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %i", path, r);
+	}
+	if ((r = remove(DIR)) < 0)
+		panic("remove %s: %i", DIR, r);
+
+	cprintf("testjournal OK\n");
+}
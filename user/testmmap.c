@@ -0,0 +1,93 @@
+// Test mmap: shared mappings write through to the file, private
+// mappings do not, mappings outlive the file descriptor, and the file
+// cannot be shrunk from under them.
+
+#include <inc/lib.h>
+
+#define FILE	"/testmmap"
+#define NPAGES	3
+
+static void
+check_file(const char *what, char c)
+{
+	char buf[512];
+	int fd, i, n;
+	off_t off;
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %i", FILE, fd);
+	for (off = 0; (n = read(fd, buf, sizeof buf)) > 0; off += n)
+		for (i = 0; i < n; i++)
+			if (buf[i] != c)
+				panic("%s: byte %d is %02x, want %02x",
+				      what, off + i, buf[i], c);
+	if (n < 0)
+		panic("read %s: %i", FILE, n);
+	if (off != NPAGES * PGSIZE - 100)
+		panic("%s: read %d bytes", what, off);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char buf[PGSIZE], *p;
+	void *va;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %i", FILE, fd);
+	memset(buf, 'a', sizeof buf);
+	for (i = 0; i < NPAGES * PGSIZE - 100; i += r)
+		if ((r = write(fd, buf, MIN(sizeof buf, NPAGES * PGSIZE - 100 - i))) <= 0)
+			panic("write: %i", r);
+
+	// Shared mapping, used after the fd is closed.
+	if ((r = mmap(fd, 0, NPAGES * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, &va)) < 0)
+		panic("mmap shared: %i", r);
+	close(fd);
+	p = va;
+	for (i = 0; i < NPAGES * PGSIZE - 100; i++)
+		if (p[i] != 'a')
+			panic("shared mapping: byte %d is %02x", i, p[i]);
+	for (i = NPAGES * PGSIZE - 100; i < NPAGES * PGSIZE; i++)
+		if (p[i] != 0)
+			panic("shared mapping: byte %d past the end is %02x", i, p[i]);
+	memset(p, 'b', NPAGES * PGSIZE - 100);
+	if ((r = msync(va, NPAGES * PGSIZE)) < 0)
+		panic("msync: %i", r);
+	check_file("msync", 'b');
+
+	// The mapped blocks cannot be freed from under us.
+	if ((fd = open(FILE, O_RDWR)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = ftruncate(fd, PGSIZE)) != -E_BUSY)
+		panic("truncating a mapped file: got %i, want %i", r, -E_BUSY);
+	close(fd);
+	if ((r = remove(FILE)) != -E_BUSY)
+		panic("removing a mapped file: got %i, want %i", r, -E_BUSY);
+	check_file("truncate", 'b');
+	if ((r = munmap(va, NPAGES * PGSIZE)) < 0)
+		panic("munmap: %i", r);
+	cprintf("mmap shared is good\n");
+
+	// Private mapping: writes stay with us.
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = mmap(fd, PGSIZE, 2 * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, &va)) < 0)
+		panic("mmap private: %i", r);
+	p = va;
+	if (p[0] != 'b')
+		panic("private mapping: byte 0 is %02x", p[0]);
+	memset(p, 'c', PGSIZE);
+	if (p[0] != 'c')
+		panic("private mapping: write lost");
+	if ((r = munmap(va, 2 * PGSIZE)) < 0)
+		panic("munmap: %i", r);
+	close(fd);
+	check_file("private", 'b');
+	cprintf("mmap private is good\n");
+
+	if ((r = remove(FILE)) < 0)
+		panic("remove %s: %i", FILE, r);
+}
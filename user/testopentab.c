@@ -0,0 +1,79 @@
+// Test the file server's open-file table: one environment cannot hold
+// more than MAXOPEN_ENV files open, others can open files while it
+// does, and the entries it closes are reused.
+
+#include <inc/lib.h>
+
+#define FILE		"/motd"
+#define FVA		((char *) 0x4000000)
+
+// Open FILE by hand, receiving its Fd page at page i after FVA, so that
+// we are not limited to the descriptors the FD layer has.
+static int
+xopen(int i)
+{
+	extern union Fsipc fsipcbuf;
+	envid_t fsenv;
+
+	strcpy(fsipcbuf.open.req_path, FILE);
+	fsipcbuf.open.req_omode = O_RDONLY;
+
+	fsenv = ipc_find_env(ENV_TYPE_FS);
+	ipc_send(fsenv, FSREQ_OPEN, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	return ipc_recv(NULL, FVA + i * PGSIZE, NULL);
+}
+
+static void
+open_files(void)
+{
+	int i, r;
+
+	for (i = 0; i < MAXOPEN_ENV; i++)
+		if ((r = xopen(i)) < 0)
+			panic("open %d of %d: %i", i, MAXOPEN_ENV, r);
+}
+
+static void
+close_files(void)
+{
+	int i, r;
+
+	for (i = 0; i < MAXOPEN_ENV; i++)
+		if ((r = sys_page_unmap(0, FVA + i * PGSIZE)) < 0)
+			panic("sys_page_unmap: %i", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int fd, r;
+
+	open_files();
+	if ((r = xopen(MAXOPEN_ENV)) != -E_MAX_OPEN)
+		panic("open past the limit: got %i, want %i", r, -E_MAX_OPEN);
+	cprintf("open files are limited to %d\n", MAXOPEN_ENV);
+
+	// Someone else is not held back by our files.
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		close_files();
+		if ((fd = open(FILE, O_RDONLY)) < 0)
+			panic("child open: %i", fd);
+		close(fd);
+		exit();
+	}
+	wait(child);
+	cprintf("other environments can open files\n");
+
+	// Closing them makes room again.
+	close_files();
+	open_files();
+	close_files();
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open after closing: %i", fd);
+	close(fd);
+
+	cprintf("testopentab OK\n");
+}
@@ -0,0 +1,79 @@
+// Test positional and vectored file I/O: pread and pwrite leave the
+// seek position alone, large reads and writes span several pages, and
+// readv and writev scatter and gather across buffers.
+
+#include <inc/lib.h>
+
+#define FILE	"/testpio"
+#define SIZE	(20 * PGSIZE + 123)
+
+static char buf[SIZE], buf2[SIZE];
+
+static void
+check(const char *what, const char *p, size_t n, off_t off)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (p[i] != (char) ((off + i) * 7))
+			panic("%s: byte %d is %02x", what, off + i, p[i] & 0xFF);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct iovec iov[3];
+	int fd, i, r;
+
+	for (i = 0; i < SIZE; i++)
+		buf[i] = i * 7;
+
+	if ((fd = open(FILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %i", FILE, fd);
+	if ((r = write(fd, buf, SIZE)) != SIZE)
+		panic("write: %i", r);
+	if ((r = pread(fd, buf2, 100, 0)) != 0)
+		panic("pread at end of file: %i", r);
+	seek(fd, 0);
+	if ((r = readn(fd, buf2, SIZE)) != SIZE)
+		panic("readn: %i", r);
+	check("readn", buf2, SIZE, 0);
+
+	memset(buf2, 0, sizeof buf2);
+	if ((r = pread(fd, buf2, 3 * PGSIZE, 5000)) != 3 * PGSIZE)
+		panic("pread: %i", r);
+	check("pread", buf2, 3 * PGSIZE, 5000);
+	if ((r = pwrite(fd, buf + 100, 2 * PGSIZE, 100)) != 2 * PGSIZE)
+		panic("pwrite: %i", r);
+	if ((r = read(fd, buf2, 1)) != 0)
+		panic("pread and pwrite moved the offset: %i", r);
+
+	seek(fd, 10);
+	iov[0].iov_base = buf2;
+	iov[0].iov_len = 10;
+	iov[1].iov_base = buf2 + 10;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = buf2 + 10;
+	iov[2].iov_len = SIZE;
+	if ((r = readv(fd, iov, 3)) != SIZE - 10)
+		panic("readv: %i", r);
+	check("readv", buf2, SIZE - 10, 10);
+	if ((r = read(fd, buf2, 1)) != 0)
+		panic("read after readv: %i", r);
+
+	seek(fd, SIZE);
+	iov[0].iov_base = buf;
+	iov[0].iov_len = PGSIZE + 1;
+	iov[1].iov_base = buf + PGSIZE + 1;
+	iov[1].iov_len = PGSIZE - 1;
+	if ((r = writev(fd, iov, 2)) != 2 * PGSIZE)
+		panic("writev: %i", r);
+	if ((r = pread(fd, buf2, 2 * PGSIZE, SIZE)) != 2 * PGSIZE)
+		panic("pread after writev: %i", r);
+	check("writev", buf2, 2 * PGSIZE, 0);
+	close(fd);
+
+	if ((r = remove(FILE)) < 0)
+		panic("remove %s: %i", FILE, r);
+	cprintf("pio ok\n");
+}
@@ -0,0 +1,99 @@
+// Test FSREQ_READDIR: every entry of a directory comes back once, with
+// its size and type, in far fewer requests than entries, and removed
+// entries are skipped.
+
+#include <inc/lib.h>
+
+#define DIR		"/testreaddir"
+#define NFILES		100
+
+static char buf[PGSIZE];
+static bool seen[NFILES];
+
+// Read all of DIR, checking each entry.  Returns how many there were.
+static int
+scan(int *nreqs)
+{
+	struct FsStats st0, st1;
+	struct Dirent *d;
+	int fd, n, i, k, count = 0;
+
+	if ((fd = open(DIR, O_RDONLY)) < 0)
+		panic("open %s: %i", DIR, fd);
+	memset(seen, 0, sizeof(seen));
+	fsstats(&st0);
+	while ((n = readdir(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i += d->d_reclen) {
+			d = (struct Dirent *) &buf[i];
+			if (strcmp(d->d_name, "sub") == 0) {
+				if (d->d_type != FTYPE_DIR)
+					panic("sub has type %d", d->d_type);
+				count++;
+				continue;
+			}
+			k = strtol(d->d_name + strlen("file-with-a-long-name-"), 0, 10);
+			if (k < 0 || k >= NFILES || seen[k])
+				panic("bad or repeated entry %s", d->d_name);
+			if (d->d_namelen != strlen(d->d_name) || d->d_size != k
+			    || d->d_type != FTYPE_REG)
+				panic("entry %s: namelen %d size %d type %d", d->d_name,
+				      d->d_namelen, d->d_size, d->d_type);
+			seen[k] = 1;
+			count++;
+		}
+	if (n < 0)
+		panic("readdir: %i", n);
+	fsstats(&st1);
+	*nreqs = st1.fs_reqs - st0.fs_reqs - 1;
+	close(fd);
+	return count;
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	int i, fd, r, nreqs;
+
+	if ((fd = open(DIR, O_RDONLY | O_MKDIR | O_CREAT)) < 0)
+		panic("mkdir: %i", fd);
+	close(fd);
+	if ((fd = open(DIR "/sub", O_RDONLY | O_MKDIR | O_CREAT)) < 0)
+		panic("mkdir sub: %i", fd);
+	close(fd);
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), DIR "/file-with-a-long-name-%d", i);
+		if ((fd = open(path, O_WRONLY | O_CREAT)) < 0)
+			panic("create %s: %i", path, fd);
+		if ((r = ftruncate(fd, i)) < 0)
+			panic("ftruncate: %i", r);
+		close(fd);
+	}
+
+	if ((r = scan(&nreqs)) != NFILES + 1)
+		panic("found %d entries, want %d", r, NFILES + 1);
+	// A page holds over 100 of these entries, where reading the raw
+	// struct Files would take seven pages.
+	if (nreqs > 3)
+		panic("listing %d entries took %d requests", NFILES + 1, nreqs);
+
+	// An open file stays put.
+	if ((fd = open(DIR "/file-with-a-long-name-0", O_RDONLY)) < 0)
+		panic("open: %i", fd);
+	if ((r = remove(DIR "/file-with-a-long-name-0")) != -E_BUSY)
+		panic("removing an open file: got %i, want %i", r, -E_BUSY);
+	close(fd);
+
+	for (i = 0; i < NFILES; i += 2) {
+		snprintf(path, sizeof(path), DIR "/file-with-a-long-name-%d", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %i", path, r);
+	}
+	if ((r = scan(&nreqs)) != NFILES / 2 + 1)
+		panic("found %d entries after removing, want %d", r, NFILES / 2 + 1);
+	for (i = 1; i < NFILES; i += 2)
+		if (!seen[i])
+			panic("file %d missing", i);
+
+	cprintf("testreaddir OK\n");
+}
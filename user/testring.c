@@ -0,0 +1,97 @@
+// Test the file server request ring: requests queued together are run
+// in one wakeup, replies land in the slot pages, and a forked child
+// gets its own ring.
+
+#include <inc/lib.h>
+
+#define NFILES	6
+
+static void
+check_sizes(const char *who)
+{
+	char name[32];
+	struct Stat st;
+	int i, r;
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(name, sizeof name, "/testring.%s.%d", who, i);
+		if ((r = stat(name, &st)) < 0)
+			panic("stat %s: %i", name, r);
+		if (st.st_size != 1000 * i)
+			panic("%s has size %d, want %d", name, st.st_size, 1000 * i);
+	}
+}
+
+static void
+run(const char *who)
+{
+	union Fsipc *req[NFILES];
+	int fd[NFILES], slot[NFILES];
+	struct Fd *f;
+	char name[32];
+	struct FsStats before, after;
+	int i, r;
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(name, sizeof name, "/testring.%s.%d", who, i);
+		if ((fd[i] = open(name, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+			panic("open %s: %i", name, fd[i]);
+	}
+
+	// Queue a size change for every file and submit them together.
+	if ((r = fsstats(&before)) < 0)
+		panic("fsstats: %i", r);
+	for (i = 0; i < NFILES; i++) {
+		if ((slot[i] = fsring_prep(FSREQ_SET_SIZE, &req[i])) < 0)
+			panic("fsring_prep: %i", slot[i]);
+		if ((r = fd_lookup(fd[i], &f)) < 0)
+			panic("fd_lookup: %i", r);
+		req[i]->set_size.req_fileid = f->fd_file.id;
+		req[i]->set_size.req_size = 1000 * i;
+	}
+	fsring_submit();
+	for (i = 0; i < NFILES; i++)
+		if ((r = fsring_wait(slot[i])) < 0)
+			panic("set_size %d: %i", i, r);
+	if ((r = fsstats(&after)) < 0)
+		panic("fsstats: %i", r);
+	if (after.fs_ring_reqs - before.fs_ring_reqs < NFILES + 1)
+		panic("%d ring requests, want at least %d",
+		      after.fs_ring_reqs - before.fs_ring_reqs, NFILES + 1);
+
+	for (i = 0; i < NFILES; i++)
+		close(fd[i]);
+	check_sizes(who);
+
+	// A request the server does not take on a ring still completes.
+	if ((slot[0] = fsring_prep(FSREQ_OPEN, &req[0])) < 0)
+		panic("fsring_prep: %i", slot[0]);
+	if ((r = fsring_wait(slot[0])) != -E_INVAL)
+		panic("open on the ring: %i", r);
+
+	for (i = 0; i < NFILES; i++) {
+		if ((slot[i] = fsring_prep(FSREQ_REMOVE, &req[i])) < 0)
+			panic("fsring_prep: %i", slot[i]);
+		snprintf(req[i]->remove.req_path, MAXPATHLEN, "/testring.%s.%d", who, i);
+	}
+	for (i = 0; i < NFILES; i++)
+		if ((r = fsring_wait(slot[i])) < 0)
+			panic("remove %d: %i", i, r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	run("parent");
+	if ((r = fork()) < 0)
+		panic("fork: %i", r);
+	if (r == 0) {
+		run("child");
+		exit();
+	}
+	wait(r);
+	run("parent");
+	cprintf("ring ok\n");
+}
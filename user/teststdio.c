@@ -0,0 +1,104 @@
+// Test buffered streams: lines written with fputs read back with fgets
+// and fread, the three buffering modes write out when they should, and
+// a stream opened for update can switch from reading to writing.
+
+#include <inc/lib.h>
+
+#define PATH		"/teststdio"
+#define NLINES		500
+
+static char buf[PGSIZE + 100];
+
+// Size of PATH as the file server sees it, once whatever the file
+// descriptor under 'f' buffers is written out.
+static off_t
+fsize(FILE *f)
+{
+	struct Stat st;
+	int r;
+
+	if ((r = fstat(fileno(f), &st)) < 0)
+		panic("fstat: %i", r);
+	return st.st_size;
+}
+
+static void
+check_mode(int mode, const char *name, off_t size_after_abc)
+{
+	FILE *f;
+
+	if (!(f = fopen(PATH, "w")))
+		panic("%s: fopen", name);
+	if (setvbuf(f, NULL, mode, 0) < 0)
+		panic("%s: setvbuf", name);
+	fputs("abc", f);
+	if (fsize(f) != size_after_abc)
+		panic("%s: size %d after \"abc\", want %d", name, fsize(f),
+		      size_after_abc);
+	fputs("\n", f);
+	if (fsize(f) != (mode == _IOFBF ? 0 : 4))
+		panic("%s: size %d after newline", name, fsize(f));
+	if (fflush(f) < 0 || fsize(f) != 4)
+		panic("%s: size %d after fflush", name, fsize(f));
+	fclose(f);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char line[64], want[64];
+	FILE *f;
+	int i, c;
+	size_t n, total;
+
+	if (!(f = fopen(PATH, "w")))
+		panic("fopen w");
+	for (i = 0; i < NLINES; i++) {
+		snprintf(line, sizeof(line), "line %d of the test\n", i);
+		if (fputs(line, f) < 0)
+			panic("fputs: %i", ferror(f));
+	}
+	if (fclose(f) < 0)
+		panic("fclose");
+
+	if (!(f = fopen(PATH, "r")))
+		panic("fopen r");
+	for (i = 0; fgets(line, sizeof(line), f); i++) {
+		snprintf(want, sizeof(want), "line %d of the test\n", i);
+		if (strcmp(line, want) != 0)
+			panic("line %d is \"%s\"", i, line);
+	}
+	if (i != NLINES || !feof(f) || ferror(f))
+		panic("read %d lines, eof %d, error %i", i, feof(f), ferror(f));
+	fclose(f);
+
+	// Reads both smaller and larger than the buffer.
+	if (!(f = fopen(PATH, "r")))
+		panic("fopen r");
+	total = fread(buf, 1, 7, f);
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		total += n;
+	if (total != fsize(f))
+		panic("fread read %d bytes of %d", total, fsize(f));
+	fclose(f);
+
+	check_mode(_IOFBF, "full", 0);
+	check_mode(_IOLBF, "line", 0);
+	check_mode(_IONBF, "none", 3);
+
+	// Write after reading, in the middle of the file.
+	if (!(f = fopen(PATH, "r+")))
+		panic("fopen r+");
+	if ((c = fgetc(f)) != 'a')
+		panic("fgetc: %c", c);
+	fputc('X', f);
+	fclose(f);
+	if (!(f = fopen(PATH, "r")) || !fgets(line, sizeof(line), f))
+		panic("reading back");
+	if (strcmp(line, "aXc\n") != 0)
+		panic("after update the file has \"%s\"", line);
+	fclose(f);
+
+	remove(PATH);
+	fputs("teststdio OK\n", stdout);
+}